@@ -0,0 +1,113 @@
+// Per-command argument vectors built on the heap vs in a parser arena,
+// alone and from several threads at once (server sessions), plus the
+// parse throughput that uses the arena.
+#include "arena.h"
+#include "lexer.h"
+#include "panic.h"
+#include "parser.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_LINES 300000
+#define BENCH_STAGES 2 // Commands per line
+#define BENCH_ARGS 6   // Arguments per command
+#define BENCH_THREADS 8
+
+static double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// @brief Build the argument vectors of BENCH_LINES lines
+/// @param arg Arena to allocate from, NULL for the heap
+static void *bench_vectors(void *arg) {
+  Arena *arena = arg;
+  Slice word = slice_from_str("argument");
+  for (size_t line = 0; line < BENCH_LINES; line++) {
+    SliceVec args[BENCH_STAGES];
+    for (size_t i = 0; i < BENCH_STAGES; i++) {
+      args[i] = arena != NULL ? slice_vec_new_in(arena) : slice_vec_new();
+      for (size_t j = 0; j < BENCH_ARGS; j++) {
+        slice_vec_push(&args[i], word);
+      }
+    }
+    for (size_t i = 0; i < BENCH_STAGES; i++) {
+      slice_vec_free(&args[i]);
+    }
+    if (arena != NULL) {
+      arena_reset(arena); // What parse_release does
+    }
+  }
+  return NULL;
+}
+
+/// @brief Run bench_vectors on n threads at once
+/// @return Seconds taken
+static double bench_threads(size_t n, bool use_arena) {
+  pthread_t threads[BENCH_THREADS];
+  Arena arenas[BENCH_THREADS];
+  double start = bench_now();
+  for (size_t i = 0; i < n; i++) {
+    arenas[i] = arena_new();
+    assertf(pthread_create(&threads[i], NULL, bench_vectors,
+                           use_arena ? &arenas[i] : NULL) == 0,
+            "pthread_create failed", NULL);
+  }
+  for (size_t i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double t = bench_now() - start;
+  for (size_t i = 0; i < n; i++) {
+    arena_free(&arenas[i]);
+  }
+  return t;
+}
+
+/// @brief Parse BENCH_LINES piped lines
+/// @return Seconds taken
+static double bench_parse(void) {
+  const char *line = "grep -n -i -e pattern file | sort -r -n -k 2 -t x\n";
+  size_t len = strlen(line);
+  char *input = malloc(len * BENCH_LINES + 1);
+  assertf(input != NULL, "malloc failed", NULL);
+  for (size_t i = 0; i < BENCH_LINES; i++) {
+    memcpy(input + i * len, line, len);
+  }
+  input[len * BENCH_LINES] = '\0';
+
+  double start = bench_now();
+  Lexer lexer = lex_new(input);
+  Parser parser = parse_new(&lexer);
+  size_t pipelines = 0;
+  while (parse_next(&parser).result == PARSE_OK) {
+    parse_release(&parser);
+    pipelines++;
+  }
+  double t = bench_now() - start;
+  parse_free(&parser);
+  lex_free(&lexer);
+  free(input);
+  assertf(pipelines == BENCH_LINES, "parse failed", NULL);
+  return t;
+}
+
+int main(void) {
+  printf("%d lines, %d commands of %d arguments each\n", BENCH_LINES,
+         BENCH_STAGES, BENCH_ARGS);
+  size_t counts[] = {1, BENCH_THREADS};
+  for (size_t i = 0; i < 2; i++) {
+    double heap = bench_threads(counts[i], false);
+    double arena = bench_threads(counts[i], true);
+    printf("%zu thread(s): heap %7.1f ms, arena %7.1f ms\n", counts[i],
+           heap * 1e3, arena * 1e3);
+  }
+  double parse = bench_parse();
+  printf("parse: %.1f ms (%.0f ns/line)\n", parse * 1e3,
+         parse * 1e9 / BENCH_LINES);
+  return 0;
+}
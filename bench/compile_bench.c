@@ -0,0 +1,104 @@
+// Loading a compiled script from the cache: a hit on the file identity,
+// a hit on the content hash (touched file) and a miss (edited file), for
+// a large script.
+#include "compile.h"
+#include "panic.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_LINES 500000
+#define BENCH_RUNS 5
+
+static double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// @brief Write the script, the last line tells versions apart
+static void bench_write(const char *path, int version) {
+  FILE *f = fopen(path, "w");
+  assertf(f != NULL, "fopen failed", NULL);
+  for (size_t i = 0; i < BENCH_LINES; i++) {
+    fprintf(f, "echo line %zu | grep -n line > /dev/null\n", i);
+  }
+  fprintf(f, "echo version %d\n", version);
+  fclose(f);
+}
+
+/// @brief Load the script the way shsh_script does, building it on a miss
+/// @return Seconds taken
+static double bench_load(const char *path, bool *hit) {
+  double start = bench_now();
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  assertf(fd != -1, "open failed", NULL);
+  struct stat st;
+  assertf(fstat(fd, &st) == 0, "fstat failed", NULL);
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  assertf(map != MAP_FAILED, "mmap failed", NULL);
+  CompiledScript cs;
+  *hit = compiled_load(&cs, path, &st, map);
+  if (!*hit) {
+    compiled_build(&cs, path, &st, map);
+  }
+  double t = bench_now() - start;
+  compiled_free(&cs);
+  munmap(map, st.st_size);
+  close(fd);
+  return t;
+}
+
+/// @brief Best of BENCH_RUNS loads, preparing the file before each
+static double bench_best(const char *path, void (*prepare)(const char *),
+                         const char *name) {
+  double best = 0;
+  bool hit = false;
+  for (size_t i = 0; i < BENCH_RUNS; i++) {
+    prepare(path);
+    double t = bench_load(path, &hit);
+    best = (i == 0 || t < best) ? t : best;
+  }
+  printf("%-8s %-4s %8.2f ms\n", name, hit ? "hit" : "miss", best * 1e3);
+  return best;
+}
+
+static void bench_keep(const char *path) { (void)path; }
+
+static void bench_touch(const char *path) {
+  assertf(utimensat(AT_FDCWD, path, NULL, 0) == 0, "utimensat failed", NULL);
+}
+
+static void bench_edit(const char *path) {
+  static int version = 1;
+  bench_write(path, version++);
+}
+
+int main(void) {
+  char cache[] = "/tmp/shsh-bench-XXXXXX";
+  assertf(mkdtemp(cache) != NULL, "mkdtemp failed", NULL);
+  setenv("XDG_CACHE_HOME", cache, 1);
+  char path[sizeof(cache) + 16];
+  snprintf(path, sizeof(path), "%s/script.sh", cache);
+
+  bench_write(path, 0);
+  sleep(2); // Let the entry be built a second after the last write
+  bool hit;
+  bench_load(path, &hit);
+
+  struct stat st;
+  assertf(stat(path, &st) == 0, "stat failed", NULL);
+  printf("%d lines, %.1f MiB\n", BENCH_LINES + 1, st.st_size / 1048576.0);
+  bench_best(path, bench_keep, "same");
+  bench_best(path, bench_touch, "touched");
+  bench_best(path, bench_edit, "edited");
+
+  char cmd[sizeof(cache) + 16];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", cache);
+  return system(cmd);
+}
@@ -0,0 +1,53 @@
+// Lexing time of one word made of N backslash escapes. Unescaping in a
+// single pass keeps the time per escape flat as N grows.
+#include "lexer.h"
+#include "panic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_RUNS 5
+
+static double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// @brief Lex a whole input
+/// @return Seconds taken
+static double bench_lex(const char *input) {
+  double start = bench_now();
+  Lexer lexer = lex_new(input);
+  Token token;
+  do {
+    token = lex_next(&lexer);
+  } while (token.type != TOKEN_EOF && token.type != TOKEN_ERROR);
+  lex_free(&lexer);
+  return bench_now() - start;
+}
+
+int main(void) {
+  const size_t sizes[] = {1000, 10000, 50000, 100000, 500000};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t n = sizes[i];
+    char *input = malloc(2 * n + 2);
+    assertf(input != NULL, "malloc failed", NULL);
+    for (size_t j = 0; j < n; j++) {
+      input[2 * j] = '\\';
+      input[2 * j + 1] = 'a' + j % 26;
+    }
+    input[2 * n] = '\n';
+    input[2 * n + 1] = '\0';
+
+    double best = bench_lex(input);
+    for (int run = 1; run < BENCH_RUNS; run++) {
+      double t = bench_lex(input);
+      best = t < best ? t : best;
+    }
+    printf("%7zu escapes: %9.3f ms  %6.1f ns/escape\n", n, best * 1e3,
+           best * 1e9 / n);
+    free(input);
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Spawning and waiting for /bin/true through posix_spawn and through
+// fork + exec, as the shell's resident memory grows.
+#include "panic.h"
+#include "procspawn.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_RUNS 300
+
+static double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// @brief Spawn and wait for /bin/true BENCH_RUNS times
+/// @return Microseconds per run
+static double bench_spawn(SpawnBackend backend) {
+  char *argv[] = {"true", NULL};
+  int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  assertf(null != -1, "open failed", NULL);
+  SpawnRequest req = {
+      .path = "/bin/true",
+      .argv = argv,
+      .stdin_fd = null,
+      .stdout_fd = null,
+      .pgid = -1,
+      .log_fd = STDERR_FILENO,
+      .dir_fd = AT_FDCWD,
+  };
+  spawn_backend = backend;
+  double start = bench_now();
+  for (size_t i = 0; i < BENCH_RUNS; i++) {
+    pid_t pid = spawn_command(&req);
+    assertf(pid != -1, "spawn failed", NULL);
+    assertf(waitpid(pid, NULL, 0) == pid, "waitpid failed", NULL);
+  }
+  double t = bench_now() - start;
+  close(null);
+  return t * 1e6 / BENCH_RUNS;
+}
+
+int main(void) {
+  const size_t sizes[] = {8, 256, 1024}; // MiB resident in the parent
+  char *held = NULL;
+  printf("%d runs of /bin/true\n", BENCH_RUNS);
+  printf("RSS       posix_spawn        fork\n");
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    free(held);
+    held = malloc(sizes[i] << 20);
+    assertf(held != NULL, "malloc failed", NULL);
+    memset(held, 1, sizes[i] << 20); // Touch it, fork copies page tables
+    double posix = bench_spawn(SPAWN_POSIX);
+    double fork = bench_spawn(SPAWN_FORK);
+    printf("%4zuMiB  %9.0f us  %9.0f us\n", sizes[i], posix, fork);
+  }
+  free(held);
+  return 0;
+}
@@ -0,0 +1,209 @@
+#include "admission.h"
+#include "panic.h"
+#include <stdlib.h>
+#include <time.h>
+
+static void admission_lock(Admission *a) {
+  assertf(pthread_mutex_lock(&a->mutex) == 0, "mutex lock failed", NULL);
+}
+
+static void admission_unlock(Admission *a) {
+  assertf(pthread_mutex_unlock(&a->mutex) == 0, "mutex unlock failed", NULL);
+}
+
+static double admission_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// @brief Is there room for n more processes of a session
+static bool admission_fits(Admission *a, AdmitSession *s, size_t n) {
+  bool global = a->global_max == 0 || a->running + n <= a->global_max ||
+                a->running == 0;
+  bool session = a->session_max == 0 || s->running + n <= a->session_max ||
+                 s->running == 0;
+  return global && session;
+}
+
+/// @brief Find the state of a session, creating it
+static AdmitSession *admission_session(Admission *a, const void *owner) {
+  for (AdmitSession *s = a->sessions; s != NULL; s = s->next) {
+    if (s->owner == owner) {
+      return s;
+    }
+  }
+  AdmitSession *s = calloc(1, sizeof(AdmitSession));
+  assertf(s != NULL, "calloc failed", NULL);
+  s->owner = owner;
+  s->next = a->sessions;
+  a->sessions = s;
+  return s;
+}
+
+/// @brief Drop the state of a session that runs and waits for nothing
+static void admission_forget(Admission *a, AdmitSession *s) {
+  if (s->running != 0 || s->want != 0) {
+    return;
+  }
+  for (AdmitSession **p = &a->sessions; *p != NULL; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+  free(s);
+}
+
+/// @brief Remove a session from the waiting ring
+static void admission_unqueue(Admission *a, AdmitSession *s) {
+  AdmitSession *prev = a->waiting;
+  while (prev->next_waiting != s) {
+    prev = prev->next_waiting;
+  }
+  if (prev == s) {
+    a->waiting = NULL; // It was the only one
+  } else {
+    prev->next_waiting = s->next_waiting;
+    if (a->waiting == s) {
+      a->waiting = s->next_waiting;
+    }
+  }
+  s->next_waiting = NULL;
+}
+
+/// @brief Admit the next queued request that fits, taking the sessions in
+/// turn
+/// @return Its session, NULL if none fits
+static AdmitSession *admission_grant(Admission *a) {
+  if (a->waiting == NULL) {
+    return NULL;
+  }
+  // One lap of the ring, from the session whose turn it is
+  AdmitSession *start = a->waiting;
+  AdmitSession *s = start;
+  while (!admission_fits(a, s, s->want)) {
+    s = s->next_waiting;
+    if (s == start) {
+      return NULL;
+    }
+  }
+
+  a->waiting = s->next_waiting; // The next session goes first next
+  admission_unqueue(a, s);
+  s->running += s->want;
+  a->running += s->want;
+  s->want = 0;
+
+  double waited = admission_now() - s->since;
+  a->stats.queued--;
+  a->stats.admitted++;
+  a->stats.waited++;
+  a->stats.wait_total += waited;
+  if (waited > a->stats.wait_max) {
+    a->stats.wait_max = waited;
+  }
+  return s;
+}
+
+/// @brief Admit queued requests while there is room, then unlock
+/// @details The callbacks run with the lock dropped.
+/// @param self Session whose request is admitted without its callback, NULL
+/// if none
+/// @return Was the request of self admitted
+/// @note Must be called with the lock held, returns with it dropped
+static bool admission_dispatch(Admission *a, AdmitSession *self) {
+  bool admitted = false;
+  AdmitSession *s;
+  while ((s = admission_grant(a)) != NULL) {
+    if (s == self) {
+      admitted = true;
+      continue;
+    }
+    AdmitFn fn = s->admitted;
+    void *arg = s->arg;
+    admission_unlock(a);
+    fn(arg);
+    admission_lock(a);
+  }
+  admission_unlock(a);
+  return admitted;
+}
+
+Admission *admission_new(size_t global_max, size_t session_max) {
+  Admission *a = calloc(1, sizeof(Admission));
+  assertf(a != NULL, "calloc failed", NULL);
+  assertf(pthread_mutex_init(&a->mutex, NULL) == 0, "mutex init failed", NULL);
+  a->global_max = global_max;
+  a->session_max = session_max;
+  return a;
+}
+
+void admission_free(Admission *a) {
+  if (a == NULL) {
+    return;
+  }
+  while (a->sessions != NULL) {
+    AdmitSession *s = a->sessions;
+    a->sessions = s->next;
+    free(s);
+  }
+  pthread_mutex_destroy(&a->mutex);
+  free(a);
+}
+
+bool admission_try(Admission *a, const void *owner, size_t n, AdmitFn fn,
+                   void *arg) {
+  if (a == NULL || n == 0) {
+    return true;
+  }
+  admission_lock(a);
+  AdmitSession *s = admission_session(a, owner);
+  assertf(s->want == 0, "admission request already queued", NULL);
+  if (a->waiting == NULL && admission_fits(a, s, n)) {
+    s->running += n;
+    a->running += n;
+    a->stats.admitted++;
+    admission_unlock(a);
+    return true;
+  }
+
+  // Queue at the end of the ring, just before the session whose turn it is
+  s->want = n;
+  s->admitted = fn;
+  s->arg = arg;
+  s->since = admission_now();
+  if (a->waiting == NULL) {
+    s->next_waiting = s;
+    a->waiting = s;
+  } else {
+    AdmitSession *last = a->waiting;
+    while (last->next_waiting != a->waiting) {
+      last = last->next_waiting;
+    }
+    last->next_waiting = s;
+    s->next_waiting = a->waiting;
+  }
+  a->stats.queued++;
+  // Room may have been left by a larger request
+  return admission_dispatch(a, s);
+}
+
+void admission_release(Admission *a, const void *owner, size_t n) {
+  if (a == NULL || n == 0) {
+    return;
+  }
+  admission_lock(a);
+  AdmitSession *s = admission_session(a, owner);
+  s->running -= n;
+  a->running -= n;
+  admission_forget(a, s);
+  admission_dispatch(a, NULL);
+}
+
+void admission_stats(Admission *a, AdmitStats *out) {
+  admission_lock(a);
+  *out = a->stats;
+  out->running = a->running;
+  admission_unlock(a);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Called once a queued request is admitted
+typedef void (*AdmitFn)(void *arg);
+
+/// @brief Per-session admission state
+typedef struct AdmitSession {
+  const void *owner;
+  size_t running;   // Admitted processes not reaped yet
+  size_t want;      // Slots of the queued request, 0 if none
+  AdmitFn admitted; // Callback of the queued request
+  void *arg;
+  double since;     // When the request was queued
+  struct AdmitSession *next; // All sessions
+  struct AdmitSession *next_waiting; // Round-robin ring of waiting sessions
+} AdmitSession;
+
+/// @brief Admission statistics
+typedef struct {
+  size_t running;
+  size_t queued;   // Requests waiting now
+  uint64_t admitted; // Requests admitted since start, waited or not
+  uint64_t waited;   // Requests that had to wait
+  double wait_total; // Seconds
+  double wait_max;
+} AdmitStats;
+
+/// @brief Concurrency limits on spawned processes
+/// @details Requests over a limit are queued instead of failing, and their
+/// session is called back once they are admitted: nothing ever waits on a
+/// thread. Sessions with a queued request take turns, so a busy session
+/// cannot starve the others.
+typedef struct {
+  pthread_mutex_t mutex;
+  size_t global_max;  // 0 for no limit
+  size_t session_max; // 0 for no limit
+  size_t running;
+  AdmitSession *sessions;
+  AdmitSession *waiting; // Next session to serve, NULL if none waits
+  AdmitStats stats;
+} Admission;
+
+/// @brief Create an admission controller
+/// @param global_max Processes of all the sessions, 0 for no limit
+/// @param session_max Processes of one session, 0 for no limit
+/// @note Allocates memory, so you must call admission_free when done
+Admission *admission_new(size_t global_max, size_t session_max);
+
+/// @brief Free an admission controller
+void admission_free(Admission *a);
+
+/// @brief Admit processes of a session now, or queue the request
+/// @details A request larger than a limit is admitted once the session (or
+/// the server) runs nothing else. A NULL controller admits everything. A
+/// session has at most one request queued.
+/// @param owner Session
+/// @param n Number of processes, all admitted at once (pipeline stages)
+/// @param fn Called once a queued request is admitted, on the thread that
+/// made room (the reaper, with the job table locked), so it must not block
+/// @param arg Argument of fn
+/// @return Is it admitted now, fn is then not called
+bool admission_try(Admission *a, const void *owner, size_t n, AdmitFn fn,
+                   void *arg);
+
+/// @brief Return the slots of processes that exited or never started
+/// @param owner Session
+/// @param n Number of processes
+void admission_release(Admission *a, const void *owner, size_t n);
+
+/// @brief Copy the statistics
+void admission_stats(Admission *a, AdmitStats *out);
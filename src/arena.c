@@ -0,0 +1,64 @@
+#include "arena.h"
+#include "panic.h"
+#include <stddef.h>
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE 4096
+
+Arena arena_new(void) { return (Arena){.head = NULL, .current = NULL}; }
+
+static ArenaBlock *arena_block_new(size_t size) {
+  size_t cap = ARENA_BLOCK_SIZE;
+  while (cap < size) {
+    cap *= 2;
+  }
+  ArenaBlock *b = malloc(sizeof(ArenaBlock) + cap);
+  assertf(b != NULL, "malloc failed", NULL);
+  b->next = NULL;
+  b->len = 0;
+  b->cap = cap;
+  return b;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  ArenaBlock *b = arena->current;
+  if (b == NULL) {
+    arena->head = arena->current = b = arena_block_new(size);
+  }
+  while (b->len + size > b->cap) {
+    if (b->next != NULL && b->next->cap >= size) {
+      // Reuse a block kept by arena_reset
+      b = b->next;
+      b->len = 0;
+    } else {
+      ArenaBlock *nb = arena_block_new(size);
+      nb->next = b->next;
+      b->next = nb;
+      b = nb;
+    }
+    arena->current = b;
+  }
+
+  void *p = (char *)b->data + b->len;
+  b->len += size;
+  return p;
+}
+
+void arena_reset(Arena *arena) {
+  arena->current = arena->head;
+  if (arena->head != NULL) {
+    arena->head->len = 0;
+  }
+}
+
+void arena_free(Arena *arena) {
+  ArenaBlock *b = arena->head;
+  while (b != NULL) {
+    ArenaBlock *next = b->next;
+    free(b);
+    b = next;
+  }
+  arena->head = arena->current = NULL;
+}
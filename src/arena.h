@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+/// @brief Arena memory block
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t len;
+  size_t cap;
+  max_align_t data[];
+} ArenaBlock;
+
+/// @brief Bump allocator
+/// @details Allocations are carved out of a chain of blocks and are only
+/// released all at once by arena_reset, which keeps the blocks for reuse.
+typedef struct {
+  ArenaBlock *head;    // first block
+  ArenaBlock *current; // block allocations are carved from
+} Arena;
+
+/// @brief Create a new empty arena
+Arena arena_new(void);
+
+/// @brief Allocate `size` bytes aligned for any type
+/// @note Panics when out of memory
+void *arena_alloc(Arena *arena, size_t size);
+
+/// @brief Release every allocation in O(1), the blocks are kept for reuse
+void arena_reset(Arena *arena);
+
+/// @brief Free the arena blocks
+void arena_free(Arena *arena);
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE // memfd_create
+#include "builtins.h"
+#include "exec.h"
+#include "fdcopy.h"
+#include "jobs.h"
+#include "log.h"
+#include "panic.h"
+#include "pathcache.h"
+#include "reaper.h"
+#include "types.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SLICE_LIT(s) ((Slice){.data = s, .len = sizeof(s) - 1})
+
+/// @brief Write a whole iovec array, resuming after short writes
+/// @return is ok
+static bool builtin_writev(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w == -1) {
+      return false;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return true;
+}
+
+static int builtin_echo(BuiltinCtx *ctx, Command *cmd) {
+  size_t start = 0;
+  bool newline = true;
+  if (cmd->args.len > 0 && slice_cmp(cmd->args.data[0], SLICE_LIT("-n")) == 0) {
+    newline = false;
+    start = 1;
+  }
+
+  // Arguments go out straight from the parser storage, a batch per syscall
+  struct iovec iov[64];
+  int n = 0;
+  for (size_t i = start; i < cmd->args.len; i++) {
+    if (i > start) {
+      iov[n++] = (struct iovec){.iov_base = " ", .iov_len = 1};
+    }
+    iov[n++] = (struct iovec){.iov_base = cmd->args.data[i].data,
+                              .iov_len = cmd->args.data[i].len};
+    if (n >= 62) {
+      if (!builtin_writev(ctx->out_fd, iov, n)) {
+        return 1;
+      }
+      n = 0;
+    }
+  }
+  if (newline) {
+    iov[n++] = (struct iovec){.iov_base = "\n", .iov_len = 1};
+  }
+  return builtin_writev(ctx->out_fd, iov, n) ? 0 : 1;
+}
+
+static int builtin_true(BuiltinCtx *ctx __attribute__((unused)),
+                        Command *cmd __attribute__((unused))) {
+  return 0;
+}
+
+static int builtin_false(BuiltinCtx *ctx __attribute__((unused)),
+                         Command *cmd __attribute__((unused))) {
+  return 1;
+}
+
+static int builtin_pwd(BuiltinCtx *ctx, Command *cmd __attribute__((unused))) {
+  char buf[PATH_MAX];
+  const char *cwd = shellctx_cwd(ctx->shell, buf, sizeof(buf));
+  if (cwd == NULL) {
+    log_error_fd(ctx->out_fd, "pwd: %s\n", strerror(errno));
+    return 1;
+  }
+  dprintf(ctx->out_fd, "%s\n", cwd);
+  return 0;
+}
+
+static int builtin_exit(BuiltinCtx *ctx, Command *cmd) {
+  ctx->exit = true;
+  return cmd->args.len > 0 ? atoi(slice_to_stack_str(cmd->args.data[0])) : 0;
+}
+
+static int builtin_wait_over(BuiltinCtx *ctx __attribute__((unused))) {
+  return 0;
+}
+
+static int builtin_wait(BuiltinCtx *ctx, Command *cmd __attribute__((unused))) {
+  if (jobs_on_idle(ctx->jobs, ctx->owner, ctx->wake, ctx->wake_arg)) {
+    return 0;
+  }
+  ctx->resume = builtin_wait_over;
+  return BUILTIN_PARKED;
+}
+
+static int builtin_cd(BuiltinCtx *ctx, Command *cmd) {
+  if (cmd->args.len == 0) {
+    log_error_fd(ctx->out_fd, "cd: missing argument\n", NULL);
+    return 1;
+  }
+  if (!shellctx_chdir(ctx->shell, slice_to_stack_str(cmd->args.data[0]))) {
+    log_error_fd(ctx->out_fd, "cd: %s: %s\n",
+                 slice_to_stack_str(cmd->args.data[0]), strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static int builtin_jobs(BuiltinCtx *ctx, Command *cmd __attribute__((unused))) {
+  jobs_print(ctx->jobs, ctx->out_fd);
+  return 0;
+}
+
+static int builtin_hash(BuiltinCtx *ctx, Command *cmd) {
+  if (cmd->args.len == 0) {
+    pathcache_print(ctx->shell, ctx->out_fd);
+  }
+  int code = 0;
+  for (size_t i = 0; i < cmd->args.len; i++) {
+    char *name = slice_to_stack_str(cmd->args.data[i]);
+    char path[PATH_MAX];
+    if (strcmp(name, "-r") == 0) {
+      pathcache_clear();
+    } else if (!pathcache_lookup(ctx->shell, name, path, sizeof(path))) {
+      log_error_fd(ctx->out_fd, "hash: %s: not found\n", name);
+      code = 1;
+    }
+  }
+  return code;
+}
+
+#define PAR_JOBS_MAX 1024 // Largest N of `par -j N`
+
+typedef struct ParState ParState;
+
+/// @brief Instance slot of `par`
+typedef struct {
+  ParState *par;
+  bool used;
+  JobId job;
+  int out; // memfd collecting the instance's stdout
+  bool ok; // It exited with 0, once done
+} ParRun;
+
+/// @brief State of a running `par`, kept while the builtin is parked
+/// @details The callbacks (instance done, admitted, output copied) only
+/// touch the fields marked below, under the mutex, and wake the command
+/// line before unlocking: once the builtin sees nothing pending under the
+/// mutex, no callback can still use the state.
+struct ParState {
+  pthread_mutex_t mutex;
+  BuiltinCtx *ctx;
+  Slice *tmpl; // Command and its fixed arguments
+  size_t tmpl_len;
+  Slice *inputs;
+  size_t ninputs;
+  size_t next; // Next input to start
+  char *buf;   // Storage of the inputs read from a file
+  SliceVec read_inputs;
+  int null_fd; // stdin of the instances
+  ParRun *runs;
+  size_t nruns;   // Slots, at most N instances at a time
+  size_t running; // Slots in use, output not written yet
+  bool queued;    // An admission request is queued
+  bool failed;
+
+  // Written by the callbacks
+  ParRun **finished; // Done instances, in order, nruns at most
+  size_t finished_head;
+  size_t finished_len;
+  bool admitted; // The queued request was admitted
+  bool copying;  // An output is being copied by fdcopy_start
+};
+
+static void par_lock(ParState *p) {
+  assertf(pthread_mutex_lock(&p->mutex) == 0, "mutex lock failed", NULL);
+}
+
+static void par_unlock(ParState *p) {
+  assertf(pthread_mutex_unlock(&p->mutex) == 0, "mutex unlock failed", NULL);
+}
+
+static void par_free(ParState *p) {
+  close(p->null_fd);
+  free(p->runs);
+  free(p->finished);
+  slice_vec_free(&p->read_inputs);
+  free(p->buf);
+  pthread_mutex_destroy(&p->mutex);
+  free(p);
+}
+
+/// @brief JobDoneFn of an instance
+static void par_job_done(void *arg, JobState state, int status,
+                         const JobUsage *usage __attribute__((unused))) {
+  ParRun *run = arg;
+  ParState *p = run->par;
+  par_lock(p);
+  run->ok =
+      state == JOB_DONE && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  p->finished[(p->finished_head + p->finished_len++) % p->nruns] = run;
+  p->ctx->wake(p->ctx->wake_arg);
+  par_unlock(p);
+}
+
+/// @brief AdmitFn of the queued instance
+static void par_admitted(void *arg) {
+  ParState *p = arg;
+  par_lock(p);
+  p->admitted = true;
+  p->ctx->wake(p->ctx->wake_arg);
+  par_unlock(p);
+}
+
+/// @brief FdcopyDoneFn of an instance's output
+static void par_copy_done(void *arg, bool ok __attribute__((unused))) {
+  ParState *p = arg;
+  par_lock(p);
+  p->copying = false;
+  p->ctx->wake(p->ctx->wake_arg);
+  par_unlock(p);
+}
+
+/// @brief Start one admitted instance of `par`, the command with the next
+/// input as one more argument
+/// @details The reaper calls par_job_done once it is over.
+static void par_start(ParState *p) {
+  BuiltinCtx *ctx = p->ctx;
+  Slice input = p->inputs[p->next++];
+  char *argv[p->tmpl_len + 2];
+  for (size_t i = 0; i < p->tmpl_len; i++) {
+    argv[i] = slice_to_stack_str(p->tmpl[i]);
+  }
+  argv[p->tmpl_len] = slice_to_stack_str(input);
+  argv[p->tmpl_len + 1] = NULL;
+
+  ParRun *run = p->runs;
+  while (run->used) {
+    run++;
+  }
+  run->out = memfd_create("par", MFD_CLOEXEC);
+  if (run->out == -1) {
+    log_error_fd(ctx->out_fd, "par: %s\n", strerror(errno));
+    admission_release(ctx->jobs->admission, ctx->owner, 1);
+    p->failed = true;
+    return;
+  }
+  SpawnRequest req = {
+      .argv = argv,
+      .stdin_fd = p->null_fd,
+      .stdout_fd = run->out,
+      .pgid = 0,
+      .log_fd = ctx->out_fd,
+      .dir_fd = ctx->shell->dir_fd,
+      .envp = ctx->shell->env,
+  };
+  reaper_hold(); // Until the job has the pid, see exec_pipeline
+  pid_t pid = exec_spawn(ctx->shell, &req);
+  if (pid == -1) {
+    reaper_release();
+    if (errno == ENOENT) {
+      log_warn_fd(ctx->out_fd, "Command not found: %s\n", argv[0]);
+    } else {
+      log_error_fd(ctx->out_fd, "Unable to run %s: %s\n", argv[0],
+                   strerror(errno));
+    }
+    admission_release(ctx->jobs->admission, ctx->owner, 1);
+    close(run->out);
+    p->failed = true;
+    return;
+  }
+  setpgid(pid, pid);
+
+  char cmdline[JOB_CMDLINE_MAX];
+  size_t len = 0;
+  cmdline[0] = '\0';
+  for (size_t i = 0; argv[i] != NULL && len < sizeof(cmdline); i++) {
+    len += snprintf(cmdline + len, sizeof(cmdline) - len, "%s%s",
+                    i == 0 ? "" : " ", argv[i]);
+  }
+  run->job = jobs_add(ctx->jobs, ctx->owner, false, cmdline);
+  jobs_add_pid(ctx->jobs, run->job, pid, pid);
+  reaper_release();
+  jobs_seal(ctx->jobs, run->job);
+  run->used = true;
+  p->running++;
+  jobs_on_done(ctx->jobs, run->job, par_job_done, run);
+}
+
+/// @brief Write the output of a done instance in one piece and free its
+/// slot
+/// @details With detach_output the copy runs on a thread of its own, the
+/// next one waits for par_copy_done.
+static void par_output(ParState *p, ParRun *run) {
+  if (!run->ok) {
+    p->failed = true;
+  }
+  lseek(run->out, 0, SEEK_SET);
+  if (p->ctx->detach_output) {
+    fdcopy_start(run->out, p->ctx->out_fd, par_copy_done, p);
+  } else {
+    fdcopy(run->out, p->ctx->out_fd);
+    close(run->out);
+  }
+  run->used = false;
+  p->running--;
+}
+
+/// @brief BuiltinResumeFn of `par`: write what is done, start what may
+/// @return 0 if every instance succeeded, 1 otherwise, BUILTIN_PARKED while
+/// some are running
+static int par_resume(BuiltinCtx *ctx) {
+  ParState *p = ctx->data;
+  while (true) {
+    par_lock(p);
+    if (!p->copying && p->finished_len > 0) {
+      ParRun *run = p->finished[p->finished_head];
+      p->finished_head = (p->finished_head + 1) % p->nruns;
+      p->finished_len--;
+      p->copying = ctx->detach_output;
+      par_unlock(p);
+      par_output(p, run);
+      continue;
+    }
+    if (p->queued && p->admitted) {
+      p->queued = false;
+      p->admitted = false;
+      par_unlock(p);
+      par_start(p);
+      continue;
+    }
+    if (!p->queued && p->next < p->ninputs && p->running < p->nruns) {
+      p->queued = true;
+      par_unlock(p);
+      // Never waited for: a queued instance starts once par_admitted is
+      // called
+      if (admission_try(ctx->jobs->admission, ctx->owner, 1, par_admitted,
+                        p)) {
+        par_lock(p);
+        p->queued = false;
+        par_unlock(p);
+        par_start(p);
+      }
+      continue;
+    }
+    bool over = !p->queued && p->running == 0 && !p->copying &&
+                p->next == p->ninputs;
+    par_unlock(p);
+    if (!over) {
+      return BUILTIN_PARKED;
+    }
+    int code = p->failed ? 1 : 0;
+    par_free(p);
+    ctx->data = NULL;
+    return code;
+  }
+}
+
+/// @brief Read a descriptor to the end, one input per line
+/// @param buf Storage of the lines, to be freed by the caller
+static SliceVec par_read_inputs(int fd, char **buf) {
+  size_t len = 0, cap = 4096;
+  *buf = malloc(cap);
+  assertf(*buf != NULL, "malloc failed", NULL);
+  ssize_t n;
+  while ((n = read(fd, *buf + len, cap - len)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    len += n;
+    if (len == cap) {
+      cap *= 2;
+      *buf = realloc(*buf, cap);
+      assertf(*buf != NULL, "realloc failed", NULL);
+    }
+  }
+
+  SliceVec inputs = slice_vec_new();
+  for (size_t start = 0, i = 0; i <= len; i++) {
+    if (i == len || (*buf)[i] == '\n') {
+      if (i > start) {
+        slice_vec_push(&inputs,
+                       (Slice){.data = *buf + start, .len = i - start});
+      }
+      start = i + 1;
+    }
+  }
+  return inputs;
+}
+
+/// @brief Parse the N of `-j N`, clamped to PAR_JOBS_MAX
+/// @return is it a positive number
+static bool par_parse_jobs(Slice arg, long *n) {
+  char *s = slice_to_stack_str(arg);
+  char *end;
+  *n = strtol(s, &end, 10); // LONG_MAX if out of range, clamped below
+  if (end == s || *end != '\0' || *n < 1) {
+    return false;
+  }
+  if (*n > PAR_JOBS_MAX) {
+    *n = PAR_JOBS_MAX;
+  }
+  return true;
+}
+
+/// @brief Can the inputs be read without blocking the thread for long
+/// @details A shared thread (detach_output) only reads regular files, a
+/// pipe or a terminal could keep it forever.
+static bool par_inputs_ok(BuiltinCtx *ctx) {
+  struct stat st;
+  return !ctx->detach_output ||
+         (fstat(ctx->in_fd, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+/// @brief `par [-j N] cmd [args...] [::: inputs...]`
+/// @details Runs cmd once per input, with the input as last argument, at most
+/// N at a time (default: online CPUs). Inputs are read one per line from a
+/// `<` redirection when there is no `:::`. The builtin is parked while the
+/// instances run: a finished instance is replaced as soon as the reaper
+/// reports it, and its output is written in one piece.
+/// @return 0 if every instance succeeded, 1 otherwise
+static int builtin_par(BuiltinCtx *ctx, Command *cmd) {
+  Slice *args = cmd->args.data;
+  size_t argc = cmd->args.len;
+  size_t first = 0;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  bool ok = true;
+  if (argc >= 1 && slice_cmp(args[0], SLICE_LIT("-j")) == 0) {
+    ok = argc >= 2 && par_parse_jobs(args[1], &n);
+    first = 2;
+  }
+  size_t sep = first;
+  while (sep < argc && slice_cmp(args[sep], SLICE_LIT(":::")) != 0) {
+    sep++;
+  }
+  if (!ok || first >= sep || (sep == argc && ctx->in_fd == -1)) {
+    log_error_fd(ctx->out_fd,
+                 "par: usage: par [-j N] cmd [args...] ::: inputs... "
+                 "(or < file)\n",
+                 NULL);
+    return 1;
+  }
+  if (sep == argc && !par_inputs_ok(ctx)) {
+    log_error_fd(ctx->out_fd, "par: inputs must come from a regular file\n",
+                 NULL);
+    return 1;
+  }
+
+  ParState *p = calloc(1, sizeof(ParState));
+  assertf(p != NULL, "calloc failed", NULL);
+  assertf(pthread_mutex_init(&p->mutex, NULL) == 0, "mutex init failed",
+          NULL);
+  p->ctx = ctx;
+  p->tmpl = &args[first];
+  p->tmpl_len = sep - first;
+  p->inputs = &args[sep + 1];
+  p->ninputs = sep < argc ? argc - sep - 1 : 0;
+  if (sep == argc) {
+    p->read_inputs = par_read_inputs(ctx->in_fd, &p->buf);
+    p->inputs = p->read_inputs.data;
+    p->ninputs = p->read_inputs.len;
+  }
+  if ((size_t)n > p->ninputs) {
+    n = p->ninputs > 0 ? p->ninputs : 1; // No more runs than inputs
+  }
+  p->nruns = n;
+  p->null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  assertf(p->null_fd != -1, "open /dev/null failed", NULL);
+  p->runs = calloc(n, sizeof(ParRun));
+  p->finished = malloc(n * sizeof(ParRun *));
+  assertf(p->runs != NULL && p->finished != NULL, "malloc failed", NULL);
+  for (long i = 0; i < n; i++) {
+    p->runs[i].par = p;
+  }
+
+  ctx->data = p;
+  ctx->resume = par_resume;
+  return par_resume(ctx);
+}
+
+// Perfect hash over the builtin names, found offline: no two names share a
+// slot. A new builtin needs new constants if it collides, builtin_check
+// catches that at startup.
+#define BUILTIN_SLOTS 32
+#define BUILTIN_HASH(first, second, last, len)                                 \
+  (((unsigned)(unsigned char)(first) + (unsigned)(unsigned char)(second) * 3 + \
+    (unsigned char)(last) + (len) * 3) &                                       \
+   (BUILTIN_SLOTS - 1))
+#define BUILTIN(id_, name_, first, second, last, run_)                         \
+  [BUILTIN_HASH(first, second, last, sizeof(name_) - 1)] = {                   \
+      .id = id_,                                                               \
+      .name = SLICE_LIT(name_),                                                \
+      .run = run_,                                                             \
+  }
+
+static const Builtin builtins[BUILTIN_SLOTS] = {
+    BUILTIN(BUILTIN_ECHO, "echo", 'e', 'c', 'o', builtin_echo),
+    BUILTIN(BUILTIN_TRUE, "true", 't', 'r', 'e', builtin_true),
+    BUILTIN(BUILTIN_FALSE, "false", 'f', 'a', 'e', builtin_false),
+    BUILTIN(BUILTIN_PWD, "pwd", 'p', 'w', 'd', builtin_pwd),
+    BUILTIN(BUILTIN_EXIT, "exit", 'e', 'x', 't', builtin_exit),
+    BUILTIN(BUILTIN_WAIT, "wait", 'w', 'a', 't', builtin_wait),
+    BUILTIN(BUILTIN_CD, "cd", 'c', 'd', 'd', builtin_cd),
+    BUILTIN(BUILTIN_JOBS, "jobs", 'j', 'o', 's', builtin_jobs),
+    BUILTIN(BUILTIN_HASH, "hash", 'h', 'a', 'h', builtin_hash),
+    BUILTIN(BUILTIN_PAR, "par", 'p', 'a', 'r', builtin_par),
+    BUILTIN(BUILTIN_QUIT, "quit", 'q', 'u', 't', NULL),
+    BUILTIN(BUILTIN_HALT, "halt", 'h', 'a', 't', NULL),
+    BUILTIN(BUILTIN_HELP, "help", 'h', 'e', 'p', NULL),
+    BUILTIN(BUILTIN_TIME, "time", 't', 'i', 'e', NULL),
+    BUILTIN(BUILTIN_MEMO, "memo", 'm', 'e', 'o', NULL),
+};
+
+/// @brief Make sure every builtin sits in its own slot
+__attribute__((constructor)) static void builtin_check(void) {
+  unsigned seen = 0;
+  for (size_t i = 0; i < BUILTIN_SLOTS; i++) {
+    Slice name = builtins[i].name;
+    if (name.len == 0) {
+      continue;
+    }
+    assertf(BUILTIN_HASH(name.data[0], name.data[1], name.data[name.len - 1],
+                         name.len) == i,
+            "builtin in the wrong slot", NULL);
+    seen |= 1u << builtins[i].id;
+  }
+  assertf(seen == (1u << (BUILTIN_MEMO + 1)) - 1, "builtin hash collision",
+          NULL);
+}
+
+const Builtin *builtin_find(Slice name) {
+  if (name.len < 2) {
+    return NULL; // Every builtin has at least two characters
+  }
+  const Builtin *b = &builtins[BUILTIN_HASH(
+      name.data[0], name.data[1], name.data[name.len - 1], name.len)];
+  if (b->name.len != name.len ||
+      memcmp(b->name.data, name.data, name.len) != 0) {
+    return NULL;
+  }
+  return b;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "jobs.h"
+#include "parser.h"
+#include "shellctx.h"
+#include "types.h"
+#include <stdbool.h>
+
+typedef enum {
+  BUILTIN_ECHO,
+  BUILTIN_TRUE,
+  BUILTIN_FALSE,
+  BUILTIN_PWD,
+  BUILTIN_EXIT,
+  BUILTIN_WAIT,
+  BUILTIN_CD,
+  BUILTIN_JOBS,
+  BUILTIN_HASH,
+  BUILTIN_PAR,
+  BUILTIN_QUIT, // Session actions, handled by the session prehook
+  BUILTIN_HALT,
+  BUILTIN_HELP,
+  BUILTIN_TIME, // Pipeline prefixes, handled by the executor
+  BUILTIN_MEMO,
+} BuiltinId;
+
+#define BUILTIN_PARKED -1 // Returned by a builtin that waits, see BuiltinCtx
+
+typedef struct BuiltinCtx BuiltinCtx;
+
+/// @brief Go on with a builtin that returned BUILTIN_PARKED
+/// @return Exit code, BUILTIN_PARKED if it waits again
+typedef int (*BuiltinResumeFn)(BuiltinCtx *ctx);
+
+/// @brief What a builtin runs with
+/// @details A builtin never blocks the thread waiting for processes: it
+/// arranges for wake to be called once it can go on, sets resume and
+/// returns BUILTIN_PARKED. resume is then called with the same context,
+/// maybe on another thread.
+struct BuiltinCtx {
+  Jobs *jobs;
+  const void *owner; // Session the jobs belong to
+  ShellCtx *shell;   // Working directory and environment
+  int in_fd;         // `<` redirection, -1 if none: the shell's own stdin
+                     // carries its commands (the client's in a server)
+  int out_fd;
+  bool detach_output; // Copy bulk output with fdcopy_start (server)
+  bool exit; // Set by the builtin to end the session
+
+  void (*wake)(void *arg); // Must not block
+  void *wake_arg;
+  BuiltinResumeFn resume; // Set by a builtin returning BUILTIN_PARKED
+  void *data;             // State of the parked builtin
+};
+
+/// @brief Builtin handler
+/// @return Exit code, BUILTIN_PARKED if it waits
+typedef int (*BuiltinFn)(BuiltinCtx *ctx, Command *cmd);
+
+typedef struct {
+  BuiltinId id;
+  Slice name;
+  BuiltinFn run; // NULL for session actions
+} Builtin;
+
+/// @brief Find a builtin by name
+/// @param name Command name
+/// @return Builtin, NULL if the name is not a builtin
+const Builtin *builtin_find(Slice name);
@@ -0,0 +1,152 @@
+#include "charclass.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define CHARCLASS_X86 1
+#include <immintrin.h>
+#endif
+
+#define CC_IS_WORD(c)                                                          \
+  !((c) == '\0' || (c) == ' ' || ((c) >= '\t' && (c) <= '\r') ||             \
+    (c) == ';' || (c) == '|' || (c) == '<' || (c) == '>' || (c) == '\'' ||     \
+    (c) == '&' || (c) == '#' || (c) == '\\')
+#define CC_ROW(r)                                                              \
+  CC_IS_WORD(r + 0x0), CC_IS_WORD(r + 0x1), CC_IS_WORD(r + 0x2),               \
+      CC_IS_WORD(r + 0x3), CC_IS_WORD(r + 0x4), CC_IS_WORD(r + 0x5),           \
+      CC_IS_WORD(r + 0x6), CC_IS_WORD(r + 0x7), CC_IS_WORD(r + 0x8),           \
+      CC_IS_WORD(r + 0x9), CC_IS_WORD(r + 0xa), CC_IS_WORD(r + 0xb),           \
+      CC_IS_WORD(r + 0xc), CC_IS_WORD(r + 0xd), CC_IS_WORD(r + 0xe),           \
+      CC_IS_WORD(r + 0xf)
+
+const bool charclass_word[256] = {
+    CC_ROW(0x00), CC_ROW(0x10), CC_ROW(0x20), CC_ROW(0x30),
+    CC_ROW(0x40), CC_ROW(0x50), CC_ROW(0x60), CC_ROW(0x70),
+    CC_ROW(0x80), CC_ROW(0x90), CC_ROW(0xa0), CC_ROW(0xb0),
+    CC_ROW(0xc0), CC_ROW(0xd0), CC_ROW(0xe0), CC_ROW(0xf0),
+};
+
+static const char *scan_word_scalar(const char *p, const char *end) {
+  while (p < end && charclass_is_word(*p)) {
+    p++;
+  }
+  return p;
+}
+
+#ifdef CHARCLASS_X86
+
+// The vector scanners only issue aligned loads. An aligned block never
+// crosses a page boundary, so reading past `end` (or past the NUL of the
+// input) is safe even though those bytes do not belong to us; matches past
+// `end` are clamped away. ASan cannot know that, hence no_sanitize_address.
+
+__attribute__((no_sanitize_address)) static const char *
+scan_word_sse2(const char *p, const char *end) {
+  while (p < end && ((uintptr_t)p & 15)) {
+    if (!charclass_is_word(*p)) {
+      return p;
+    }
+    p++;
+  }
+
+  const __m128i nul = _mm_setzero_si128();
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i ctl_span = _mm_set1_epi8('\r' - '\t');
+  const __m128i semi = _mm_set1_epi8(';');
+  const __m128i pipe = _mm_set1_epi8('|');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i quote = _mm_set1_epi8('\'');
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i hash = _mm_set1_epi8('#');
+  const __m128i bslash = _mm_set1_epi8('\\');
+
+  for (; p < end; p += 16) {
+    __m128i v = _mm_load_si128((const __m128i *)p);
+    // '\t'..'\r': (v - '\t') as unsigned <= '\r' - '\t'
+    __m128i t = _mm_sub_epi8(v, tab);
+    __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(t, ctl_span), t);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nul));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, space));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, semi));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, pipe));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, lt));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, gt));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, amp));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, hash));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bslash));
+    unsigned mask = (unsigned)_mm_movemask_epi8(m);
+    if (mask != 0) {
+      const char *hit = p + __builtin_ctz(mask);
+      return hit < end ? hit : end;
+    }
+  }
+  return end;
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) static const char *
+scan_word_avx2(const char *p, const char *end) {
+  while (p < end && ((uintptr_t)p & 31)) {
+    if (!charclass_is_word(*p)) {
+      return p;
+    }
+    p++;
+  }
+
+  const __m256i nul = _mm256_setzero_si256();
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i ctl_span = _mm256_set1_epi8('\r' - '\t');
+  const __m256i semi = _mm256_set1_epi8(';');
+  const __m256i pipe = _mm256_set1_epi8('|');
+  const __m256i lt = _mm256_set1_epi8('<');
+  const __m256i gt = _mm256_set1_epi8('>');
+  const __m256i quote = _mm256_set1_epi8('\'');
+  const __m256i amp = _mm256_set1_epi8('&');
+  const __m256i hash = _mm256_set1_epi8('#');
+  const __m256i bslash = _mm256_set1_epi8('\\');
+
+  for (; p < end; p += 32) {
+    __m256i v = _mm256_load_si256((const __m256i *)p);
+    __m256i t = _mm256_sub_epi8(v, tab);
+    __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(t, ctl_span), t);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, nul));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, space));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, semi));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, pipe));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, lt));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, gt));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, quote));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, amp));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, hash));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, bslash));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+    if (mask != 0) {
+      const char *hit = p + __builtin_ctz(mask);
+      return hit < end ? hit : end;
+    }
+  }
+  return end;
+}
+
+#endif // CHARCLASS_X86
+
+static const char *(*scan_word_impl)(const char *, const char *) =
+    scan_word_scalar;
+
+__attribute__((constructor)) static void charclass_init(void) {
+#ifdef CHARCLASS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_word_impl = scan_word_avx2;
+  } else {
+    scan_word_impl = scan_word_sse2;
+  }
+#endif
+}
+
+const char *charclass_scan_word(const char *begin, const char *end) {
+  return scan_word_impl(begin, end);
+}
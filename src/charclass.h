@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+/// @brief Word byte table
+/// @details `charclass_word[c]` is true when `c` can be copied verbatim into
+/// an unescaped word, i.e. it is not whitespace, NUL, a backslash or one of
+/// `;|<>'&#`
+extern const bool charclass_word[256];
+
+/// @brief Is byte part of an unescaped word
+#define charclass_is_word(c) (charclass_word[(unsigned char)(c)])
+
+/// @brief Find the first byte in [begin, end) that ends a run of word bytes
+/// @details Uses AVX2 when the CPU supports it, SSE2 otherwise, and falls back
+/// to `charclass_word` on other architectures. The implementation is chosen
+/// once at startup.
+/// @return Pointer to the first non-word byte, or `end` if there is none
+const char *charclass_scan_word(const char *begin, const char *end);
@@ -0,0 +1,397 @@
+#include "compile.h"
+#include "lexer.h"
+#include "log.h"
+#include "panic.h"
+#include "parser.h"
+#include "types.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t fnv1a(const void *data, size_t len, uint64_t h) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * FNV_PRIME;
+  }
+  return h;
+}
+
+bool cache_dir(char *out, size_t cap) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+  if (xdg != NULL && xdg[0] != '\0') {
+    n = snprintf(out, cap, "%s/shsh", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    n = snprintf(out, cap, "%s/.cache/shsh", home);
+  } else {
+    return false;
+  }
+  return n > 0 && (size_t)n < cap;
+}
+
+/// @brief Get the cache file of a script, keyed by its absolute path
+/// @return is ok
+static bool cache_path(char *out, size_t cap, const char *path) {
+  char dir[PATH_MAX];
+  char real[PATH_MAX];
+  if (!cache_dir(dir, sizeof(dir)) || realpath(path, real) == NULL) {
+    return false;
+  }
+  uint64_t h = fnv1a(real, strlen(real), FNV_OFFSET);
+  int n = snprintf(out, cap, "%s/%016llx.shc", dir, (unsigned long long)h);
+  return n > 0 && (size_t)n < cap;
+}
+
+/// @brief Point the section pointers of a compiled script into its data
+/// @return is the layout consistent
+static bool compiled_index(CompiledScript *cs) {
+  if (cs->size < sizeof(CompiledHeader)) {
+    return false;
+  }
+  const CompiledHeader *h = cs->data;
+  if (h->magic != COMPILED_MAGIC || h->version != COMPILED_VERSION) {
+    return false;
+  }
+  size_t commands_size = (size_t)h->commands_len * sizeof(CompiledCommand);
+  size_t args_size = (size_t)h->args_len * sizeof(StrRef);
+  if (sizeof(CompiledHeader) + commands_size + args_size + h->strings_len !=
+      cs->size) {
+    return false;
+  }
+  cs->header = h;
+  cs->commands = (const CompiledCommand *)(h + 1);
+  cs->args = (const StrRef *)(cs->commands + h->commands_len);
+  cs->strings = (const char *)(cs->args + h->args_len);
+
+  // Never trust offsets read from disk
+  for (uint32_t i = 0; i < h->args_len; i++) {
+    if ((uint64_t)cs->args[i].off + cs->args[i].len > h->strings_len) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->commands_len; i++) {
+    const CompiledCommand *c = &cs->commands[i];
+    const StrRef *refs[] = {&c->name, &c->in_file, &c->out_file, &c->in_tcp,
+                            &c->out_tcp};
+    for (size_t j = 0; j < sizeof(refs) / sizeof(refs[0]); j++) {
+      if ((uint64_t)refs[j]->off + refs[j]->len > h->strings_len) {
+        return false;
+      }
+    }
+    if ((uint64_t)c->args_off + c->args_len > h->args_len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// @brief Record the identity of a script file in a header
+static void compiled_identify(CompiledHeader *h, const struct stat *st) {
+  h->dev = st->st_dev;
+  h->ino = st->st_ino;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  h->ctime_sec = st->st_ctim.tv_sec;
+  h->ctime_nsec = st->st_ctim.tv_nsec;
+  h->size = st->st_size;
+  h->built_sec = time(NULL);
+}
+
+/// @brief Is the entry recorded for this very file, unchanged since
+/// @details A write in the second the entry was built could keep ctime
+/// as it was, such an entry is left to the content hash.
+static bool compiled_same_file(const CompiledHeader *h,
+                               const struct stat *st) {
+  return h->dev == (uint64_t)st->st_dev && h->ino == (uint64_t)st->st_ino &&
+         h->size == (uint64_t)st->st_size &&
+         h->mtime_sec == st->st_mtim.tv_sec &&
+         h->mtime_nsec == st->st_mtim.tv_nsec &&
+         h->ctime_sec == st->st_ctim.tv_sec &&
+         h->ctime_nsec == st->st_ctim.tv_nsec && h->built_sec > h->ctime_sec;
+}
+
+static void compiled_store(const CompiledScript *cs, const char *path);
+
+/// @brief Store a loaded entry again with the current identity of the script
+static void compiled_refresh(const CompiledScript *cs, const char *path,
+                             const struct stat *st) {
+  CompiledScript copy = {.data = malloc(cs->size), .size = cs->size};
+  assertf(copy.data != NULL, "malloc failed", NULL);
+  memcpy(copy.data, cs->data, cs->size);
+  compiled_identify(copy.data, st);
+  compiled_store(&copy, path);
+  free(copy.data);
+}
+
+bool compiled_load(CompiledScript *cs, const char *path, const struct stat *st,
+                   const char *content) {
+  *cs = (CompiledScript){0};
+  char cpath[PATH_MAX];
+  if (!cache_path(cpath, sizeof(cpath), path)) {
+    return false;
+  }
+  int fd = open(cpath, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat cst;
+  if (fstat(fd, &cst) == -1 || cst.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  cs->data = map;
+  cs->size = cst.st_size;
+  cs->mapped = true;
+
+  if (!compiled_index(cs)) {
+    log_debug("Invalid compiled script %s\n", cpath);
+    compiled_free(cs);
+    return false;
+  }
+  if (compiled_same_file(cs->header, st)) {
+    log_debug("Loaded compiled script %s\n", cpath);
+    return true;
+  }
+  // Moved, copied, touched or rewritten, the content tells
+  if (cs->header->size != (uint64_t)st->st_size ||
+      cs->header->hash != fnv1a(content, st->st_size, FNV_OFFSET)) {
+    log_debug("Stale compiled script %s\n", cpath);
+    compiled_free(cs);
+    return false;
+  }
+  log_debug("Loaded compiled script %s by content\n", cpath);
+  compiled_refresh(cs, path, st);
+  return true;
+}
+
+/// @brief Growable byte buffer
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buf;
+
+static size_t buf_push(Buf *b, const void *data, size_t len) {
+  if (len == 0) {
+    return b->len;
+  }
+  if (b->len + len > b->cap) {
+    size_t cap = b->cap == 0 ? 256 : b->cap;
+    while (cap < b->len + len) {
+      cap *= 2;
+    }
+    b->data = realloc(b->data, cap);
+    assertf(b->data != NULL, "realloc failed", NULL);
+    b->cap = cap;
+  }
+  size_t off = b->len;
+  memcpy(b->data + off, data, len);
+  b->len += len;
+  return off;
+}
+
+/// @brief Script compiler state
+typedef struct {
+  Buf commands;
+  Buf args;
+  Buf strings;
+
+  // Open addressing string interning table
+  StrRef *table;
+  size_t table_cap;
+  size_t table_len;
+} Compiler;
+
+static StrRef *compiler_slot(Compiler *c, const char *data, size_t len) {
+  size_t mask = c->table_cap - 1;
+  size_t i = fnv1a(data, len, FNV_OFFSET) & mask;
+  while (c->table[i].off != UINT32_MAX) {
+    StrRef *r = &c->table[i];
+    if (r->len == len && memcmp(c->strings.data + r->off, data, len) == 0) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return &c->table[i];
+}
+
+static void compiler_grow(Compiler *c) {
+  StrRef *old = c->table;
+  size_t old_cap = c->table_cap;
+  c->table_cap = old_cap == 0 ? 64 : old_cap * 2;
+  c->table = malloc(c->table_cap * sizeof(StrRef));
+  assertf(c->table != NULL, "malloc failed", NULL);
+  for (size_t i = 0; i < c->table_cap; i++) {
+    c->table[i].off = UINT32_MAX;
+  }
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].off != UINT32_MAX) {
+      *compiler_slot(c, c->strings.data + old[i].off, old[i].len) = old[i];
+    }
+  }
+  free(old);
+}
+
+static StrRef compiler_intern(Compiler *c, Slice s) {
+  if (s.len == 0) {
+    return (StrRef){.off = 0, .len = 0};
+  }
+  if ((c->table_len + 1) * 2 > c->table_cap) {
+    compiler_grow(c);
+  }
+  StrRef *slot = compiler_slot(c, s.data, s.len);
+  if (slot->off == UINT32_MAX) {
+    slot->off = buf_push(&c->strings, s.data, s.len);
+    slot->len = s.len;
+    c->table_len++;
+  }
+  return *slot;
+}
+
+void cache_mkdir(char *dir) {
+  for (char *p = dir + 1; *p != '\0'; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(dir, 0700);
+      *p = '/';
+    }
+  }
+  mkdir(dir, 0700);
+}
+
+/// @brief Store the compiled script in the cache
+static void compiled_store(const CompiledScript *cs, const char *path) {
+  char cpath[PATH_MAX];
+  char dir[PATH_MAX];
+  char tmp[PATH_MAX + 32];
+  if (!cache_path(cpath, sizeof(cpath), path) ||
+      !cache_dir(dir, sizeof(dir))) {
+    return;
+  }
+  cache_mkdir(dir);
+
+  // Write a private file and rename it, readers never see a partial file
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cpath, getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    log_debug("Unable to create %s: %s\n", tmp, strerror(errno));
+    return;
+  }
+  size_t off = 0;
+  while (off < cs->size) {
+    ssize_t n = write(fd, (const char *)cs->data + off, cs->size - off);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      log_debug("Unable to write %s: %s\n", tmp, strerror(errno));
+      close(fd);
+      unlink(tmp);
+      return;
+    }
+    off += n;
+  }
+  close(fd);
+  if (rename(tmp, cpath) == -1) {
+    unlink(tmp);
+    return;
+  }
+  log_debug("Stored compiled script %s\n", cpath);
+}
+
+void compiled_build(CompiledScript *cs, const char *path, const struct stat *st,
+                    const char *content) {
+  Compiler c = {0};
+  compiler_grow(&c);
+
+  Lexer lexer = lex_new_stream((LexSource){0});
+  lex_feed(&lexer, content, st->st_size);
+  lex_finish(&lexer);
+  Parser parser = parse_new(&lexer);
+
+  while (true) {
+    parse_release(&parser);
+    ParseResult pr = parse_next(&parser);
+    if (pr.result == PARSE_EOF) {
+      break;
+    }
+    if (pr.result != PARSE_OK) {
+      // Only the error itself is replayed
+      CompiledCommand cc = {.result = pr.result};
+      buf_push(&c.commands, &cc, sizeof(cc));
+      continue;
+    }
+    for (size_t i = 0; i < pr.pipeline.len; i++) {
+      Command *cmd = &pr.pipeline.commands[i];
+      CompiledCommand cc = {
+          .result = pr.result,
+          .flags = cmd->flags,
+          .args_off = c.args.len / sizeof(StrRef),
+          .args_len = cmd->args.len,
+          .name = compiler_intern(&c, cmd->name),
+          .in_file = compiler_intern(&c, cmd->in_file),
+          .out_file = compiler_intern(&c, cmd->out_file),
+          .in_tcp = compiler_intern(&c, cmd->in_tcp),
+          .out_tcp = compiler_intern(&c, cmd->out_tcp),
+      };
+      for (size_t j = 0; j < cmd->args.len; j++) {
+        StrRef r = compiler_intern(&c, cmd->args.data[j]);
+        buf_push(&c.args, &r, sizeof(r));
+      }
+      buf_push(&c.commands, &cc, sizeof(cc));
+    }
+  }
+  parse_free(&parser);
+  lex_free(&lexer);
+
+  CompiledHeader h = {
+      .magic = COMPILED_MAGIC,
+      .version = COMPILED_VERSION,
+      .hash = fnv1a(content, st->st_size, FNV_OFFSET),
+      .commands_len = c.commands.len / sizeof(CompiledCommand),
+      .args_len = c.args.len / sizeof(StrRef),
+      .strings_len = c.strings.len,
+  };
+  compiled_identify(&h, st);
+  Buf out = {0};
+  buf_push(&out, &h, sizeof(h));
+  buf_push(&out, c.commands.data, c.commands.len);
+  buf_push(&out, c.args.data, c.args.len);
+  buf_push(&out, c.strings.data, c.strings.len);
+  free(c.commands.data);
+  free(c.args.data);
+  free(c.strings.data);
+  free(c.table);
+
+  *cs = (CompiledScript){.data = out.data, .size = out.len, .mapped = false};
+  assertf(compiled_index(cs), "invalid compiled script", NULL);
+  compiled_store(cs, path);
+}
+
+void compiled_free(CompiledScript *cs) {
+  if (cs->data == NULL) {
+    return;
+  }
+  if (cs->mapped) {
+    munmap(cs->data, cs->size);
+  } else {
+    free(cs->data);
+  }
+  *cs = (CompiledScript){0};
+}
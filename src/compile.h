@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define COMPILED_MAGIC 0x48534853 // "SHSH"
+#define COMPILED_VERSION 3
+
+/// @brief String reference into the compiled string table
+typedef struct {
+  uint32_t off;
+  uint32_t len;
+} StrRef;
+
+/// @brief Compiled script file header
+/// @details The file is laid out as the header, the command array, the
+/// argument array and the interned string table, in that order.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t dev;       // Script device
+  uint64_t ino;       // Script inode
+  int64_t mtime_sec;  // Script mtime
+  int64_t mtime_nsec; // Script mtime (nanoseconds)
+  int64_t ctime_sec;  // Script ctime, which a write always moves
+  int64_t ctime_nsec;
+  int64_t built_sec;  // When the entry was written (wall clock)
+  uint64_t size;      // Script size
+  uint64_t hash;      // Script content hash
+  uint32_t commands_len;
+  uint32_t args_len;
+  uint32_t strings_len;
+  uint32_t reserved;
+} CompiledHeader;
+
+/// @brief Compiled command, flat counterpart of Command
+/// @details Stages of a pipeline are consecutive commands, all but the last
+/// one have CMD_PIPE set. A failed pipeline is a single command with a
+/// non-OK result.
+typedef struct {
+  uint16_t result; // ParseResultEnum
+  uint16_t flags;  // CommandFlags
+  uint32_t args_off;
+  uint32_t args_len;
+  StrRef name;
+  StrRef in_file;
+  StrRef out_file;
+  StrRef in_tcp;
+  StrRef out_tcp;
+} CompiledCommand;
+
+/// @brief Compiled script
+typedef struct CompiledScript {
+  void *data; // Mapped cache file or heap buffer
+  size_t size;
+  bool mapped;
+
+  const CompiledHeader *header;
+  const CompiledCommand *commands;
+  const StrRef *args;
+  const char *strings;
+} CompiledScript;
+
+/// @brief FNV-1a hash
+/// @param h Previous hash, FNV_OFFSET to start
+uint64_t fnv1a(const void *data, size_t len, uint64_t h);
+
+/// @brief Get the shsh cache directory ($XDG_CACHE_HOME/shsh or
+/// ~/.cache/shsh)
+/// @return is ok
+bool cache_dir(char *out, size_t cap);
+
+/// @brief Create a directory and its parents (mkdir -p), best effort
+/// @param dir Path, modified while walking it but restored
+void cache_mkdir(char *dir);
+
+/// @brief Load the compiled form of a script from the cache
+/// @details An entry recorded for the same file (device, inode, size,
+/// mtime and ctime) is used without reading the script. Otherwise the
+/// content hash decides, and a matching entry is rewritten with the new
+/// file identity so the next run skips the hash.
+/// @param path Script path
+/// @param st Script stat
+/// @param content Script content
+/// @return is ok, false if there is no valid cache entry
+bool compiled_load(CompiledScript *cs, const char *path, const struct stat *st,
+                   const char *content);
+
+/// @brief Compile a script and store it in the cache
+/// @details Storing is best effort, the compiled script is usable even if the
+/// cache directory cannot be written.
+/// @param path Script path
+/// @param st Script stat
+/// @param content Script content
+void compiled_build(CompiledScript *cs, const char *path, const struct stat *st,
+                    const char *content);
+
+/// @brief Free a compiled script
+void compiled_free(CompiledScript *cs);
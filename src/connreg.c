@@ -0,0 +1,117 @@
+#include "connreg.h"
+#include "panic.h"
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#define CONNREG_NONE UINT32_MAX
+
+static ConnSlot *connreg_slot(ConnRegistry *r, uint32_t slot) {
+  if (slot >= atomic_load(&r->nslots)) {
+    return NULL;
+  }
+  ConnSlot *chunk = atomic_load(&r->chunks[slot / CONNREG_CHUNK]);
+  return &chunk[slot % CONNREG_CHUNK];
+}
+
+ConnRegistry *connreg_new(void) {
+  ConnRegistry *r = calloc(1, sizeof(ConnRegistry));
+  assertf(r != NULL, "calloc failed", NULL);
+  assertf(pthread_mutex_init(&r->mutex, NULL) == 0, "mutex init failed",
+          NULL);
+  r->free = CONNREG_NONE;
+  return r;
+}
+
+void connreg_free(ConnRegistry *r) {
+  if (r == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < CONNREG_CHUNKS; i++) {
+    free(atomic_load(&r->chunks[i]));
+  }
+  pthread_mutex_destroy(&r->mutex);
+  free(r);
+}
+
+ConnId connreg_add(ConnRegistry *r, int fd) {
+  assertf(pthread_mutex_lock(&r->mutex) == 0, "mutex lock failed", NULL);
+  uint32_t slot = r->free;
+  ConnSlot *s;
+  if (slot != CONNREG_NONE) {
+    s = connreg_slot(r, slot);
+    r->free = s->next_free;
+  } else {
+    slot = atomic_load(&r->nslots);
+    if (slot == (uint32_t)CONNREG_CHUNK * CONNREG_CHUNKS) {
+      pthread_mutex_unlock(&r->mutex);
+      return 0;
+    }
+    ConnSlot *chunk = atomic_load(&r->chunks[slot / CONNREG_CHUNK]);
+    if (chunk == NULL) {
+      chunk = calloc(CONNREG_CHUNK, sizeof(ConnSlot));
+      assertf(chunk != NULL, "calloc failed", NULL);
+      atomic_store(&r->chunks[slot / CONNREG_CHUNK], chunk);
+    }
+    s = &chunk[slot % CONNREG_CHUNK];
+    atomic_store(&r->nslots, slot + 1); // Published once it is there
+  }
+  atomic_store(&s->fd, fd);
+  uint32_t gen = atomic_load(&s->gen) + 1; // Odd, in use
+  atomic_store(&s->gen, gen);
+  atomic_fetch_add(&r->count, 1);
+  pthread_mutex_unlock(&r->mutex);
+  return CONN_ID(slot, gen);
+}
+
+void connreg_remove(ConnRegistry *r, ConnId id) {
+  assertf(pthread_mutex_lock(&r->mutex) == 0, "mutex lock failed", NULL);
+  ConnSlot *s = connreg_slot(r, CONN_SLOT(id));
+  if (s != NULL && atomic_load(&s->gen) == CONN_GEN(id)) {
+    atomic_store(&s->gen, CONN_GEN(id) + 1); // Even, free
+    s->next_free = r->free;
+    r->free = CONN_SLOT(id);
+    atomic_fetch_sub(&r->count, 1);
+  }
+  pthread_mutex_unlock(&r->mutex);
+}
+
+bool connreg_alive(ConnRegistry *r, ConnId id) {
+  ConnSlot *s = connreg_slot(r, CONN_SLOT(id));
+  return s != NULL && atomic_load(&s->gen) == CONN_GEN(id) &&
+         atomic_load(&s->aborted) != CONN_GEN(id);
+}
+
+bool connreg_abort(ConnRegistry *r, ConnId id) {
+  // Locked against connreg_remove, so the fd is still the connection's
+  assertf(pthread_mutex_lock(&r->mutex) == 0, "mutex lock failed", NULL);
+  ConnSlot *s = connreg_slot(r, CONN_SLOT(id));
+  if (s == NULL || (CONN_GEN(id) & 1) == 0 ||
+      atomic_load(&s->gen) != CONN_GEN(id)) {
+    pthread_mutex_unlock(&r->mutex);
+    return false;
+  }
+  // Tagged with the generation, a slot reused meanwhile stays alive
+  atomic_store(&s->aborted, CONN_GEN(id));
+  // Whatever blocks on the socket (a copy, a command) sees it gone
+  shutdown(atomic_load(&s->fd), SHUT_RDWR);
+  pthread_mutex_unlock(&r->mutex);
+  return true;
+}
+
+void connreg_each(ConnRegistry *r, ConnEachFn fn, void *arg) {
+  uint32_t n = atomic_load(&r->nslots);
+  for (uint32_t slot = 0; slot < n; slot++) {
+    ConnSlot *s = connreg_slot(r, slot);
+    uint32_t gen = atomic_load(&s->gen);
+    if ((gen & 1) == 0) {
+      continue;
+    }
+    int fd = atomic_load(&s->fd);
+    bool alive = atomic_load(&s->aborted) != gen;
+    // Reused while reading, the fd may belong to the next connection
+    if (atomic_load(&s->gen) != gen) {
+      continue;
+    }
+    fn(arg, CONN_ID(slot, gen), fd, alive);
+  }
+}
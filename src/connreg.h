@@ -0,0 +1,69 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CONNREG_CHUNK 256   // Slots allocated at once
+#define CONNREG_CHUNKS 4096 // So at most 1M connections at a time
+
+/// @brief Connection handle: generation in the high half, slot in the low
+/// @details A handle outlives its connection harmlessly, the slot's
+/// generation moves on when it is freed. 0 is never a handle.
+typedef uint64_t ConnId;
+
+#define CONN_ID(slot, gen) (((ConnId)(gen) << 32) | (slot))
+#define CONN_SLOT(id) ((uint32_t)(id))
+#define CONN_GEN(id) ((uint32_t)((id) >> 32))
+
+/// @brief One connection, never moved once allocated
+typedef struct {
+  _Atomic uint32_t gen;     // Odd while in use, bumped on claim and release
+  _Atomic uint32_t aborted; // Generation that was aborted
+  _Atomic int fd;
+  uint32_t next_free;
+} ConnSlot;
+
+/// @brief Slab of connections
+/// @details Adding and removing take a mutex for O(1) free list work,
+/// looking up and iterating take no lock at all.
+typedef struct {
+  pthread_mutex_t mutex;
+  _Atomic(ConnSlot *) chunks[CONNREG_CHUNKS];
+  _Atomic uint32_t nslots; // Slots ever handed out
+  uint32_t free;           // Free list head, UINT32_MAX when empty
+  _Atomic uint32_t count;  // Connections registered
+} ConnRegistry;
+
+/// @brief Visitor for connreg_each
+typedef void (*ConnEachFn)(void *arg, ConnId id, int fd, bool alive);
+
+/// @brief Create an empty registry
+/// @note Allocates memory, so you must call connreg_free when done
+ConnRegistry *connreg_new(void);
+
+/// @brief Free a registry
+void connreg_free(ConnRegistry *r);
+
+/// @brief Register a connection
+/// @return Its handle, 0 if the registry is full
+ConnId connreg_add(ConnRegistry *r, int fd);
+
+/// @brief Unregister a connection, stale handles are ignored
+void connreg_remove(ConnRegistry *r, ConnId id);
+
+/// @brief Is the connection registered and not aborted
+bool connreg_alive(ConnRegistry *r, ConnId id);
+
+/// @brief Mark a connection aborted and shut its socket down, its session
+/// closes it
+/// @note Unregister a connection before closing its fd, or this may shut
+/// down a reused one
+/// @return Was it registered
+bool connreg_abort(ConnRegistry *r, ConnId id);
+
+/// @brief Visit the registered connections without locking
+/// @details Connections added or removed meanwhile may be missed, every
+/// visited one was registered under that handle at some point of the walk.
+void connreg_each(ConnRegistry *r, ConnEachFn fn, void *arg);
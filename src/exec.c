@@ -1,292 +1,1055 @@
+#define _GNU_SOURCE // pipe2, memfd_create
 #include "exec.h"
+#include "builtins.h"
+#include "fdcopy.h"
 #include "log.h"
+#include "memo.h"
 #include "panic.h"
 #include "parser.h"
+#include "pathcache.h"
+#include "reaper.h"
 #include "semantic_analysis.h"
+#include "tcpconn.h"
 #include "types.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 Executor executor_new(Parser *parser, Jobs *jobs) {
-  return (Executor){.parser = parser, .jobs = jobs};
+  return (Executor){.parser = parser,
+                    .jobs = jobs,
+                    .shell = shellctx_process(),
+                    .job = -1,
+                    .capture = -1,
+                    .builtin_files = {-1, -1}};
 }
 
-Jobs *jobs_new(void) {
-  Jobs *j = malloc(sizeof(Jobs));
-  j->pids = NULL;
-  j->pids_size = 0;
-  j->pids_capacity = 0;
-  assertf(pthread_mutex_init(&j->mutex, NULL) == 0, "mutex init failed", NULL);
-  return j;
+/// @brief Let a parked command line go on, from a callback (any thread,
+/// never blocks)
+/// @details If the thread driving it did not park it yet, it sees the wake
+/// and goes on by itself, otherwise done hands it back to the caller.
+static void exec_wake(void *arg) {
+  Executor *executor = arg;
+  ExecWake wake = atomic_load(&executor->wake);
+  while (true) {
+    if (wake == EXEC_PARKED) {
+      if (atomic_compare_exchange_weak(&executor->wake, &wake, EXEC_AWAKE)) {
+        executor->done(executor, executor->done_arg);
+        return;
+      }
+    } else if (wake == EXEC_WOKEN ||
+               atomic_compare_exchange_weak(&executor->wake, &wake,
+                                            EXEC_WOKEN)) {
+      return;
+    }
+  }
 }
 
-void jobs_free(Jobs *jobs) {
-  free(jobs->pids);
-  free(jobs);
+/// @brief FdcopyDoneFn of exec_copy_out
+static void exec_copy_done(void *arg, bool ok __attribute__((unused))) {
+  Executor *executor = arg;
+  atomic_store(&executor->wait_over, true);
+  exec_wake(executor);
 }
 
-size_t push_pid(Jobs *jobs, pid_t pid, bool next) {
-  assertf(pthread_mutex_lock(&jobs->mutex) == 0, "mutex lock failed", NULL);
-  if (!next) {
-    jobs->pids_size = 0;
-    for (size_t i = 0; (i < jobs->pids_size); i++) {
-      if (jobs->pids[i] == -1) {
-        jobs->pids[i] = pid;
-        assertf(pthread_mutex_unlock(&jobs->mutex) == 0, "mutex unlock failed",
-                NULL);
-        return i;
-      }
+/// @brief Copy a descriptor to the output and close it
+/// @details With detach_output the copy runs on a thread of its own and
+/// the command line is parked until it is over.
+static void exec_copy_out(Executor *executor, int fd) {
+  if (!executor->detach_output) {
+    fdcopy(fd, executor->out_fd);
+    close(fd);
+    return;
+  }
+  executor->wait = EXEC_WAIT_COPY;
+  atomic_store(&executor->wait_over, false);
+  fdcopy_start(fd, executor->out_fd, exec_copy_done, executor);
+}
+
+/// @brief Render a pipeline as a command line, truncated to cap
+static void exec_cmdline(Pipeline *pipeline, char *out, size_t cap) {
+  size_t len = 0;
+  out[0] = '\0';
+  for (size_t i = 0; i < pipeline->len && len < cap; i++) {
+    Command *command = &pipeline->commands[i];
+    len += snprintf(out + len, cap - len, "%s%.*s", i == 0 ? "" : " | ",
+                    (int)command->name.len, command->name.data);
+    for (size_t j = 0; j < command->args.len && len < cap; j++) {
+      len += snprintf(out + len, cap - len, " %.*s",
+                      (int)command->args.data[j].len, command->args.data[j].data);
     }
   }
-  int i = jobs->pids_size;
+}
 
-  if (jobs->pids_size == jobs->pids_capacity) {
-    jobs->pids_capacity =
-        jobs->pids_capacity == 0 ? 1 : jobs->pids_capacity * 2;
-    jobs->pids = realloc(jobs->pids, jobs->pids_capacity * sizeof(pid_t));
+/// @brief Open the redirections of a command, files and TCP connections
+/// @details They are opened by the shell, so a failure is reported here
+/// rather than by a half set up child. A connection is handed to the
+/// command as its stdin or stdout, the data never passes through the shell.
+/// @param dir_fd Directory relative paths are opened from
+/// @param first Is the command the first stage (may read a file/socket)
+/// @param last Is the command the last stage (may write a file/socket)
+/// @param connects Sockets made by exec_connect, taken over here
+/// @param filein Input file or socket, -1 if none
+/// @param fileout Output file or socket, -1 if none
+/// @return EXEC_SUCCESS, nothing is left open on failure
+static ExecStatusEnum exec_open_redirections(Command *command, int dir_fd,
+                                             bool first, bool last, int log_fd,
+                                             ExecConnect *connects,
+                                             int *filein, int *fileout) {
+  *filein = -1;
+  *fileout = -1;
+  if (first && CMDISFIN(*command)) {
+    *filein = openat(dir_fd, slice_to_stack_str(command->in_file),
+                     O_RDONLY | O_CLOEXEC);
+    if (*filein == -1) {
+      log_error_fd(log_fd, "Unable to open file %s\n",
+                   slice_to_stack_str(command->in_file));
+      return EXEC_ERROR_FILE_OPEN;
+    }
+  }
+  if (first && CMDISTIN(*command)) {
+    *filein = connects[0].fd;
+    connects[0].fd = -1;
+    if (*filein == -1) {
+      char *target = slice_to_stack_str(command->in_tcp);
+      log_error_fd(log_fd, "Unable to connect to %s: %s\n", target,
+                   connects[0].err);
+      return EXEC_ERROR_CONNECT;
+    }
+  }
+
+  ExecStatusEnum status = EXEC_SUCCESS;
+  if (last && CMDISFOUT(*command)) {
+    *fileout = openat(dir_fd, slice_to_stack_str(command->out_file),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (*fileout == -1) {
+      log_error_fd(log_fd, "Unable to open file %s\n",
+                   slice_to_stack_str(command->out_file));
+      status = EXEC_ERROR_FILE_OPEN;
+    }
   }
-  jobs->pids[jobs->pids_size++] = pid;
-  assertf(pthread_mutex_unlock(&jobs->mutex) == 0, "mutex unlock failed", NULL);
-  return i;
+  if (last && CMDISTOUT(*command)) {
+    *fileout = connects[1].fd;
+    connects[1].fd = -1;
+    if (*fileout == -1) {
+      char *target = slice_to_stack_str(command->out_tcp);
+      log_error_fd(log_fd, "Unable to connect to %s: %s\n", target,
+                   connects[1].err);
+      status = EXEC_ERROR_CONNECT;
+    }
+  }
+  if (status != EXEC_SUCCESS && *filein != -1) {
+    close(*filein);
+    *filein = -1;
+  }
+  return status;
 }
 
-void remove_pid(Jobs *jobs, pid_t pid) {
-  assertf(pthread_mutex_lock(&jobs->mutex) == 0, "mutex lock failed", NULL);
-  for (size_t i = 0; i < jobs->pids_size; i++) {
-    if (jobs->pids[i] == pid) {
-      jobs->pids[i] = -1;
-      break;
+/// @brief Close the redirections opened for the first n stages
+static void exec_close_redirections(const int *fileins, const int *fileouts,
+                                    size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (fileins[i] != -1) {
+      close(fileins[i]);
+    }
+    if (fileouts[i] != -1) {
+      close(fileouts[i]);
     }
   }
-  assertf(pthread_mutex_unlock(&jobs->mutex) == 0, "mutex unlock failed", NULL);
 }
 
-ExecResult exec_next(Executor *executor, int in_fd, int out_fd,
-                     int (*pre_hook)(Command)) {
+/// @brief End a builtin that returned its exit code
+static ExecResult exec_builtin_over(Executor *executor, int code,
+                                    ExecResult r) {
+  r.exit_code = code;
+  if (executor->builtin.exit) {
+    r.status = EXEC_EXIT;
+  }
+  exec_close_redirections(&executor->builtin_files[0],
+                          &executor->builtin_files[1], 1);
+  executor->builtin_files[0] = executor->builtin_files[1] = -1;
+  return r;
+}
+
+/// @brief Run a builtin in the shell process
+/// @details A builtin that waits is left parked in executor->builtin.
+static ExecResult exec_builtin(Executor *executor, const Builtin *builtin,
+                               Command *command, int out_fd, ExecResult r) {
+  int filein, fileout;
+  ExecStatusEnum status = exec_open_redirections(
+      command, executor->shell.dir_fd, true, true, out_fd,
+      executor->pending.connects, &filein, &fileout);
+  if (status != EXEC_SUCCESS) {
+    r.status = status;
+    r.exit_code = 1;
+    return r;
+  }
+  executor->builtin_files[0] = filein;
+  executor->builtin_files[1] = fileout;
+  executor->builtin = (BuiltinCtx){
+      .jobs = executor->jobs,
+      .owner = executor,
+      .shell = &executor->shell,
+      .in_fd = filein,
+      .out_fd = fileout != -1 ? fileout : out_fd,
+      .detach_output = executor->detach_output,
+      .wake = exec_wake,
+      .wake_arg = executor,
+  };
+  int code = builtin->run(&executor->builtin, command);
+  if (code == BUILTIN_PARKED) {
+    executor->wait = EXEC_WAIT_BUILTIN;
+    return r;
+  }
+  return exec_builtin_over(executor, code, r);
+}
+
+/// @brief Does a command only forward data: `cat` with plain file operands
+static bool exec_is_forward(Command *command) {
+  if (slice_cmp(command->name, slice_from_str("cat")) != 0 ||
+      CMDISBG(*command)) {
+    return false;
+  }
+  for (size_t i = 0; i < command->args.len; i++) {
+    Slice arg = command->args.data[i];
+    if (arg.len > 0 && arg.data[0] == '-') {
+      return false; // Options or stdin, leave them to cat
+    }
+  }
+  return true;
+}
+
+/// @brief Can a forwarding command run in the shell
+/// @details Only copies that end on their own may: from regular files to a
+/// regular file, a pipe or a socket. A device or a fifo may never end and
+/// a terminal may block, while only a cat process can be interrupted. Empty
+/// files are left to cat too, /proc ones look like that and may block.
+/// @param detach With detach_output only a regular file may take the copy,
+/// the shell's thread must not wait for a reader
+static bool exec_forward_ok(Command *command, int dir_fd, int out_fd,
+                            bool detach) {
+  struct stat st;
+  if (CMDISTIN(*command)) {
+    return false;
+  }
+  if (CMDISFIN(*command) &&
+      (fstatat(dir_fd, slice_to_stack_str(command->in_file), &st, 0) == -1 ||
+       !S_ISREG(st.st_mode) || st.st_size == 0)) {
+    return false;
+  }
+  for (size_t i = 0; i < command->args.len; i++) {
+    if (fstatat(dir_fd, slice_to_stack_str(command->args.data[i]), &st, 0) ==
+            -1 ||
+        !S_ISREG(st.st_mode) || st.st_size == 0) {
+      return false; // Missing ones are reported by cat
+    }
+  }
+  if (CMDISFOUT(*command)) {
+    // Created as a regular file if it does not exist
+    return fstatat(dir_fd, slice_to_stack_str(command->out_file), &st, 0) ==
+               -1 ||
+           S_ISREG(st.st_mode);
+  }
+  if (CMDISTOUT(*command)) {
+    return !detach;
+  }
+  return fstat(out_fd, &st) == 0 &&
+         (S_ISREG(st.st_mode) ||
+          (!detach && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))));
+}
+
+/// @brief Copy a file to the output like cat would
+/// @return Exit code
+static int exec_forward_fd(int fd, const char *name, int dst, int log_fd) {
+  if (fdcopy(fd, dst)) {
+    return 0;
+  }
+  if (errno == EPIPE) {
+    return 128 + SIGPIPE; // Where cat would have been killed
+  }
+  log_error_fd(log_fd, "cat: %s: %s\n", name, strerror(errno));
+  return 1;
+}
+
+/// @brief Run a forwarding command in the shell, moving the data in the
+/// kernel instead of through a cat process
+static ExecResult exec_forward(Command *command, int dir_fd, int out_fd,
+                               int log_fd, ExecConnect *connects,
+                               ExecResult r) {
+  int filein, fileout;
+  ExecStatusEnum status = exec_open_redirections(
+      command, dir_fd, true, true, log_fd, connects, &filein, &fileout);
+  if (status != EXEC_SUCCESS) {
+    r.status = status;
+    r.exit_code = 1;
+    return r;
+  }
+  const int dst = fileout != -1 ? fileout : out_fd;
+
+  r.exit_code = 0;
+  if (command->args.len == 0) {
+    r.exit_code = exec_forward_fd(filein, "-", dst, log_fd);
+  }
+  for (size_t i = 0; i < command->args.len && r.exit_code <= 1; i++) {
+    char *name = slice_to_stack_str(command->args.data[i]);
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      log_error_fd(log_fd, "cat: %s: %s\n", name, strerror(errno));
+      r.exit_code = 1;
+      continue;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+      // Replaced since exec_forward_ok, copying it might never end
+      log_error_fd(log_fd, "cat: %s: Not a regular file\n", name);
+      r.exit_code = 1;
+      close(fd);
+      continue;
+    }
+    int code = exec_forward_fd(fd, name, dst, log_fd);
+    if (code != 0) {
+      r.exit_code = code;
+    }
+    close(fd);
+  }
+
+  if (filein != -1) {
+    close(filein);
+  }
+  if (fileout != -1) {
+    close(fileout);
+  }
+  return r;
+}
+
+/// @brief Open the file a leading `cat file |` stage would forward
+/// @return Descriptor for the next stage's stdin, -1 to keep the cat stage
+static int exec_forward_head(Pipeline *pipeline, int dir_fd) {
+  Command *first = &pipeline->commands[0];
+  if (pipeline->len < 2 || !exec_is_forward(first) || CMDISFIN(*first) ||
+      CMDISTIN(*first) || first->args.len != 1) {
+    return -1;
+  }
+  int fd = openat(dir_fd, slice_to_stack_str(first->args.data[0]),
+                  O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1; // cat reports it
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+pid_t exec_spawn(const ShellCtx *shell, SpawnRequest *req) {
+  // Resolve through the command cache, execvp would try every PATH entry
+  const char *cmd = req->argv[0];
+  char path[PATH_MAX];
+  pid_t pid = -1;
+  errno = ENOENT;
+  if (strchr(cmd, '/') != NULL) {
+    pid = spawn_command(req);
+  } else if (pathcache_lookup(shell, cmd, path, sizeof(path))) {
+    req->path = path;
+    pid = spawn_command(req);
+    if (pid == -1 && errno == ENOENT) {
+      // Removed since it was cached, look it up again
+      pathcache_forget(cmd);
+      errno = ENOENT;
+      if (pathcache_lookup(shell, cmd, path, sizeof(path))) {
+        pid = spawn_command(req);
+      }
+    }
+  }
+  req->path = NULL;
+  return pid;
+}
+
+/// @brief Seconds between two timevals
+static double exec_tv_diff(struct timeval a, struct timeval b) {
+  return (a.tv_sec - b.tv_sec) + (a.tv_usec - b.tv_usec) / 1e6;
+}
+
+/// @brief Print the report of `time`
+static void exec_print_usage(int fd, const JobUsage *usage) {
+  dprintf(fd,
+          "real\t%.3fs\n"
+          "user\t%.3fs\n"
+          "sys\t%.3fs\n"
+          "maxrss\t%ld KiB\n"
+          "faults\t%ld minor, %ld major\n",
+          usage->real, usage->user, usage->sys, usage->maxrss, usage->minflt,
+          usage->majflt);
+}
+
+/// @brief Add the shell thread's usage since before to a job's
+static void exec_self_usage(JobUsage *usage, const struct rusage *before) {
+  struct rusage now;
+  getrusage(RUSAGE_THREAD, &now);
+  usage->user += exec_tv_diff(now.ru_utime, before->ru_utime);
+  usage->sys += exec_tv_diff(now.ru_stime, before->ru_stime);
+  usage->minflt += now.ru_minflt - before->ru_minflt;
+  usage->majflt += now.ru_majflt - before->ru_majflt;
+}
+
+static ExecResult exec_pipeline(Executor *executor, Pipeline *pipeline,
+                                int in_fd, int out_fd, int log_fd,
+                                ExecResult r);
+static ExecResult exec_pipeline_ready(Executor *executor, ExecResult r);
+static ExecResult exec_spawn_pipeline(Executor *executor, ExecResult r);
+
+/// @brief Run a checked pipeline through the output cache
+/// @param ttl Maximum age of a cached output in seconds, 0 for no limit
+static ExecResult exec_memo(Executor *executor, Pipeline *pipeline, int in_fd,
+                            int out_fd, ExecResult r, long ttl) {
+  Command *last = &pipeline->commands[pipeline->len - 1];
+  MemoKey key;
+  if (r.is_background || CMDISFOUT(*last) || CMDISTOUT(*last) ||
+      !memo_key(&executor->shell, pipeline, in_fd, &key)) {
+    log_warn_fd(out_fd, "memo: output not cacheable, running uncached\n",
+                NULL);
+    return exec_pipeline(executor, pipeline, in_fd, out_fd, out_fd, r);
+  }
+  int cached = memo_open(&key, ttl);
+  if (cached != -1) {
+    log_debug_fd(out_fd, "memo: replaying %016llx\n",
+                 (unsigned long long)key.hash);
+    memo_key_free(&key);
+    r.exit_code = 0;
+    exec_copy_out(executor, cached);
+    return r;
+  }
+
+  // Captured whole, only a successful run is worth replaying. The capture
+  // is saved and copied out by exec_send_capture.
+  int capture = memfd_create("memo", MFD_CLOEXEC);
+  if (capture == -1) {
+    memo_key_free(&key);
+    return exec_pipeline(executor, pipeline, in_fd, out_fd, out_fd, r);
+  }
+  executor->capture = capture;
+  executor->memo = key;
+  return exec_pipeline(executor, pipeline, in_fd, capture, out_fd, r);
+}
+
+/// @brief Run a checked pipeline, memoized if ttl is not -1
+static ExecResult exec_run(Executor *executor, Pipeline *pipeline, int in_fd,
+                           int out_fd, ExecResult r, long ttl) {
+  if (ttl != -1) {
+    return exec_memo(executor, pipeline, in_fd, out_fd, r, ttl);
+  }
+  return exec_pipeline(executor, pipeline, in_fd, out_fd, out_fd, r);
+}
+
+/// @brief Parse the seconds of `memo -t`
+/// @return Seconds, -1 if it is not a number from 0 to LONG_MAX
+static long exec_parse_ttl(Slice arg) {
+  char *s = slice_to_stack_str(arg);
+  char *end;
+  errno = 0;
+  long ttl = strtol(s, &end, 10);
+  if (errno != 0 || end == s || *end != '\0' || ttl < 0) {
+    return -1;
+  }
+  return ttl;
+}
+
+/// @brief Drop the first words of a command, the next one becomes its name
+static void exec_strip_prefix(Command *command, size_t words) {
+  command->name = command->args.data[words - 1];
+  command->args.data += words;
+  command->args.len -= words;
+}
+
+/// @brief Parse the next command line and start it
+/// @details Leaves the result so far in executor->result, and what the
+/// command line is parked for in executor->wait.
+static void exec_begin(Executor *executor, int in_fd, int out_fd,
+                       int (*pre_hook)(Command)) {
   ExecResult r = {
       .status = EXEC_SUCCESS,
       .exit_code = -1,
       .is_background = false,
       .is_pipeline = false,
   };
+  executor->result = r;
+  executor->out_fd = out_fd;
+  executor->wait = EXEC_WAIT_NONE;
+  executor->job = -1;
+  executor->waits_last = false;
+  executor->usage = (JobUsage){0};
+  executor->timed = false;
+  executor->capture = -1;
+  executor->pending.connects[0].fd = -1;
+  executor->pending.connects[1].fd = -1;
 
-  int jobs_range[2] = {-1, -1}; // Start and end of jobs in current pipeline
-  int pipe_in = -1;             // Pipe input
+  // Commands returned by the previous call are done with
+  parse_release(executor->parser);
 
-  while (true) { // Loop Until Command or Pipeline
-    ParseResult pr = parse_next(executor->parser);
-    if (pre_hook != NULL) {
+  ParseResult pr = parse_next(executor->parser);
+  Pipeline *pipeline = &pr.pipeline;
+  if (pre_hook != NULL) {
+    for (size_t i = 0; i < pipeline->len; i++) {
       int phr;
-      if ((phr = pre_hook(pr.command)) != 0) {
-        clear_command_args(pr.command);
-        r.prehook_result = phr;
-        r.status = EXEC_PREHOOK_BREAK;
-        break; // Break Loop
+      if ((phr = pre_hook(pipeline->commands[i])) != 0) {
+        executor->result.prehook_result = phr;
+        executor->result.status = EXEC_PREHOOK_BREAK;
+        return;
       }
     }
+  }
 
-    if (strcmp(slice_to_stack_str(pr.command.name), "jobs") == 0) {
-      for (size_t i = 0; i < executor->jobs->pids_size; i++) {
-        if (executor->jobs->pids[i] != -1) {
-          log_info_fd(out_fd, "PID: %d\n", executor->jobs->pids[i]);
-        }
-      }
-      clear_command_args(pr.command);
-      continue;
+  switch (pr.result) {
+  case PARSE_OK:
+    break;
+  case PARSE_ERROR:
+    executor->result.status = EXEC_PARSE_ERROR;
+    return;
+  case PARSE_EOF:
+    executor->result.status = EXEC_PARSE_EOF;
+    return;
+  default:
+    panicf("Unexpected parse result: %d\n", pr.result);
+  }
+
+  Command *first = &pipeline->commands[0];
+  if (pipeline->len == 1 && first->name.len == 0) {
+    return;
+  }
+
+  // `time` and `memo` prefix the pipeline, its first stage is the next word
+  const Builtin *prefix = builtin_find(first->name);
+  const bool timed = prefix != NULL && prefix->id == BUILTIN_TIME;
+  if (timed && first->args.len == 0) {
+    exec_print_usage(out_fd, &(JobUsage){0});
+    return;
+  }
+  if (timed) {
+    exec_strip_prefix(first, 1);
+    prefix = builtin_find(first->name);
+  }
+  long ttl = -1; // Not memoized
+  if (prefix != NULL && prefix->id == BUILTIN_MEMO) {
+    size_t words = 1;
+    ttl = 0;
+    if (first->args.len >= 1 &&
+        slice_cmp(first->args.data[0], slice_from_str("-t")) == 0) {
+      ttl = first->args.len >= 2 ? exec_parse_ttl(first->args.data[1]) : -1;
+      words = 3;
+    }
+    if (first->args.len < words || ttl < 0) {
+      log_error_fd(out_fd, "memo: usage: memo [-t seconds] command\n", NULL);
+      executor->result.exit_code = 1;
+      return;
     }
+    exec_strip_prefix(first, words);
+  }
 
-    if (strcmp(slice_to_stack_str(pr.command.name), "cd") == 0) {
-      if (pr.command.args.len == 0) {
-        log_error_fd(out_fd, "cd: missing argument\n", NULL);
-        r.status = EXEC_ERROR_FILE_OPEN;
-        clear_command_args(pr.command);
-        return r;
-      }
-      if (chdir(slice_to_stack_str(pr.command.args.data[0])) == -1) {
-        log_error_fd(out_fd, "cd: %s: No such file or directory\n",
-                     slice_to_stack_str(pr.command.args.data[0]));
-        r.status = EXEC_ERROR_FILE_OPEN;
-        clear_command_args(pr.command);
-        return r;
-      }
-      clear_command_args(pr.command);
-      continue;
+  // Nothing is spawned unless the whole pipeline is valid
+  SemanticResult sr = semantic_analyze_pipeline(pipeline);
+  if (sr.result != SEMANTIC_OK) {
+    executor->result.status = EXEC_SEMANTIC_ERROR;
+    executor->result.semantic_reason = sr.reason;
+    return;
+  }
+
+  Command *last = &pipeline->commands[pipeline->len - 1];
+  r.is_background = CMDISBG(*last);
+  r.is_pipeline = pipeline->len > 1;
+  if (timed && r.is_background) {
+    log_warn_fd(out_fd, "time: background jobs are not timed\n", NULL);
+  }
+  if (!timed || r.is_background) {
+    executor->result = exec_run(executor, pipeline, in_fd, out_fd, r, ttl);
+    return;
+  }
+
+  // The shell's own share covers builtins and data it forwarded itself
+  struct rusage self;
+  getrusage(RUSAGE_THREAD, &self);
+  executor->timed = true;
+  clock_gettime(CLOCK_MONOTONIC, &executor->started);
+  executor->result = exec_run(executor, pipeline, in_fd, out_fd, r, ttl);
+  exec_self_usage(&executor->usage, &self);
+}
+
+/// @brief JobDoneFn of the foreground job
+static void exec_job_done(void *arg, JobState state, int status,
+                          const JobUsage *usage) {
+  Executor *executor = arg;
+  executor->job_state = state;
+  executor->job_status = status;
+  executor->job_usage = *usage;
+  atomic_store(&executor->wait_over, true);
+  exec_wake(executor);
+}
+
+/// @brief Park the command line until its foreground job is done or
+/// stopped
+static void exec_await_job(Executor *executor, JobId job) {
+  executor->job = job;
+  executor->wait = EXEC_WAIT_JOB;
+  atomic_store(&executor->wait_over, false);
+  log_debug_fd(executor->out_fd, "Waiting for job %d\n", job);
+  jobs_on_done(executor->jobs, job, exec_job_done, executor);
+}
+
+/// @brief Take how the foreground job ended into the result
+static void exec_job_over(Executor *executor) {
+  if (executor->job_state == JOB_STOPPED) {
+    log_debug_fd(executor->out_fd, "Job %d stopped\n", executor->job);
+  } else if (executor->waits_last) { // The last stage decides
+    executor->result.exit_code = WEXITSTATUS(executor->job_status);
+  }
+  // Added to the shell's share measured so far
+  JobUsage *usage = &executor->job_usage;
+  executor->usage.user += usage->user;
+  executor->usage.sys += usage->sys;
+  executor->usage.maxrss = usage->maxrss;
+  executor->usage.minflt += usage->minflt;
+  executor->usage.majflt += usage->majflt;
+}
+
+/// @brief Save the captured output of a memoized pipeline and copy it out
+static void exec_send_capture(Executor *executor) {
+  const ExecResult *r = &executor->result;
+  int capture = executor->capture;
+  executor->capture = -1;
+  if (r->status == EXEC_SUCCESS && r->exit_code == 0) {
+    memo_save(&executor->memo, capture);
+  }
+  memo_key_free(&executor->memo);
+  lseek(capture, 0, SEEK_SET);
+  exec_copy_out(executor, capture);
+}
+
+/// @brief Go on with what the command line was parked for
+/// @details Called again for nothing is harmless.
+static void exec_step(Executor *executor) {
+  switch (executor->wait) {
+  case EXEC_WAIT_NONE:
+    return;
+  case EXEC_WAIT_JOB:
+    if (atomic_load(&executor->wait_over)) {
+      executor->wait = EXEC_WAIT_NONE;
+      exec_job_over(executor);
+    }
+    return;
+  case EXEC_WAIT_BUILTIN: {
+    BuiltinCtx *ctx = &executor->builtin;
+    int code = ctx->resume(ctx);
+    if (code != BUILTIN_PARKED) {
+      executor->wait = EXEC_WAIT_NONE;
+      executor->result = exec_builtin_over(executor, code, executor->result);
     }
+    return;
+  }
+  case EXEC_WAIT_COPY:
+    if (atomic_load(&executor->wait_over)) {
+      executor->wait = EXEC_WAIT_NONE;
+    }
+    return;
+  case EXEC_WAIT_ADMISSION:
+    if (atomic_load(&executor->wait_over)) {
+      executor->wait = EXEC_WAIT_NONE;
+      executor->result = exec_spawn_pipeline(executor, executor->result);
+    }
+    return;
+  case EXEC_WAIT_CONNECT:
+    if (atomic_load(&executor->wait_over)) {
+      executor->wait = EXEC_WAIT_NONE;
+      executor->result = exec_pipeline_ready(executor, executor->result);
+    }
+    return;
+  }
+}
 
-    switch (pr.result) {
-    case PARSE_OK:
+/// @brief Drive the command line until it is over or parked
+/// @param woken Was it handed back by done
+/// @return Is it over
+static bool exec_drive(Executor *executor, bool woken) {
+  struct rusage self;
+  if (executor->timed) {
+    getrusage(RUSAGE_THREAD, &self);
+  }
+  bool parked = false;
+  while (true) {
+    if (woken) {
+      exec_step(executor);
+    }
+    if (executor->wait == EXEC_WAIT_NONE && executor->capture != -1) {
+      exec_send_capture(executor);
+    }
+    if (executor->wait == EXEC_WAIT_NONE) {
       break;
-    case PARSE_ERROR:
-      r.status = EXEC_PARSE_ERROR;
-      clear_command_args(pr.command);
-      // FIXME: Clear pipeline and next commands
-      return r;
-    case PARSE_EOF:
-      assertf(pipe_in == -1, "Unexpected EOF while parsing pipeline", NULL);
-      r.status = EXEC_PARSE_EOF;
-      clear_command_args(pr.command);
-      return r;
-    default:
-      panicf("Unexpected parse result: %d\n", pr.result);
-    }
-
-    if (pr.command.name.len == 0) {
-      continue;
     }
+    ExecWake awake = EXEC_AWAKE;
+    if (atomic_compare_exchange_strong(&executor->wake, &awake,
+                                       EXEC_PARKED)) {
+      parked = true;
+      break;
+    }
+    atomic_store(&executor->wake, EXEC_AWAKE); // A callback came meanwhile
+    woken = true;
+  }
+  // The executor is not touched once parked, but for the usage of `time`
+  // that only the driving thread writes
+  if (executor->timed) {
+    exec_self_usage(&executor->usage, &self);
+  }
+  if (parked) {
+    return false;
+  }
+  executor->state = EXEC_STATE_REAPED;
+  return true;
+}
+
+/// @brief What exec_next waits on
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool woken;
+} ExecWaiter;
+
+/// @brief ExecDoneFn of exec_next
+static void exec_next_wake(Executor *executor __attribute__((unused)),
+                           void *arg) {
+  ExecWaiter *w = arg;
+  pthread_mutex_lock(&w->mutex);
+  w->woken = true;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+}
 
-    SemanticResult sr = semantic_analyze(&pr.command);
-    if (sr.result != SEMANTIC_OK) {
-      r.status = EXEC_SEMANTIC_ERROR;
-      r.semantic_reason = sr.reason;
-      return r;
+ExecResult exec_next(Executor *executor, int in_fd, int out_fd,
+                     int (*pre_hook)(Command)) {
+  ExecWaiter w = {
+      .mutex = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+  };
+  bool over =
+      exec_start(executor, in_fd, out_fd, pre_hook, exec_next_wake, &w);
+  while (!over) {
+    pthread_mutex_lock(&w.mutex);
+    while (!w.woken) {
+      pthread_cond_wait(&w.cond, &w.mutex);
     }
+    w.woken = false;
+    pthread_mutex_unlock(&w.mutex);
+    over = exec_resume(executor);
+  }
+  return exec_finish(executor);
+}
 
-    r.is_background = r.is_background || CMDISBG(pr.command);
-    r.is_pipeline = r.is_pipeline || CMDISPIPE(pr.command);
+bool exec_start(Executor *executor, int in_fd, int out_fd,
+                int (*pre_hook)(Command), ExecDoneFn done, void *arg) {
+  assertf(executor->state == EXEC_STATE_IDLE, "executor is busy", NULL);
+  executor->state = EXEC_STATE_RUNNING;
+  executor->done = done;
+  executor->done_arg = arg;
+  atomic_store(&executor->wake, EXEC_AWAKE);
+  exec_begin(executor, in_fd, out_fd, pre_hook);
+  return exec_drive(executor, false);
+}
 
-    // Move Arguments to Stack
-    const int argc = pr.command.args.len + /*cmd*/ 1 + /*NULL*/ 1;
-    char *argv[argc];
-    char *cmd = slice_to_stack_str(pr.command.name);
-    argv[0] = cmd;
-    for (size_t i = 0; i < pr.command.args.len; i++) {
-      argv[i + 1] = slice_to_stack_str(pr.command.args.data[i]);
+bool exec_resume(Executor *executor) {
+  assertf(executor->state == EXEC_STATE_RUNNING, "executor is not parked",
+          NULL);
+  return exec_drive(executor, true);
+}
+
+ExecResult exec_finish(Executor *executor) {
+  assertf(executor->state == EXEC_STATE_REAPED, "executor is not done", NULL);
+  ExecResult r = executor->result;
+  if (executor->timed) {
+    JobUsage usage = executor->usage;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usage.real = (end.tv_sec - executor->started.tv_sec) +
+                 (end.tv_nsec - executor->started.tv_nsec) / 1e9;
+    exec_print_usage(executor->out_fd, &usage);
+  }
+  // Made for a pipeline that did not run
+  for (size_t i = 0; i < 2; i++) {
+    if (executor->pending.connects[i].fd != -1) {
+      close(executor->pending.connects[i].fd);
+      executor->pending.connects[i].fd = -1;
     }
-    argv[argc - 1] = NULL;
+  }
+  executor->state = EXEC_STATE_IDLE;
+  executor->job = -1;
+  return r;
+}
+
+/// @brief AdmitFn of a parked pipeline
+static void exec_admitted(void *arg) {
+  Executor *executor = arg;
+  atomic_store(&executor->wait_over, true);
+  exec_wake(executor);
+}
 
-    clear_command_args(pr.command);
+/// @brief TcpDoneFn of a pipeline's redirection
+static void exec_connected(void *arg, int fd, const char *err) {
+  ExecConnect *c = arg;
+  Executor *executor = c->executor;
+  c->fd = fd;
+  c->err = err;
+  if (atomic_fetch_sub(&executor->connecting, 1) == 1) {
+    atomic_store(&executor->wait_over, true);
+    exec_wake(executor);
+  }
+}
 
-    int pipefd[2];
-    if (CMDISPIPE(pr.command)) {
-      assertf(pipe(pipefd) != -1, "pipe failed", NULL);
+/// @brief Start the TCP connections of the pending pipeline
+/// @details Made before anything runs, so a pipeline that cannot have them
+/// does not start at all. The outcome is taken by exec_open_redirections.
+/// @return Is the command line parked until they are made
+static bool exec_connect(Executor *executor) {
+  ExecPending *pending = &executor->pending;
+  Command *first = &pending->source.commands[0];
+  Command *last = &pending->source.commands[pending->source.len - 1];
+  const Slice *targets[2] = {
+      CMDISTIN(*first) ? &first->in_tcp : NULL,
+      CMDISTOUT(*last) ? &last->out_tcp : NULL,
+  };
+  if (targets[0] == NULL && targets[1] == NULL) {
+    return false;
+  }
+  executor->wait = EXEC_WAIT_CONNECT;
+  atomic_store(&executor->wait_over, false);
+  // One more until every connect started, none can end the wait before
+  atomic_store(&executor->connecting, 1);
+  for (size_t i = 0; i < 2; i++) {
+    pending->connects[i] = (ExecConnect){.executor = executor, .fd = -1};
+    if (targets[i] != NULL) {
+      atomic_fetch_add(&executor->connecting, 1);
+      const Slice slice = *targets[i];
+      char *target = slice_to_stack_str(slice);
+      tcp_connect_start(target, TCP_CONNECT_TIMEOUT_MS, exec_connected,
+                        &pending->connects[i]);
     }
+  }
+  if (atomic_fetch_sub(&executor->connecting, 1) == 1) {
+    executor->wait = EXEC_WAIT_NONE; // All over already
+    return false;
+  }
+  log_debug_fd(pending->log_fd, "Connecting\n", NULL);
+  return true;
+}
 
-    pid_t main_pid = getpid();
-    pid_t pid = fork();
-    assertf(pid != -1, "fork failed", NULL);
-    if (pid == 0) {
-      if (r.is_background) {
-        setpgid(0, abs(main_pid));
-      } else {
-        setpgid(0, 0);
-      }
+/// @brief Run a checked pipeline
+/// @param out_fd Output of the pipeline
+/// @param log_fd Where the shell reports errors
+/// @details The command line is parked until its TCP redirections are
+/// connected, then until the pipeline is admitted, then until a foreground
+/// job is over.
+static ExecResult exec_pipeline(Executor *executor, Pipeline *pipeline,
+                                int in_fd, int out_fd, int log_fd,
+                                ExecResult r) {
+  // Kept by value, the command line may be parked before it is spawned
+  ExecPending *pending = &executor->pending;
+  pending->source = *pipeline;
+  pending->stages = *pipeline;
+  pending->head_fd = -1;
+  pending->in_fd = in_fd;
+  pending->out_fd = out_fd;
+  pending->log_fd = log_fd;
+  if (exec_connect(executor)) {
+    return r;
+  }
+  return exec_pipeline_ready(executor, r);
+}
 
-      if (CMDISTIN(pr.command) || CMDISTOUT(pr.command)) {
-        not_implemented(); // TCP IN/OUT not implemented
-      }
+/// @brief Run the pending pipeline of exec_pipeline once it is connected
+static ExecResult exec_pipeline_ready(Executor *executor, ExecResult r) {
+  ExecPending *pending = &executor->pending;
+  Command *first = &pending->source.commands[0];
+  const int out_fd = pending->out_fd;
+  const int log_fd = pending->log_fd;
 
-      if (pipe_in != -1) {
-        assertf(dup2(pipe_in, STDIN_FILENO) != -1, "dup2 failed", NULL);
-        close(pipe_in);
-      } else if (CMDISFIN(pr.command)) {
-        int filein = open(slice_to_stack_str(pr.command.in_file), O_RDONLY);
-        assertf(dup2(filein, STDIN_FILENO) != -1, "dup2 failed", NULL);
-        close(filein);
-      } else {
-        assertf(dup2(in_fd, STDIN_FILENO) != -1, "dup2 failed", NULL);
-      }
+  // Builtins run in the shell itself, unless they are part of a pipeline or
+  // in the background
+  const Builtin *builtin = builtin_find(first->name);
+  if (!r.is_pipeline && !r.is_background && builtin != NULL &&
+      builtin->run != NULL) {
+    return exec_builtin(executor, builtin, first, out_fd, r);
+  }
+  if (!r.is_pipeline && !r.is_background && exec_is_forward(first) &&
+      (first->args.len > 0 || CMDISFIN(*first)) &&
+      exec_forward_ok(first, executor->shell.dir_fd, out_fd,
+                      executor->detach_output)) {
+    return exec_forward(first, executor->shell.dir_fd, out_fd, log_fd,
+                        pending->connects, r);
+  }
 
-      if (CMDISPIPE(pr.command)) {
-        assertf(dup2(pipefd[1], STDOUT_FILENO) != -1, "dup2 failed", NULL);
-        close(pipefd[1]);
-      } else if (CMDISFOUT(pr.command)) {
-        int fileout = open(slice_to_stack_str(pr.command.out_file),
-                           O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        assertf(dup2(fileout, STDOUT_FILENO) != -1, "dup2 failed", NULL);
-        close(fileout);
-      } else {
-        assertf(dup2(out_fd, STDOUT_FILENO) != -1, "dup2 failed", NULL);
-      }
+  // `cat file | cmd` runs as `cmd < file`, one process and one copy less
+  pending->head_fd =
+      exec_forward_head(&pending->source, executor->shell.dir_fd);
+  if (pending->head_fd != -1) {
+    pending->stages.commands++;
+    pending->stages.len--;
+  }
 
-      log_debug_fd(out_fd, "Executing command: %s\n", cmd);
-      execvp(cmd, argv);
-      log_warn_fd(out_fd, "Command not found: %s\n", cmd);
-      _exit(1);
-    }
+  // Room for the whole pipeline before any stage starts: a stage admitted
+  // alone could block on a pipe whose other end is still queued. Never
+  // asked for under the reaper hold, a release from the reaper would need
+  // it.
+  executor->wait = EXEC_WAIT_ADMISSION;
+  atomic_store(&executor->wait_over, false);
+  if (!admission_try(executor->jobs->admission, executor,
+                     pending->stages.len, exec_admitted, executor)) {
+    log_debug_fd(log_fd, "Waiting for admission\n", NULL);
+    return r;
+  }
+  executor->wait = EXEC_WAIT_NONE;
+  return exec_spawn_pipeline(executor, r);
+}
 
-    if (CMDISPIPE(pr.command)) {
-      close(pipefd[1]);
-      pipe_in = pipefd[0];
-    }
+/// @brief Spawn the admitted pipeline of exec_pipeline
+static ExecResult exec_spawn_pipeline(Executor *executor, ExecResult r) {
+  ExecPending *pending = &executor->pending;
+  Pipeline *pipeline = &pending->stages;
+  const int head_fd = pending->head_fd;
+  const int in_fd = pending->in_fd;
+  const int out_fd = pending->out_fd;
+  const int log_fd = pending->log_fd;
+  Admission *admission = executor->jobs->admission;
 
-    size_t jobid = push_pid(executor->jobs, pid, r.is_pipeline);
-    if (jobs_range[0] == -1) {
-      jobs_range[0] = jobid;
+  // Open every redirection up front, a pipeline that cannot have all of
+  // them does not start at all
+  const size_t npipes = pipeline->len - 1;
+  int fileins[npipes + 1];
+  int fileouts[npipes + 1];
+  for (size_t stage = 0; stage < pipeline->len; stage++) {
+    ExecStatusEnum status = exec_open_redirections(
+        &pipeline->commands[stage], executor->shell.dir_fd, stage == 0,
+        stage == npipes, log_fd, pending->connects, &fileins[stage],
+        &fileouts[stage]);
+    if (status == EXEC_SUCCESS) {
+      continue;
     }
-    jobs_range[1] = jobid + 1;
-
-    if (!CMDISPIPE(pr.command)) {
-      break;
+    exec_close_redirections(fileins, fileouts, stage);
+    if (head_fd != -1) {
+      close(head_fd);
     }
+    admission_release(admission, executor, pipeline->len);
+    r.status = status;
+    r.exit_code = 1;
+    return r;
   }
 
-  if (r.is_background) {
-    log_debug_fd(out_fd, "Running in background\n", NULL);
-    pid_t main_pid = getpid();
-    for (int i = jobs_range[0]; i < jobs_range[1]; i++) {
-      pid_t pid = executor->jobs->pids[i];
-      if (pid == -1) {
-        log_debug_fd(out_fd, "Skipping PID %d\n", pid);
-        continue;
-      }
+  // Create every pipe up front, pipes[i] connects stage i to stage i + 1.
+  // They are close-on-exec, each child only keeps what it dup2s.
+  int pipes[npipes + 1][2];
+  for (size_t i = 0; i < npipes; i++) {
+    assertf(pipe2(pipes[i], O_CLOEXEC) != -1, "pipe failed", NULL);
+  }
 
-      int status;
-      bool is_process_running;
-      if (waitpid(pid, &status, WNOHANG) == 0) {
-        is_process_running = true;
-      } else {
-        is_process_running = false;
-      }
+  // Nothing is reaped before it is added to the job: the stages join the
+  // group of the first one, which must still exist, and an exit reported
+  // for a pid of no job is dropped
+  reaper_hold();
 
-      if (!is_process_running) {
-        log_debug_fd(out_fd, "Removing PID %d\n", pid);
-        remove_pid(executor->jobs, pid);
-        continue;
-      } else {
-        log_debug_fd(out_fd, "Setting PGID for PID %d\n", pid);
-        setpgid(pid, abs(main_pid));
-      }
+  pid_t pgid = 0; // Process group of the pipeline, the first stage leads it
+  pid_t last_pid = -1;
+  JobId job = -1;
+  for (size_t stage = 0; stage < pipeline->len; stage++) {
+    Command *command = &pipeline->commands[stage];
+
+    // Move Arguments to Stack
+    const int argc = command->args.len + /*cmd*/ 1 + /*NULL*/ 1;
+    char *argv[argc];
+    char *cmd = slice_to_stack_str(command->name);
+    argv[0] = cmd;
+    for (size_t i = 0; i < command->args.len; i++) {
+      argv[i + 1] = slice_to_stack_str(command->args.data[i]);
     }
-    return r;
-  }
+    argv[argc - 1] = NULL;
+
+    const int filein = fileins[stage];
+    const int fileout = fileouts[stage];
+    SpawnRequest req = {
+        .argv = argv,
+        .stdin_fd = stage > 0      ? pipes[stage - 1][0]
+                    : head_fd != -1 ? head_fd
+                    : filein != -1  ? filein
+                                    : in_fd,
+        .stdout_fd = stage < npipes ? pipes[stage][1]
+                     : fileout != -1 ? fileout
+                                     : out_fd,
+        // Background jobs stay in the shell's group
+        .pgid = r.is_background ? -1 : pgid,
+        .log_fd = log_fd,
+        .dir_fd = executor->shell.dir_fd,
+        .envp = executor->shell.env,
+    };
 
-  log_debug_fd(out_fd, "Waiting for jobs from %d to %d\n", jobs_range[0],
-               jobs_range[1]);
-  for (int i = jobs_range[0]; i < jobs_range[1]; i++) {
-    int status;
-    pid_t pid = executor->jobs->pids[i];
+    pid_t pid = exec_spawn(&executor->shell, &req);
     if (pid == -1) {
-      log_debug_fd(out_fd, "Skipping PID %d\n", pid);
-      continue;
-    }
-    do {
-      log_debug_fd(out_fd, "Waiting for PID %d\n", pid);
-      pid_t wpid = waitpid(pid, &status, WUNTRACED);
-      if (WIFSTOPPED(status)) {
-        log_debug_fd(out_fd, "PID %d stopped\n", pid);
-        break;
-      }
-      if (WIFSIGNALED(status)) {
-        log_debug_fd(out_fd, "PID %d signaled\n", pid);
-        break;
+      if (errno == ENOENT) {
+        log_warn_fd(log_fd, "Command not found: %s\n", cmd);
+      } else {
+        log_error_fd(log_fd, "Unable to run %s: %s\n", cmd, strerror(errno));
       }
-      if (WIFEXITED(status)) {
-        log_debug_fd(out_fd, "PID %d exited\n", pid);
-        break;
+      admission_release(admission, executor, 1);
+      if (stage == npipes) {
+        r.exit_code = 127;
       }
-      if (wpid == -1) {
-        panic("waitpid failed");
+      continue;
+    }
+
+    // Set the group from both sides, so it is in place whichever runs first
+    if (!r.is_background) {
+      if (pgid == 0) {
+        pgid = pid;
       }
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-    if (!r.is_pipeline) {
-      r.exit_code = WEXITSTATUS(status);
+      setpgid(pid, pgid);
     }
-    remove_pid(executor->jobs, pid);
+    if (stage == npipes) {
+      last_pid = pid;
+    }
+
+    if (job == -1) {
+      char cmdline[JOB_CMDLINE_MAX];
+      exec_cmdline(&pending->source, cmdline, sizeof(cmdline));
+      job = jobs_add(executor->jobs, executor, r.is_background, cmdline);
+    }
+    jobs_add_pid(executor->jobs, job, pid, r.is_background ? getpgrp() : pgid);
+  }
+
+  exec_close_redirections(fileins, fileouts, pipeline->len);
+  for (size_t i = 0; i < npipes; i++) {
+    close(pipes[i][0]);
+    close(pipes[i][1]);
   }
+  if (head_fd != -1) {
+    close(head_fd);
+  }
+  reaper_release();
+  if (job == -1) {
+    return r; // Nothing was started
+  }
+  jobs_seal(executor->jobs, job);
+
+  if (r.is_background) {
+    log_debug_fd(log_fd, "Running in background\n", NULL);
+    return r;
+  }
+
+  executor->waits_last = last_pid != -1;
+  exec_await_job(executor, job);
   return r;
 }
@@ -1,9 +1,15 @@
 #pragma once
 
+#include "builtins.h"
+#include "jobs.h"
+#include "memo.h"
 #include "parser.h"
+#include "procspawn.h"
 #include "semantic_analysis.h"
+#include "shellctx.h"
 #include "types.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -18,6 +24,8 @@ typedef enum {
   EXEC_IN_BACKGROUND,
   EXEC_PIPELINE,
   EXEC_ERROR_FILE_OPEN,
+  EXEC_ERROR_CONNECT, // TCP redirection
+  EXEC_EXIT, // `exit` builtin
 } ExecStatusEnum;
 
 typedef struct {
@@ -29,37 +37,89 @@ typedef struct {
   int prehook_result;
 } ExecResult;
 
-typedef struct {
-  pid_t *pids;
-  size_t pids_size;
-  size_t pids_capacity;
+/// @brief Progress of the command line an executor runs
+typedef enum {
+  EXEC_STATE_IDLE,    // Nothing in flight
+  EXEC_STATE_RUNNING, // Parked, exec_resume goes on once done is called
+  EXEC_STATE_REAPED,  // Over, exec_finish makes the result
+} ExecState;
+
+/// @brief What a running command line is parked for
+typedef enum {
+  EXEC_WAIT_NONE,
+  EXEC_WAIT_JOB,       // The foreground job to be reaped
+  EXEC_WAIT_BUILTIN,   // A builtin that returned BUILTIN_PARKED
+  EXEC_WAIT_COPY,      // Output copied by fdcopy_start
+  EXEC_WAIT_ADMISSION, // Room for the processes of a pipeline
+  EXEC_WAIT_CONNECT,   // The TCP redirections of a pipeline
+} ExecWait;
 
-  pthread_mutex_t mutex;
-} Jobs;
+/// @brief Who drives a running command line
+typedef enum {
+  EXEC_AWAKE,  // The caller of exec_start or exec_resume
+  EXEC_WOKEN,  // The same, and a callback came meanwhile
+  EXEC_PARKED, // Nobody, the next callback calls done
+} ExecWake;
 
-/// @brief Create a new jobs struct
-/// @note Allocates memory, so you must call jobs_free when done
-Jobs *jobs_new(void);
+typedef struct Executor Executor;
 
-/// @brief Free a jobs struct
-void jobs_free(Jobs *jobs);
+/// @brief TCP redirection of a pipeline, made by tcp_connect_start
+typedef struct {
+  Executor *executor;
+  int fd;          // Connected socket, -1 if none
+  const char *err; // Reason of a failure, NULL if none
+} ExecConnect;
 
-/// @brief Push a pid to the jobs list
-/// @param jobs Jobs struct
-/// @param pid Process ID
-/// @param next If true, push to the end of the list
-size_t push_pid(Jobs *jobs, int pid, bool next);
+/// @brief A pipeline waiting for its connections or admission, spawned
+/// once admitted
+typedef struct {
+  Pipeline source;         // What the job is listed as
+  Pipeline stages;         // What is spawned
+  int head_fd;             // Input of the first stage, -1 if none
+  ExecConnect connects[2]; // Stdin of the first stage, stdout of the last
+  int in_fd;
+  int out_fd;
+  int log_fd;
+} ExecPending;
 
-/// @brief Remove a pid from the jobs list
-/// @param jobs Jobs struct
-/// @param pid Process ID
-void remove_pid(Jobs *jobs, int pid);
+/// @brief Called once a parked command line can go on
+typedef void (*ExecDoneFn)(Executor *executor, void *arg);
 
 /// @brief Executor struct
-typedef struct {
+struct Executor {
   Parser *parser;
   Jobs *jobs;
-} Executor;
+  ShellCtx shell; // The process's unless replaced (server sessions)
+  bool detach_output; // Copy bulk output with fdcopy_start: the thread is
+                      // shared and the output may be a slow client
+
+  // Command line in flight
+  ExecState state;
+  ExecResult result;
+  int out_fd;
+  JobId job;        // Foreground job to wait for, -1 if none
+  bool waits_last;  // The last stage runs, its status is the exit code
+  JobUsage usage;   // Of the job, then of the shell's share too (time)
+  bool timed;
+  struct timespec started;
+  int capture;      // Output kept for the cache, -1 if none
+  MemoKey memo;
+  BuiltinCtx builtin; // Of a parked builtin
+  int builtin_files[2]; // Its redirections, -1 if none
+  ExecPending pending;
+  ExecDoneFn done;
+  void *done_arg;
+
+  // Parking, written by the callbacks while the command line waits
+  ExecWait wait;
+  _Atomic ExecWake wake;
+  atomic_bool wait_over; // The job was reaped, the copy is over, the
+                         // pipeline was admitted or connected
+  atomic_int connecting; // Connections not made yet
+  JobState job_state;
+  int job_status;
+  JobUsage job_usage;
+};
 
 /// @brief Create a new executor
 /// @note Allocates memory, so you must call executor_free when done
@@ -73,3 +133,39 @@ Executor executor_new(Parser *parser, Jobs *jobs);
 /// the pre-hook returns a non-zero value, the command will not be executed.
 ExecResult exec_next(Executor *executor, int in_fd, int out_fd,
                      int (*pre_hook)(Command));
+
+/// @brief Start the next command or pipeline without waiting for it
+/// @details Parsing, builtins and spawning happen here. Whatever would
+/// block the thread parks the command line instead (EXEC_STATE_RUNNING):
+/// TCP connections, admission, the foreground job, `wait`, and with
+/// detach_output the copies of a cached or captured output. Once it can go
+/// on, done is called and the caller calls exec_resume. The result is the
+/// same exec_next would give, taken with exec_finish. Builtins still write
+/// their own short output (echo, pwd, errors) straight to out_fd.
+/// @param in_fd Input file descriptor
+/// @param out_fd Output file descriptor, used until exec_finish
+/// @param pre_hook As for exec_next
+/// @param done Called once the parked command line can go on, on the
+/// thread of the callback that woke it (the reaper, a copy, admission, a
+/// connection). It must not block, nor call exec_resume itself.
+/// @param arg Argument of done
+/// @return Is it over already, done is then not called
+bool exec_start(Executor *executor, int in_fd, int out_fd,
+                int (*pre_hook)(Command), ExecDoneFn done, void *arg);
+
+/// @brief Go on with a command line parked by exec_start
+/// @note Call it once for every call of done
+/// @return Is it over, done is called again otherwise
+bool exec_resume(Executor *executor);
+
+/// @brief Complete the command line started by exec_start
+/// @details Writes the `time` report.
+/// @note Call it once exec_start or exec_resume returned true
+ExecResult exec_finish(Executor *executor);
+
+/// @brief Spawn a command, resolving argv[0] through the command cache
+/// @param shell Context whose PATH and directory the lookup uses, the same
+/// the request's dir_fd and envp come from
+/// @param req Request, its path is filled in by the lookup
+/// @return pid of the child, -1 and errno set (ENOENT if not found)
+pid_t exec_spawn(const ShellCtx *shell, SpawnRequest *req);
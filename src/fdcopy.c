@@ -0,0 +1,288 @@
+#define _GNU_SOURCE // copy_file_range, splice
+#include "fdcopy.h"
+#include "panic.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FDCOPY_CHUNK (1 << 30) // Per syscall, well under the 2GB limits
+#define FDCOPY_PIPE_CHUNK (1 << 16)
+#define FDCOPY_BUF 65536
+#define FDCOPY_TURN (1 << 20) // Sent to one destination before the next
+#define FDCOPY_EVENTS 64
+
+/// @brief Result of a fast path
+typedef enum {
+  FDCOPY_DONE,
+  FDCOPY_ERROR,
+  FDCOPY_UNSUPPORTED, // Nothing fatal, the next method takes over
+} FdcopyResult;
+
+/// @brief Can the next method carry on after this errno
+static bool fdcopy_unsupported(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP ||
+         err == EBADF;
+}
+
+/// @brief Run a zero-copy syscall until EOF
+/// @details Offsets are the descriptors' own, so a method that gives up
+/// halfway leaves the next one at the right place.
+static FdcopyResult fdcopy_loop(int in_fd, int out_fd,
+                                ssize_t (*step)(int, int)) {
+  while (true) {
+    ssize_t n = step(in_fd, out_fd);
+    if (n == 0) {
+      return FDCOPY_DONE;
+    }
+    if (n > 0) {
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    return fdcopy_unsupported(errno) ? FDCOPY_UNSUPPORTED : FDCOPY_ERROR;
+  }
+}
+
+static ssize_t fdcopy_range_step(int in_fd, int out_fd) {
+  return copy_file_range(in_fd, NULL, out_fd, NULL, FDCOPY_CHUNK, 0);
+}
+
+static ssize_t fdcopy_sendfile_step(int in_fd, int out_fd) {
+  return sendfile(out_fd, in_fd, NULL, FDCOPY_CHUNK);
+}
+
+static ssize_t fdcopy_splice_step(int in_fd, int out_fd) {
+  return splice(in_fd, NULL, out_fd, NULL, FDCOPY_PIPE_CHUNK, SPLICE_F_MOVE);
+}
+
+/// @brief Copy through a user-space buffer
+static bool fdcopy_rw(int in_fd, int out_fd) {
+  char buf[FDCOPY_BUF];
+  while (true) {
+    ssize_t n = read(in_fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0;
+    }
+    for (ssize_t off = 0; off < n;) {
+      ssize_t w = write(out_fd, buf + off, n - off);
+      if (w == -1 && errno == EINTR) {
+        continue;
+      }
+      if (w == -1) {
+        return false;
+      }
+      off += w;
+    }
+  }
+}
+
+bool fdcopy(int in_fd, int out_fd) {
+  struct stat in_st, out_st;
+  if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+    return false;
+  }
+
+  // Files claiming to be empty may be generated on read (/proc), only a
+  // plain read sees their content
+  const bool in_file = S_ISREG(in_st.st_mode) && in_st.st_size > 0;
+
+  FdcopyResult res = FDCOPY_UNSUPPORTED;
+  if (in_file && S_ISREG(out_st.st_mode)) {
+    res = fdcopy_loop(in_fd, out_fd, fdcopy_range_step);
+  }
+  if (res == FDCOPY_UNSUPPORTED && in_file) {
+    res = fdcopy_loop(in_fd, out_fd, fdcopy_sendfile_step);
+  }
+  if (res == FDCOPY_UNSUPPORTED &&
+      (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))) {
+    res = fdcopy_loop(in_fd, out_fd, fdcopy_splice_step);
+  }
+  if (res == FDCOPY_UNSUPPORTED) {
+    return fdcopy_rw(in_fd, out_fd);
+  }
+  return res == FDCOPY_DONE;
+}
+
+/// @brief Copy started by fdcopy_start
+typedef struct FdcopyTask {
+  int in_fd;
+  int out_fd;
+  off_t off;  // Next byte of in_fd to send
+  bool armed; // out_fd is in the copier's epoll
+  FdcopyDoneFn done;
+  void *arg;
+  struct FdcopyTask *next; // Queued for the copier
+} FdcopyTask;
+
+/// @brief The copier: one thread moving every started copy along
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t over;  // A copy is over
+  size_t running;       // Started by fdcopy_start, not over yet
+  pthread_once_t once;
+  bool started;         // The thread runs, copies are inline otherwise
+  int epoll_fd;         // Destinations waiting for room
+  int wake_fd;          // eventfd, tasks were queued
+  FdcopyTask *queued;   // Not seen by the copier yet
+  char buf[FDCOPY_BUF]; // Only used by the copier
+} copier = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .over = PTHREAD_COND_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+    .epoll_fd = -1,
+    .wake_fd = -1,
+};
+
+/// @brief End a copy: close its source, call done and count it out
+static void fdcopy_finish(FdcopyTask *task, bool ok) {
+  if (task->armed) {
+    epoll_ctl(copier.epoll_fd, EPOLL_CTL_DEL, task->out_fd, NULL);
+  }
+  close(task->in_fd);
+  task->done(task->arg, ok);
+  free(task);
+
+  pthread_mutex_lock(&copier.mutex);
+  if (--copier.running == 0) {
+    pthread_cond_broadcast(&copier.over);
+  }
+  pthread_mutex_unlock(&copier.mutex);
+}
+
+/// @brief Send what a socket takes now, then wait in epoll for more room
+/// @details A turn sends FDCOPY_TURN bytes at most, so one fast client
+/// cannot hold the copier. Destinations that are not sockets are copied
+/// with fdcopy at once, they do not make the copier wait for long.
+static void fdcopy_step(FdcopyTask *task) {
+  for (size_t sent = 0; sent < FDCOPY_TURN;) {
+    ssize_t n = pread(task->in_fd, copier.buf, sizeof(copier.buf), task->off);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fdcopy_finish(task, n == 0);
+      return;
+    }
+    ssize_t w =
+        send(task->out_fd, copier.buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w == -1 && errno == ENOTSOCK) {
+      bool ok = lseek(task->in_fd, task->off, SEEK_SET) != -1 &&
+                fdcopy(task->in_fd, task->out_fd);
+      fdcopy_finish(task, ok);
+      return;
+    }
+    if (w == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      fdcopy_finish(task, false);
+      return;
+    }
+    if (w == -1) {
+      break; // Full
+    }
+    task->off += w;
+    sent += w;
+  }
+  // Full, or its turn is over: the next turn comes once there is room
+  struct epoll_event ev = {.events = EPOLLOUT | EPOLLONESHOT, .data.ptr = task};
+  int op = task->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(copier.epoll_fd, op, task->out_fd, &ev) == -1) {
+    fdcopy_finish(task, false);
+    return;
+  }
+  task->armed = true;
+}
+
+static void *fdcopy_thread(void *arg __attribute__((unused))) {
+  struct epoll_event events[FDCOPY_EVENTS];
+  while (true) {
+    int n = epoll_wait(copier.epoll_fd, events, FDCOPY_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr != NULL) {
+        fdcopy_step(events[i].data.ptr);
+        continue;
+      }
+      uint64_t count;
+      if (read(copier.wake_fd, &count, sizeof(count)) == -1) {
+        continue;
+      }
+      pthread_mutex_lock(&copier.mutex);
+      FdcopyTask *task = copier.queued;
+      copier.queued = NULL;
+      pthread_mutex_unlock(&copier.mutex);
+      while (task != NULL) {
+        FdcopyTask *next = task->next;
+        fdcopy_step(task);
+        task = next;
+      }
+    }
+  }
+  return NULL;
+}
+
+/// @brief Start the copier, copies run inline if it cannot be
+static void fdcopy_init(void) {
+  copier.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  copier.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  copier.started =
+      copier.epoll_fd != -1 && copier.wake_fd != -1 &&
+      epoll_ctl(copier.epoll_fd, EPOLL_CTL_ADD, copier.wake_fd, &ev) == 0 &&
+      pthread_create(&thread, &attr, fdcopy_thread, NULL) == 0;
+  pthread_attr_destroy(&attr);
+}
+
+void fdcopy_start(int in_fd, int out_fd, FdcopyDoneFn done, void *arg) {
+  pthread_once(&copier.once, fdcopy_init);
+  FdcopyTask *task = malloc(sizeof(FdcopyTask));
+  assertf(task != NULL, "malloc failed", NULL);
+  *task = (FdcopyTask){
+      .in_fd = in_fd,
+      .out_fd = out_fd,
+      .off = lseek(in_fd, 0, SEEK_CUR),
+      .done = done,
+      .arg = arg,
+  };
+  bool queue = copier.started && task->off != -1;
+  pthread_mutex_lock(&copier.mutex);
+  copier.running++;
+  if (queue) {
+    task->next = copier.queued;
+    copier.queued = task;
+  }
+  pthread_mutex_unlock(&copier.mutex);
+
+  if (!queue) {
+    fdcopy_finish(task, fdcopy(in_fd, out_fd));
+    return;
+  }
+  uint64_t one = 1;
+  assertf(write(copier.wake_fd, &one, sizeof(one)) == sizeof(one),
+          "eventfd write failed", NULL);
+}
+
+void fdcopy_drain(void) {
+  pthread_mutex_lock(&copier.mutex);
+  while (copier.running != 0) {
+    pthread_cond_wait(&copier.over, &copier.mutex);
+  }
+  pthread_mutex_unlock(&copier.mutex);
+}
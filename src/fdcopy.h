@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+
+/// @brief Copy everything from one descriptor to another, in the kernel
+/// @details Uses copy_file_range between regular files, sendfile from a
+/// regular file to anything (sockets included) and splice when either end
+/// is a pipe. Falls back to read/write for the rest.
+/// @param in_fd Source, read until EOF
+/// @param out_fd Destination
+/// @return is ok, errno set on failure
+bool fdcopy(int in_fd, int out_fd);
+
+/// @brief Called once a copy started by fdcopy_start is over
+/// @param ok Did the copy succeed
+typedef void (*FdcopyDoneFn)(void *arg, bool ok);
+
+/// @brief Copy like fdcopy in the background
+/// @details For a destination that may not take the data for long (a
+/// client that does not read), the calling thread goes on meanwhile. One
+/// copier thread serves every copy: sockets are written without blocking
+/// and waited for in epoll, so a stuck client holds no thread. Other
+/// destinations are copied at once. If the copier cannot be started, or
+/// in_fd cannot seek, the copy runs on the calling thread.
+/// @param in_fd Source, a regular file or memfd, closed once copied
+/// @param out_fd Destination, must stay open until done is called
+/// @param done Called once the copy is over, on the copier. It must not
+/// block.
+void fdcopy_start(int in_fd, int out_fd, FdcopyDoneFn done, void *arg);
+
+/// @brief Wait until every copy started by fdcopy_start is over
+void fdcopy_drain(void);
@@ -0,0 +1,595 @@
+#include "jobs.h"
+#include "log.h"
+#include "panic.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+static JobSlot *jobs_slot(Jobs *jobs, JobId id) {
+  JobSlot *chunk = atomic_load_explicit(&jobs->chunks[id / JOBS_CHUNK_SLOTS],
+                                        memory_order_acquire);
+  return &chunk[id % JOBS_CHUNK_SLOTS];
+}
+
+static void jobs_lock(Jobs *jobs) {
+  assertf(pthread_mutex_lock(&jobs->mutex) == 0, "mutex lock failed", NULL);
+}
+
+/// @brief Drop the lock, then call the sessions whose jobs ended
+static void jobs_unlock(Jobs *jobs) {
+  JobsIdleWait *ready = jobs->idle_ready;
+  jobs->idle_ready = NULL;
+  assertf(pthread_mutex_unlock(&jobs->mutex) == 0, "mutex unlock failed", NULL);
+  while (ready != NULL) {
+    JobsIdleWait *next = ready->next;
+    ready->fn(ready->arg);
+    free(ready);
+    ready = next;
+  }
+}
+
+static void slot_write_begin(JobSlot *slot) {
+  atomic_fetch_add_explicit(&slot->seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void slot_write_end(JobSlot *slot) {
+  atomic_fetch_add_explicit(&slot->seq, 1, memory_order_release);
+}
+
+static size_t pid_hash(pid_t pid, size_t mask) {
+  return ((uint32_t)pid * 2654435761u) & mask;
+}
+
+/// @brief Find the map entry of a pid, or the free entry it would go to
+static size_t pid_slot(Jobs *jobs, pid_t pid) {
+  size_t mask = jobs->pids_cap - 1;
+  size_t i = pid_hash(pid, mask);
+  while (jobs->pids[i] != 0 && jobs->pids[i] != pid) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/// @brief Add the usage of processes to the usage of a job
+static void job_usage_merge(JobUsage *to, const JobUsage *from) {
+  to->user += from->user;
+  to->sys += from->sys;
+  if (from->maxrss > to->maxrss) {
+    to->maxrss = from->maxrss;
+  }
+  to->minflt += from->minflt;
+  to->majflt += from->majflt;
+}
+
+/// @brief Usage of one reaped process
+static JobUsage job_usage_of(const struct rusage *ru) {
+  return (JobUsage){
+      .user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+      .sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+      .maxrss = ru->ru_maxrss,
+      .minflt = ru->ru_minflt,
+      .majflt = ru->ru_majflt,
+  };
+}
+
+static void pid_insert(Jobs *jobs, pid_t pid, JobId id) {
+  if ((jobs->pids_len + 1) * 2 > jobs->pids_cap) {
+    pid_t *old = jobs->pids;
+    JobId *old_jobs = jobs->pid_jobs;
+    size_t old_cap = jobs->pids_cap;
+    jobs->pids_cap = old_cap == 0 ? 64 : old_cap * 2;
+    jobs->pids = calloc(jobs->pids_cap, sizeof(pid_t));
+    jobs->pid_jobs = malloc(jobs->pids_cap * sizeof(JobId));
+    assertf(jobs->pids != NULL && jobs->pid_jobs != NULL, "malloc failed",
+            NULL);
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i] != 0) {
+        size_t j = pid_slot(jobs, old[i]);
+        jobs->pids[j] = old[i];
+        jobs->pid_jobs[j] = old_jobs[i];
+      }
+    }
+    free(old);
+    free(old_jobs);
+  }
+  size_t i = pid_slot(jobs, pid);
+  if (jobs->pids[i] == 0) {
+    jobs->pids_len++;
+  }
+  jobs->pids[i] = pid;
+  jobs->pid_jobs[i] = id;
+}
+
+/// @brief Find the map entry of a pid
+/// @return Entry index, -1 if the pid is not in the map
+static ssize_t pid_find(Jobs *jobs, pid_t pid) {
+  if (jobs->pids_cap == 0) {
+    return -1;
+  }
+  size_t i = pid_slot(jobs, pid);
+  return jobs->pids[i] == pid ? (ssize_t)i : -1;
+}
+
+static void pid_remove(Jobs *jobs, size_t hole) {
+  jobs->pids[hole] = 0;
+  jobs->pids_len--;
+  // Backward shift deletion keeps the probe sequences unbroken
+  size_t mask = jobs->pids_cap - 1;
+  for (size_t i = (hole + 1) & mask; jobs->pids[i] != 0; i = (i + 1) & mask) {
+    size_t home = pid_hash(jobs->pids[i], mask);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      jobs->pids[hole] = jobs->pids[i];
+      jobs->pid_jobs[hole] = jobs->pid_jobs[i];
+      jobs->pids[i] = 0;
+      hole = i;
+    }
+  }
+}
+
+static size_t owner_hash(const void *owner, size_t mask) {
+  return ((uintptr_t)owner >> 4) * 11400714819323198485ull & mask;
+}
+
+/// @brief Find the map entry of a session, or the free entry it would go to
+static JobsOwner *owner_slot(Jobs *jobs, const void *owner) {
+  size_t mask = jobs->owners_cap - 1;
+  size_t i = owner_hash(owner, mask);
+  while (jobs->owners[i].owner != NULL && jobs->owners[i].owner != owner) {
+    i = (i + 1) & mask;
+  }
+  return &jobs->owners[i];
+}
+
+/// @brief Find the map entry of a session
+/// @return Entry, NULL if the session has none
+static JobsOwner *owner_find(Jobs *jobs, const void *owner) {
+  if (jobs->owners_cap == 0) {
+    return NULL;
+  }
+  JobsOwner *e = owner_slot(jobs, owner);
+  return e->owner == owner ? e : NULL;
+}
+
+/// @brief Find the map entry of a session, creating it
+static JobsOwner *owner_get(Jobs *jobs, const void *owner) {
+  if ((jobs->owners_len + 1) * 2 > jobs->owners_cap) {
+    JobsOwner *old = jobs->owners;
+    size_t old_cap = jobs->owners_cap;
+    jobs->owners_cap = old_cap == 0 ? 16 : old_cap * 2;
+    jobs->owners = calloc(jobs->owners_cap, sizeof(JobsOwner));
+    assertf(jobs->owners != NULL, "calloc failed", NULL);
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].owner != NULL) {
+        *owner_slot(jobs, old[i].owner) = old[i];
+      }
+    }
+    free(old);
+  }
+  JobsOwner *e = owner_slot(jobs, owner);
+  if (e->owner == NULL) {
+    e->owner = owner;
+    jobs->owners_len++;
+  }
+  return e;
+}
+
+/// @brief Remove the entry of a session that runs and waits for nothing
+/// @note Invalidates the other entry pointers
+static void owner_forget(Jobs *jobs, JobsOwner *e) {
+  if (e->running != 0 || e->idle != NULL) {
+    return;
+  }
+  *e = (JobsOwner){0};
+  jobs->owners_len--;
+  // Backward shift deletion keeps the probe sequences unbroken
+  size_t mask = jobs->owners_cap - 1;
+  size_t hole = e - jobs->owners;
+  for (size_t i = (hole + 1) & mask; jobs->owners[i].owner != NULL;
+       i = (i + 1) & mask) {
+    size_t home = owner_hash(jobs->owners[i].owner, mask);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      jobs->owners[hole] = jobs->owners[i];
+      jobs->owners[i] = (JobsOwner){0};
+      hole = i;
+    }
+  }
+}
+
+/// @brief Count the running jobs of a session
+/// @param owner Session, NULL for all of them
+/// @note Must be called with the lock held
+static size_t jobs_running(Jobs *jobs, const void *owner) {
+  if (owner == NULL) {
+    return jobs->running;
+  }
+  JobsOwner *e = owner_find(jobs, owner);
+  return e != NULL ? e->running : 0;
+}
+
+/// @brief Change the state of a job, keeping the running counts
+/// @note Must be called with the lock held, inside a slot write
+static void job_set_state(Jobs *jobs, Job *job, JobState state) {
+  bool was = job->state == JOB_RUNNING;
+  bool is = state == JOB_RUNNING;
+  job->state = state;
+  if (was == is) {
+    return;
+  }
+  jobs->running += is ? 1 : -1;
+  if (job->owner == NULL) {
+    return;
+  }
+  JobsOwner *e = owner_get(jobs, job->owner);
+  e->running += is ? 1 : -1;
+  owner_forget(jobs, e);
+}
+
+/// @brief Hand a list of waiters to jobs_unlock
+static void jobs_idle_ready(Jobs *jobs, JobsIdleWait **list) {
+  while (*list != NULL) {
+    JobsIdleWait *w = *list;
+    *list = w->next;
+    w->next = jobs->idle_ready;
+    jobs->idle_ready = w;
+  }
+}
+
+/// @brief Free the slot of a job
+/// @details Sessions waiting for their jobs to end are handed to
+/// jobs_unlock once none runs.
+/// @note Must be called with the lock held, inside a slot write
+static void job_release(Jobs *jobs, JobSlot *slot) {
+  job_set_state(jobs, &slot->job, JOB_FREE);
+  slot->next_free = jobs->free_head;
+  jobs->free_head = slot->job.id;
+  jobs->len--;
+  pthread_cond_broadcast(&jobs->released);
+
+  JobsOwner *e = slot->job.owner != NULL
+                     ? owner_find(jobs, slot->job.owner)
+                     : NULL;
+  if (e != NULL && e->running == 0) {
+    jobs_idle_ready(jobs, &e->idle);
+    owner_forget(jobs, e);
+  }
+  if (jobs->running == 0) {
+    jobs_idle_ready(jobs, &jobs->idle);
+  }
+}
+
+/// @brief Completion callback to run once the lock is dropped
+typedef struct {
+  JobDoneFn fn; // NULL if none
+  void *arg;
+  JobState state;
+  int status;
+  JobUsage usage;
+} JobDone;
+
+/// @brief Hand a done or stopped foreground job to its callback, as
+/// jobs_wait_job would hand it to a waiter
+/// @note Must be called with the lock held, inside a slot write
+static void job_take_done(Jobs *jobs, JobSlot *slot, JobState state,
+                          JobDone *done) {
+  *done = (JobDone){
+      .fn = slot->on_done,
+      .arg = slot->done_arg,
+      .state = state,
+      .status = slot->job.status,
+      .usage = slot->job.usage,
+  };
+  slot->on_done = NULL;
+  if (state == JOB_DONE) {
+    job_release(jobs, slot);
+  } else {
+    job_set_state(jobs, &slot->job, JOB_STOPPED);
+    slot->job.background = true;
+  }
+}
+
+static void job_run_done(JobDone *done) {
+  if (done->fn != NULL) {
+    done->fn(done->arg, done->state, done->status, &done->usage);
+  }
+}
+
+/// @brief Finish a job once it is sealed and all its processes are reaped
+/// @param done Filled in if the job has a completion callback
+/// @note Must be called with the lock held, inside a slot write
+static void job_finish_if_done(Jobs *jobs, JobSlot *slot, JobDone *done) {
+  if (!slot->job.sealed || slot->job.alive != 0) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  slot->job.usage.real = (now.tv_sec - slot->job.started.tv_sec) +
+                         (now.tv_nsec - slot->job.started.tv_nsec) / 1e9;
+  if (slot->job.background) {
+    job_release(jobs, slot);
+  } else if (slot->on_done != NULL) {
+    job_take_done(jobs, slot, JOB_DONE, done);
+  } else {
+    job_set_state(jobs, &slot->job, JOB_DONE);
+    pthread_cond_broadcast(&slot->changed);
+    pthread_cond_broadcast(&jobs->finished);
+  }
+}
+
+Jobs *jobs_new(void) {
+  Jobs *j = calloc(1, sizeof(Jobs));
+  assertf(j != NULL, "calloc failed", NULL);
+  j->free_head = -1;
+  assertf(pthread_mutex_init(&j->mutex, NULL) == 0, "mutex init failed", NULL);
+  assertf(pthread_cond_init(&j->released, NULL) == 0, "cond init failed", NULL);
+  assertf(pthread_cond_init(&j->finished, NULL) == 0, "cond init failed", NULL);
+  return j;
+}
+
+void jobs_free(Jobs *jobs) {
+  size_t n = atomic_load(&jobs->slots);
+  for (size_t i = 0; i < JOBS_MAX_CHUNKS; i++) {
+    JobSlot *chunk = atomic_load(&jobs->chunks[i]);
+    for (size_t j = 0; chunk != NULL && j < JOBS_CHUNK_SLOTS &&
+                       i * JOBS_CHUNK_SLOTS + j < n;
+         j++) {
+      pthread_cond_destroy(&chunk[j].changed);
+    }
+    free(chunk);
+  }
+  free(jobs->pids);
+  free(jobs->pid_jobs);
+  for (size_t i = 0; i < jobs->owners_cap; i++) {
+    jobs_idle_ready(jobs, &jobs->owners[i].idle);
+  }
+  free(jobs->owners);
+  jobs_idle_ready(jobs, &jobs->idle);
+  while (jobs->idle_ready != NULL) {
+    JobsIdleWait *next = jobs->idle_ready->next;
+    free(jobs->idle_ready);
+    jobs->idle_ready = next;
+  }
+  pthread_cond_destroy(&jobs->released);
+  pthread_cond_destroy(&jobs->finished);
+  pthread_mutex_destroy(&jobs->mutex);
+  free(jobs);
+}
+
+JobId jobs_add(Jobs *jobs, const void *owner, bool background,
+               const char *cmdline) {
+  jobs_lock(jobs);
+  JobId id = jobs->free_head;
+  if (id != -1) {
+    jobs->free_head = jobs_slot(jobs, id)->next_free;
+  } else {
+    size_t n = atomic_load_explicit(&jobs->slots, memory_order_relaxed);
+    assertf(n < (size_t)JOBS_MAX_CHUNKS * JOBS_CHUNK_SLOTS,
+            "job table is full", NULL);
+    if (n % JOBS_CHUNK_SLOTS == 0) {
+      JobSlot *chunk = calloc(JOBS_CHUNK_SLOTS, sizeof(JobSlot));
+      assertf(chunk != NULL, "calloc failed", NULL);
+      for (size_t i = 0; i < JOBS_CHUNK_SLOTS; i++) {
+        assertf(pthread_cond_init(&chunk[i].changed, NULL) == 0,
+                "cond init failed", NULL);
+      }
+      atomic_store_explicit(&jobs->chunks[n / JOBS_CHUNK_SLOTS], chunk,
+                            memory_order_release);
+    }
+    atomic_store_explicit(&jobs->slots, n + 1, memory_order_release);
+    id = n;
+  }
+
+  JobSlot *slot = jobs_slot(jobs, id);
+  slot_write_begin(slot);
+  slot->job = (Job){
+      .id = id,
+      .state = JOB_FREE,
+      .background = background,
+      .owner = owner,
+  };
+  job_set_state(jobs, &slot->job, JOB_RUNNING);
+  clock_gettime(CLOCK_MONOTONIC, &slot->job.started);
+  snprintf(slot->job.cmdline, sizeof(slot->job.cmdline), "%s", cmdline);
+  slot_write_end(slot);
+  jobs->len++;
+  jobs_unlock(jobs);
+  return id;
+}
+
+void jobs_add_pid(Jobs *jobs, JobId id, pid_t pid, pid_t pgid) {
+  jobs_lock(jobs);
+  JobSlot *slot = jobs_slot(jobs, id);
+  slot_write_begin(slot);
+  if (slot->job.procs == 0) {
+    slot->job.leader = pid;
+  }
+  slot->job.tail = pid;
+  slot->job.pgid = pgid;
+  slot->job.procs++;
+  slot->job.alive++;
+  assertf(pid_find(jobs, pid) == -1, "pid added twice", NULL);
+  pid_insert(jobs, pid, id);
+  slot_write_end(slot);
+  jobs_unlock(jobs);
+}
+
+void jobs_seal(Jobs *jobs, JobId id) {
+  jobs_lock(jobs);
+  JobSlot *slot = jobs_slot(jobs, id);
+  slot_write_begin(slot);
+  slot->job.sealed = true;
+  JobDone done = {0};
+  job_finish_if_done(jobs, slot, &done);
+  slot_write_end(slot);
+  jobs_unlock(jobs);
+  job_run_done(&done);
+}
+
+bool jobs_update(Jobs *jobs, pid_t pid, int status, const struct rusage *ru) {
+  jobs_lock(jobs);
+  ssize_t i = pid_find(jobs, pid);
+  if (i == -1) {
+    // Added under the reaper hold, so not one of a job (the spawn helper)
+    jobs_unlock(jobs);
+    log_debug("Dropped the status of PID %d, not in a job\n", pid);
+    return false;
+  }
+  JobSlot *slot = jobs_slot(jobs, jobs->pid_jobs[i]);
+  bool background = slot->job.background;
+
+  JobDone done = {0};
+  slot_write_begin(slot);
+  if (WIFSTOPPED(status) && slot->on_done != NULL) {
+    job_take_done(jobs, slot, JOB_STOPPED, &done);
+  } else if (WIFSTOPPED(status)) {
+    job_set_state(jobs, &slot->job, JOB_STOPPED);
+    pthread_cond_broadcast(&slot->changed);
+  } else if (WIFCONTINUED(status)) {
+    job_set_state(jobs, &slot->job, JOB_RUNNING);
+  } else {
+    pid_remove(jobs, i);
+    JobUsage usage = job_usage_of(ru);
+    job_usage_merge(&slot->job.usage, &usage);
+    slot->job.alive--;
+    admission_release(jobs->admission, slot->job.owner, 1);
+    if (pid == slot->job.tail) {
+      slot->job.status = status;
+    }
+    job_finish_if_done(jobs, slot, &done);
+  }
+  slot_write_end(slot);
+  jobs_unlock(jobs);
+  job_run_done(&done);
+  return background;
+}
+
+JobState jobs_wait_job(Jobs *jobs, JobId id, int *status, JobUsage *usage) {
+  jobs_lock(jobs);
+  JobSlot *slot = jobs_slot(jobs, id);
+  while (slot->job.state == JOB_RUNNING) {
+    pthread_cond_wait(&slot->changed, &jobs->mutex);
+  }
+  JobState state = slot->job.state;
+  *status = slot->job.status;
+  if (usage != NULL) {
+    *usage = slot->job.usage;
+  }
+
+  slot_write_begin(slot);
+  if (state == JOB_DONE) {
+    job_release(jobs, slot);
+  } else {
+    slot->job.background = true;
+  }
+  slot_write_end(slot);
+  jobs_unlock(jobs);
+  return state;
+}
+
+void jobs_on_done(Jobs *jobs, JobId id, JobDoneFn fn, void *arg) {
+  jobs_lock(jobs);
+  JobSlot *slot = jobs_slot(jobs, id);
+  JobDone done = {0};
+  slot_write_begin(slot);
+  slot->on_done = fn;
+  slot->done_arg = arg;
+  if (slot->job.state != JOB_RUNNING) {
+    // Over before the callback was set
+    job_take_done(jobs, slot, slot->job.state, &done);
+  }
+  slot_write_end(slot);
+  jobs_unlock(jobs);
+  job_run_done(&done);
+}
+
+size_t jobs_snapshot(Jobs *jobs, Job *out, size_t cap) {
+  size_t n = atomic_load_explicit(&jobs->slots, memory_order_acquire);
+  size_t len = 0;
+  for (size_t i = 0; i < n && len < cap; i++) {
+    JobSlot *slot = jobs_slot(jobs, i);
+    Job job;
+    unsigned seq;
+    do {
+      seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+      if (seq & 1) {
+        continue; // Being written
+      }
+      memcpy(&job, &slot->job, sizeof(job));
+      atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) ||
+             seq != atomic_load_explicit(&slot->seq, memory_order_relaxed));
+    if (job.state == JOB_RUNNING || job.state == JOB_STOPPED) {
+      out[len++] = job;
+    }
+  }
+  return len;
+}
+
+void jobs_print(Jobs *jobs, int fd) {
+  size_t cap = atomic_load_explicit(&jobs->slots, memory_order_acquire);
+  if (cap == 0) {
+    return;
+  }
+  Job *snapshot = malloc(cap * sizeof(Job));
+  assertf(snapshot != NULL, "malloc failed", NULL);
+  size_t n = jobs_snapshot(jobs, snapshot, cap);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (size_t i = 0; i < n; i++) {
+    Job *job = &snapshot[i];
+    double elapsed = (now.tv_sec - job->started.tv_sec) +
+                     (now.tv_nsec - job->started.tv_nsec) / 1e9;
+    dprintf(fd, "[%d] %d %s %.1fs %s%s\n", job->id, job->leader,
+            job->state == JOB_STOPPED ? "Stopped" : "Running", elapsed,
+            job->cmdline, job->background ? " &" : "");
+  }
+  free(snapshot);
+}
+
+void jobs_hangup(Jobs *jobs, const void *owner) {
+  jobs_lock(jobs);
+  // Every process not reaped yet is in the map, so none of the pids can
+  // have been reused. Background jobs share the shell's group, so the
+  // processes are signalled one by one.
+  for (size_t i = 0; i < jobs->pids_cap; i++) {
+    if (jobs->pids[i] == 0 ||
+        jobs_slot(jobs, jobs->pid_jobs[i])->job.owner != owner) {
+      continue;
+    }
+    kill(jobs->pids[i], SIGHUP);
+    kill(jobs->pids[i], SIGCONT); // A stopped one would not see it
+  }
+  jobs_unlock(jobs);
+}
+
+void jobs_wait(Jobs *jobs, const void *owner) {
+  jobs_lock(jobs);
+  size_t running = jobs_running(jobs, owner);
+  if (running != 0) {
+    log_info("Waiting for %zu jobs\n", running);
+  }
+  while (running != 0) {
+    pthread_cond_wait(&jobs->released, &jobs->mutex);
+    running = jobs_running(jobs, owner);
+  }
+  jobs_unlock(jobs);
+}
+
+bool jobs_on_idle(Jobs *jobs, const void *owner, JobsIdleFn fn, void *arg) {
+  jobs_lock(jobs);
+  size_t running = jobs_running(jobs, owner);
+  if (running != 0) {
+    log_info("Waiting for %zu jobs\n", running);
+    JobsIdleWait **list =
+        owner != NULL ? &owner_get(jobs, owner)->idle : &jobs->idle;
+    JobsIdleWait *w = malloc(sizeof(JobsIdleWait));
+    assertf(w != NULL, "malloc failed", NULL);
+    *w = (JobsIdleWait){.fn = fn, .arg = arg, .next = *list};
+    *list = w;
+  }
+  jobs_unlock(jobs);
+  return running == 0;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "admission.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define JOB_CMDLINE_MAX 128
+#define JOBS_CHUNK_SLOTS 256
+#define JOBS_MAX_CHUNKS 16384 // PID_MAX_LIMIT jobs, the table never fills up
+
+typedef int32_t JobId; // Slot index, -1 for no job
+
+typedef enum {
+  JOB_FREE, // Slot not in use
+  JOB_RUNNING,
+  JOB_STOPPED,
+  JOB_DONE, // Foreground job waiting for jobs_wait_job
+} JobState;
+
+/// @brief Resources used by the processes of a job
+typedef struct {
+  double real;   // Wall time from start to the last process reaped, seconds
+  double user;   // CPU time of all the processes, seconds
+  double sys;
+  long maxrss;   // Largest resident set of a process, KiB
+  long minflt;   // Page faults of all the processes
+  long majflt;
+} JobUsage;
+
+/// @brief Job (one pipeline)
+typedef struct {
+  JobId id;
+  JobState state;
+  pid_t leader; // pid of the first stage
+  pid_t tail;   // pid of the last stage added
+  pid_t pgid;
+  int status;   // Wait status of tail, once reaped
+  int procs;    // Processes in the job
+  int alive;    // Processes not reaped yet
+  bool sealed;  // All the processes were added
+  bool background;
+  const void *owner;       // Session that started the job
+  struct timespec started; // CLOCK_MONOTONIC
+  JobUsage usage;          // Of the processes reaped so far
+  char cmdline[JOB_CMDLINE_MAX];
+} Job;
+
+/// @brief Called once a foreground job is done or stopped
+/// @param arg Argument given to jobs_on_done
+/// @param state JOB_DONE or JOB_STOPPED
+/// @param status Wait status of the last stage
+/// @param usage Resources used by the job
+typedef void (*JobDoneFn)(void *arg, JobState state, int status,
+                          const JobUsage *usage);
+
+/// @brief Called once no job of a session is running
+typedef void (*JobsIdleFn)(void *arg);
+
+/// @brief Session waiting for its jobs to end (jobs_on_idle)
+typedef struct JobsIdleWait {
+  JobsIdleFn fn;
+  void *arg;
+  struct JobsIdleWait *next;
+} JobsIdleWait;
+
+/// @brief Jobs of one session
+typedef struct {
+  const void *owner;  // NULL for a free entry
+  size_t running;     // Jobs in JOB_RUNNING
+  JobsIdleWait *idle; // Waiting for running to drop to 0
+} JobsOwner;
+
+/// @brief Job slot
+/// @details `seq` is a seqlock: odd while the job is being written.
+typedef struct {
+  atomic_uint seq;
+  Job job;
+  JobId next_free;
+  pthread_cond_t changed; // Job stopped or done
+  JobDoneFn on_done;      // Instead of jobs_wait_job, NULL if none
+  void *done_arg;
+} JobSlot;
+
+/// @brief Job table
+/// @details Writers serialize on the mutex. Slots live in chunks that never
+/// move, so readers take consistent snapshots without locking. Processes are
+/// found through a pid -> slot hash map, freed slots are reused through a
+/// free-list.
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t released; // A job was removed
+  pthread_cond_t finished; // A foreground job is done
+
+  _Atomic(JobSlot *) chunks[JOBS_MAX_CHUNKS];
+  atomic_size_t slots; // Slots ever handed out
+  JobId free_head;
+  size_t len; // Jobs in use
+
+  // pid -> slot of the processes not reaped yet, open addressing, pid 0 is
+  // a free entry
+  pid_t *pids;
+  JobId *pid_jobs;
+  size_t pids_cap;
+  size_t pids_len;
+
+  // owner -> running jobs, open addressing, kept while it has some or a
+  // session waits for them
+  JobsOwner *owners;
+  size_t owners_cap;
+  size_t owners_len;
+  size_t running;           // Jobs in JOB_RUNNING, of every session
+  JobsIdleWait *idle;       // Waiting for every job to end
+  JobsIdleWait *idle_ready; // Their jobs ended, called once unlocked
+  Admission *admission; // Process limits, may be NULL
+} Jobs;
+
+/// @brief Create a new jobs struct
+/// @note Allocates memory, so you must call jobs_free when done
+Jobs *jobs_new(void);
+
+/// @brief Free a jobs struct
+void jobs_free(Jobs *jobs);
+
+/// @brief Add a job
+/// @param owner Session that starts the job
+/// @param background Is the job in the background
+/// @param cmdline Command line, truncated to JOB_CMDLINE_MAX
+/// @return Job id
+JobId jobs_add(Jobs *jobs, const void *owner, bool background,
+               const char *cmdline);
+
+/// @brief Add a process to a job
+/// @details Must be called under reaper_hold taken before the process was
+/// spawned, so it cannot have been reaped yet. Its admission slot is
+/// returned once it exits.
+/// @param id Job id
+/// @param pid Process ID
+/// @param pgid Process group of the process
+void jobs_add_pid(Jobs *jobs, JobId id, pid_t pid, pid_t pgid);
+
+/// @brief Mark a job as complete, no more processes will be added
+/// @param id Job id
+void jobs_seal(Jobs *jobs, JobId id);
+
+/// @brief Record a wait status of a process (reaper only)
+/// @details Finished background jobs are removed, finished foreground jobs
+/// are handed to jobs_wait_job. The status of a pid in no job is dropped:
+/// processes are added before they can be reaped (jobs_add_pid).
+/// @param pid Process ID
+/// @param status Wait status
+/// @param ru Resources used by the process, counted once it exited
+/// @return Is the process part of a background job
+bool jobs_update(Jobs *jobs, pid_t pid, int status, const struct rusage *ru);
+
+/// @brief Wait until a foreground job is done or stopped
+/// @details A done job is removed, a stopped job moves to the background.
+/// @param id Job id
+/// @param status Wait status of the last stage
+/// @param usage Resources used by the job, may be NULL
+/// @return JOB_DONE or JOB_STOPPED
+JobState jobs_wait_job(Jobs *jobs, JobId id, int *status, JobUsage *usage);
+
+/// @brief Be called back once a foreground job is done or stopped, instead
+/// of waiting for it
+/// @details The job is then handled as by jobs_wait_job. The callback runs
+/// on the reaper thread without the lock held, or right away on this one if
+/// the job is already over, so it must not block.
+/// @param id Sealed job id
+/// @param fn Callback
+/// @param arg Argument of the callback
+void jobs_on_done(Jobs *jobs, JobId id, JobDoneFn fn, void *arg);
+
+/// @brief Copy the running and stopped jobs, without locking
+/// @param out Snapshot
+/// @param cap Capacity of out
+/// @return Number of jobs copied
+size_t jobs_snapshot(Jobs *jobs, Job *out, size_t cap);
+
+/// @brief Print the running and stopped jobs
+/// @param fd Output file descriptor
+void jobs_print(Jobs *jobs, int fd);
+
+/// @brief Send SIGHUP to every process of a session's jobs, as a closed
+/// terminal would
+/// @param owner Session
+void jobs_hangup(Jobs *jobs, const void *owner);
+
+/// @brief Wait until no job of a session is running
+/// @param owner Session, NULL for all of them
+void jobs_wait(Jobs *jobs, const void *owner);
+
+/// @brief Be called back once no job of a session is running, instead of
+/// waiting in jobs_wait
+/// @details The callback runs without the lock held, on the thread that
+/// removed the last job (mostly the reaper), so it must not block.
+/// @param owner Session, NULL for all of them
+/// @param fn Callback
+/// @param arg Argument of the callback
+/// @return Is none running already, the callback is then not called
+bool jobs_on_idle(Jobs *jobs, const void *owner, JobsIdleFn fn, void *arg);
@@ -1,182 +1,416 @@
 #include "lexer.h"
+#include "charclass.h"
+#include "panic.h"
 #include "types.h"
-#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define LEX_BLOCK_SIZE 4096
+#define LEX_CHUNK_SIZE (64 * 1024)
+
+int lexer_at_end(Lexer *lexer) { return lexer->position == lexer->length; }
+
 char lexer_peek(Lexer *lexer) { return lexer->input[lexer->position]; }
 
-char lexer_lookahead(Lexer *lexer, int n) {
-  return lexer->input[lexer->position + n];
+char lexer_advance(Lexer *lexer) { return lexer->input[lexer->position++]; }
+
+/// @brief Read the next chunk from the source
+/// @return is there something to lex (more input or the end of it)
+int lexer_refill(Lexer *lexer) {
+  if (lexer->source.read == NULL) {
+    return 0;
+  }
+  if (lexer->chunk == NULL) {
+    lexer->chunk = malloc(LEX_CHUNK_SIZE);
+    assertf(lexer->chunk != NULL, "malloc failed", NULL);
+  }
+  ssize_t n = lexer->source.read(lexer->source.ctx, lexer->chunk,
+                                 LEX_CHUNK_SIZE);
+  lexer->input = lexer->chunk;
+  lexer->position = 0;
+  lexer->length = n > 0 ? n : 0;
+  lexer->eof = n <= 0;
+  return 1;
 }
 
-char lexer_advance(Lexer *lexer) {
-  char c = lexer_peek(lexer);
-  if (c != '\0')
-    lexer->position++;
-  return c;
+/// @brief Start a new token in the token storage
+void lexer_token_begin(Lexer *lexer) {
+  lexer->token_start = lexer->tokens != NULL ? lexer->tokens->len : 0;
 }
 
-int lexer_eat(Lexer *lexer, char c) {
-  if (lexer_peek(lexer) == c) {
-    lexer_advance(lexer);
-    return 1;
+/// @brief Append bytes to the token being built
+void lexer_token_append(Lexer *lexer, const char *data, size_t len) {
+  LexBlock *b = lexer->tokens;
+  if (b == NULL || b->len + len > b->cap) {
+    // Move the partial token to a fresh block, earlier tokens stay put
+    size_t partial = b != NULL ? b->len - lexer->token_start : 0;
+    size_t cap = LEX_BLOCK_SIZE;
+    while (cap < partial + len) {
+      cap *= 2;
+    }
+    LexBlock *nb = malloc(sizeof(LexBlock) + cap);
+    assertf(nb != NULL, "malloc failed", NULL);
+    nb->next = b;
+    nb->cap = cap;
+    nb->len = partial;
+    if (partial != 0) {
+      memcpy(nb->data, b->data + lexer->token_start, partial);
+      b->len = lexer->token_start;
+    }
+    lexer->tokens = nb;
+    lexer->token_start = 0;
+    b = nb;
   }
-  return 0;
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+/// @brief Finish the token being built
+Slice lexer_token_end(Lexer *lexer) {
+  if (lexer->tokens == NULL) {
+    return (Slice){.data = "", .len = 0};
+  }
+  return (Slice){
+      .data = lexer->tokens->data + lexer->token_start,
+      .len = lexer->tokens->len - lexer->token_start,
+  };
 }
 
-int isescaped(int c) { return c != '\''; }
+Token lexer_token(Lexer *lexer, TokenType type) {
+  lexer->state = LEX_STATE_START;
+  return (Token){.type = type, .value = lexer_token_end(lexer)};
+}
 
-int isnonspecial(int c) {
-  return !isspace(c) && c != ';' && c != '|' && c != '>' && c != '<' &&
-         c != '\'' && c != '&' && c != '\0' && c != '#';
+Token lexer_special(Lexer *lexer, TokenType type, char *text) {
+  lexer->state = LEX_STATE_START;
+  return (Token){.type = type,
+                 .value = (Slice){.data = text, .len = strlen(text)}};
 }
 
-Lexer lex_new(char *input) { return (Lexer){.input = input, .position = 0}; }
+Lexer lex_new(const char *input) {
+  return (Lexer){
+      .input = input,
+      .length = strlen(input),
+      .eof = true,
+      .state = LEX_STATE_START,
+  };
+}
 
-Token lex_next(Lexer *lexer) {
-  int current_position = lexer->position;
+Lexer lex_new_stream(LexSource source) {
+  return (Lexer){
+      .input = "",
+      .state = LEX_STATE_START,
+      .source = source,
+  };
+}
 
-  // Skip whitespace
-  while ((lexer_peek(lexer) == ' ') || (lexer_peek(lexer) == '\t') ||
-         (lexer_peek(lexer) == '\r')) {
-    lexer_advance(lexer);
-    current_position++;
+void lex_free(Lexer *lexer) {
+  LexBlock *b = lexer->tokens;
+  while (b != NULL) {
+    LexBlock *next = b->next;
+    free(b);
+    b = next;
   }
+  lexer->tokens = NULL;
+  free(lexer->chunk);
+  lexer->chunk = NULL;
+}
 
-  // Skip comments
-  if (lexer_peek(lexer) == '#') {
-    while (lexer_peek(lexer) != '\n' && lexer_peek(lexer) != '\0') {
-      lexer_advance(lexer);
-      current_position++;
-    }
+void lex_feed(Lexer *lexer, const char *chunk, size_t len) {
+  assertf(lexer_at_end(lexer), "lex_feed before the chunk was consumed", NULL);
+  lexer->input = chunk;
+  lexer->length = len;
+  lexer->position = 0;
+}
+
+void lex_finish(Lexer *lexer) { lexer->eof = true; }
+
+Slice lex_release(Lexer *lexer, Slice keep) {
+  LexBlock *head = lexer->tokens;
+  if (head == NULL) {
+    return keep;
+  }
+  LexBlock *b = head->next;
+  while (b != NULL) {
+    LexBlock *next = b->next;
+    free(b);
+    b = next;
+  }
+  head->next = NULL;
+
+  uintptr_t k = (uintptr_t)keep.data;
+  uintptr_t lo = (uintptr_t)head->data;
+  if (keep.len != 0 && k >= lo && k < lo + head->len) {
+    memmove(head->data, keep.data, keep.len);
+    head->len = keep.len;
+    keep.data = head->data;
+  } else {
+    head->len = 0;
   }
+  lexer->token_start = head->len;
+  return keep;
+}
 
-  // Check for end of input
-  if (lexer_eat(lexer, '\0'))
-    return (Token){.type = TOKEN_EOF, .value = (Slice){0}};
-
-  // Check for unescaped word (\<char> | <char>)+
-  if (lexer_peek(lexer) == '\\' || isnonspecial(lexer_peek(lexer))) {
-    int state = 0; // 0: normal, 1: escaped
-    do {
-      if (lexer_peek(lexer) == '\0') {
-        if (state)
-          return (Token){.type = TOKEN_ERROR,
-                         .value = (Slice){
-                             .data = lexer->input + current_position,
-                             .len = lexer->position - current_position,
-                         }};
-        break;
+Token lex_next(Lexer *lexer) {
+  while (true) {
+    if (lexer_at_end(lexer) && !lexer->eof) {
+      if (!lexer_refill(lexer)) {
+        return (Token){.type = TOKEN_INCOMPLETE, .value = (Slice){0}};
       }
-      if (lexer_peek(lexer) == '\\') {
-        state = !state;
-        // FIXME: SHITTY CODE! I'm too lazy to fix this
-        memmove((lexer->input + lexer->position),
-                (lexer->input + lexer->position + 1),
-                strlen(lexer->input + lexer->position + 1));
-        lexer->input[strlen(lexer->input) - 1] = '\0';
+      continue;
+    }
+
+    // From here on, being at the end means the input is over
+    switch (lexer->state) {
+    case LEX_STATE_START: {
+      if (lexer_at_end(lexer)) {
+        return (Token){.type = TOKEN_EOF, .value = (Slice){0}};
+      }
+      char c = lexer_peek(lexer);
+      if (c == '\\' || charclass_is_word(c)) {
+        lexer_token_begin(lexer);
+        lexer->state = LEX_STATE_WORD;
         continue;
-      } else {
-        state = 0;
       }
-      lexer_advance(lexer);
-    } while (state || isnonspecial(lexer_peek(lexer)));
+      switch (c) {
+      case '\0':
+        lexer->length = lexer->position;
+        lexer->eof = true;
+        continue;
+      case ' ':
+      case '\t':
+      case '\v':
+      case '\f':
+      case '\r':
+        lexer_advance(lexer);
+        continue;
+      case '#':
+        lexer_advance(lexer);
+        lexer->state = LEX_STATE_COMMENT;
+        continue;
+      case '\'':
+        lexer_advance(lexer);
+        lexer_token_begin(lexer);
+        lexer->state = LEX_STATE_QUOTED;
+        continue;
+      case '>':
+        lexer_advance(lexer);
+        lexer->state = LEX_STATE_FILE_OUT;
+        continue;
+      case '<':
+        lexer_advance(lexer);
+        lexer->state = LEX_STATE_FILE_IN;
+        continue;
+      case '|':
+        lexer_advance(lexer);
+        return lexer_special(lexer, TOKEN_PIPE, "|");
+      case '&':
+        lexer_advance(lexer);
+        return lexer_special(lexer, TOKEN_BG, "&");
+      case ';':
+        lexer_advance(lexer);
+        return lexer_special(lexer, TOKEN_SEMICOLON, ";");
+      case '\n':
+        lexer_advance(lexer);
+        return lexer_special(lexer, TOKEN_NEWLINE, "\n");
+      default:
+        lexer_advance(lexer);
+        return lexer_special(lexer, TOKEN_ERROR, "");
+      }
+    }
 
-    return (Token){.type = TOKEN_WORD,
-                   .value = (Slice){
-                       .data = lexer->input + current_position,
-                       .len = lexer->position - current_position,
-                   }};
-  }
+    case LEX_STATE_COMMENT:
+      while (!lexer_at_end(lexer) && lexer_peek(lexer) != '\n' &&
+             lexer_peek(lexer) != '\0') {
+        lexer_advance(lexer);
+      }
+      if (!lexer_at_end(lexer) || lexer->eof) {
+        lexer->state = LEX_STATE_START;
+      }
+      continue;
 
-  // Check for escaped word
-  if (lexer_eat(lexer, '\'')) {
-    int state = 0; // 0: normal, 1: escaped
-    while (isescaped(lexer_peek(lexer)) || state) {
-      if (lexer_peek(lexer) == '\0') {
-        return (Token){
-            .type = TOKEN_ERROR,
-            .value =
-                (Slice){
-                    .data = lexer->input + current_position,
-                    .len = lexer->position - current_position,
-                },
-        };
+    case LEX_STATE_WORD: {
+      // Copy the run of plain word bytes up to the next special byte
+      const char *run = lexer->input + lexer->position;
+      size_t n = charclass_scan_word(run, lexer->input + lexer->length) - run;
+      lexer_token_append(lexer, run, n);
+      lexer->position += n;
+      if (lexer_at_end(lexer)) {
+        if (lexer->eof) {
+          return lexer_token(lexer, TOKEN_WORD);
+        }
+        continue;
       }
       if (lexer_peek(lexer) == '\\') {
-        // FIXME: SHITTY CODE! I'm too lazy to fix this
-        state = !state;
-        memmove((lexer->input + lexer->position),
-                (lexer->input + lexer->position + 1),
-                strlen(lexer->input + lexer->position + 1));
-        lexer->input[strlen(lexer->input) - 1] = '\0';
+        lexer_advance(lexer);
+        lexer->state = LEX_STATE_WORD_ESCAPE;
         continue;
       }
-      state = 0;
-      lexer_advance(lexer);
+      return lexer_token(lexer, TOKEN_WORD);
+    }
+
+    case LEX_STATE_QUOTED: {
+      const char *run = lexer->input + lexer->position;
+      size_t n = 0;
+      while (lexer->position + n < lexer->length && run[n] != '\'' &&
+             run[n] != '\\' && run[n] != '\0') {
+        n++;
+      }
+      lexer_token_append(lexer, run, n);
+      lexer->position += n;
+      if (lexer_at_end(lexer)) {
+        if (lexer->eof) {
+          return lexer_token(lexer, TOKEN_ERROR);
+        }
+        continue;
+      }
+      switch (lexer_advance(lexer)) {
+      case '\'':
+        return lexer_token(lexer, TOKEN_ESCAPED_WORD);
+      case '\\':
+        lexer->state = LEX_STATE_QUOTED_ESCAPE;
+        continue;
+      default: // NUL
+        lexer->position--;
+        return lexer_token(lexer, TOKEN_ERROR);
+      }
     }
 
-    if (!lexer_eat(lexer, '\'')) {
-      return (Token){
-          .type = TOKEN_ERROR,
-          .value =
-              (Slice){
-                  .data = lexer->input + current_position,
-                  .len = lexer->position - current_position,
-              },
-      };
+    case LEX_STATE_WORD_ESCAPE:
+    case LEX_STATE_QUOTED_ESCAPE:
+      if (lexer_at_end(lexer) || lexer_peek(lexer) == '\0') {
+        return lexer_token(lexer, TOKEN_ERROR);
+      }
+      lexer_token_append(lexer, lexer->input + lexer->position, 1);
+      lexer_advance(lexer);
+      lexer->state = lexer->state == LEX_STATE_WORD_ESCAPE
+                         ? LEX_STATE_WORD
+                         : LEX_STATE_QUOTED;
+      continue;
+
+    case LEX_STATE_FILE_OUT:
+      if (!lexer_at_end(lexer) && lexer_peek(lexer) == '@') {
+        lexer_advance(lexer);
+        return lexer_special(lexer, TOKEN_TCP_OUT, ">@");
+      }
+      return lexer_special(lexer, TOKEN_FILE_OUT, ">");
+
+    case LEX_STATE_FILE_IN:
+      if (!lexer_at_end(lexer) && lexer_peek(lexer) == '@') {
+        lexer_advance(lexer);
+        return lexer_special(lexer, TOKEN_TCP_IN, "<@");
+      }
+      return lexer_special(lexer, TOKEN_FILE_IN, "<");
     }
-    return (Token){
-        .type = TOKEN_ESCAPED_WORD,
-        .value =
-            (Slice){
-                .data = lexer->input + current_position + 1,
-                .len = lexer->position - current_position - 2,
-            },
-    };
   }
+}
 
-  // Check for special characters
-  TokenType type = TOKEN_ERROR;
-  int length = 1;
-
-  switch (lexer_advance(lexer)) {
-  case '|':
-    type = TOKEN_PIPE;
-    break;
-  case '&':
-    type = TOKEN_BG;
-    break;
-  case '>':
-    if (lexer_eat(lexer, '@')) {
-      type = TOKEN_TCP_OUT;
-      length = 2;
+/// @brief Frame up to a NUL byte, which ends the input of lex_next
+static size_t lex_frame_nul(LexFrame *frame, const char *nul,
+                            const char *data) {
+  *frame = (LexFrame){0};
+  return nul + 1 - data;
+}
+
+size_t lex_frame(LexFrame *frame, const char *data, size_t len) {
+  const char *p = data;
+  const char *end = data + len;
+  while (p < end) {
+    switch (frame->state) {
+    case LEX_STATE_QUOTED:
+      // Only the closing quote and escapes matter inside a quote
+      while (p < end && *p != '\'' && *p != '\\' && *p != '\n' &&
+             *p != '\0') {
+        p++;
+      }
+      if (p < end) {
+        if (*p == '\0') {
+          return lex_frame_nul(frame, p, data);
+        }
+        if (*p == '\n') {
+          frame->lines = true;
+        } else {
+          frame->state =
+              *p == '\'' ? LEX_STATE_START : LEX_STATE_QUOTED_ESCAPE;
+        }
+        p++;
+      }
+      continue;
+    case LEX_STATE_QUOTED_ESCAPE:
+    case LEX_STATE_WORD_ESCAPE:
+      if (*p == '\0') {
+        return lex_frame_nul(frame, p, data);
+      }
+      frame->lines |= *p == '\n';
+      frame->state = frame->state == LEX_STATE_WORD_ESCAPE ? LEX_STATE_START
+                                                           : LEX_STATE_QUOTED;
+      p++;
+      continue;
+    case LEX_STATE_COMMENT:
+      while (p < end && *p != '\n' && *p != '\0') {
+        p++;
+      }
+      if (p == end) {
+        return 0;
+      }
+      frame->state = LEX_STATE_START;
+      continue; // The newline or NUL is handled as one between tokens
+    default:
       break;
     }
-    type = TOKEN_FILE_OUT;
-    break;
-  case '<':
-    if (lexer_eat(lexer, '@')) {
-      type = TOKEN_TCP_IN;
-      length = 2;
+
+    // Between tokens or inside a plain word
+    const char *word = p;
+    p = charclass_scan_word(p, end);
+    if (p != word) {
+      frame->command = true;
+      frame->pipe = false;
+      continue;
+    }
+    switch (*p++) {
+    case '\0':
+      return lex_frame_nul(frame, p - 1, data);
+    case ' ':
+    case '\t':
+    case '\v':
+    case '\f':
+    case '\r':
+      break;
+    case '#':
+      frame->state = LEX_STATE_COMMENT;
+      break;
+    case '\n':
+      if (frame->command && !frame->pipe) {
+        *frame = (LexFrame){0};
+        return p - data;
+      }
+      frame->lines = frame->command;
+      break;
+    case '|':
+      frame->command = true;
+      frame->pipe = true;
+      break;
+    case ';':
+      frame->pipe = false;
+      break;
+    case '\'':
+      frame->state = LEX_STATE_QUOTED;
+      frame->command = true;
+      frame->pipe = false;
+      break;
+    case '\\':
+      frame->state = LEX_STATE_WORD_ESCAPE;
+      frame->command = true;
+      frame->pipe = false;
+      break;
+    default: // & < > and the bytes lex_next rejects
+      frame->command = true;
+      frame->pipe = false;
       break;
     }
-    type = TOKEN_FILE_IN;
-    break;
-  case ';':
-    type = TOKEN_SEMICOLON;
-    break;
-  case '\n':
-    type = TOKEN_NEWLINE;
-    break;
-  default:
-    break;
   }
-  return (Token){.type = type,
-                 .value = (Slice){
-                     .data = lexer->input + current_position,
-                     .len = length,
-                 }};
+  return 0;
 }
@@ -1,5 +1,8 @@
 #pragma once
 #include "types.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 typedef enum {
   TOKEN_WORD,         // word without special characters
@@ -13,7 +16,8 @@ typedef enum {
   TOKEN_SEMICOLON,    // ;
   TOKEN_NEWLINE,      // \n
   TOKEN_EOF,          // end of file
-  TOKEN_ERROR         // error
+  TOKEN_ERROR,        // error
+  TOKEN_INCOMPLETE,   // input ran out in the middle of a token, feed more
 } TokenType;
 
 /// @brief Token structure
@@ -22,19 +26,103 @@ typedef struct {
   Slice value;
 } Token;
 
+/// @brief Where the lexer stopped when the input ran out
+typedef enum {
+  LEX_STATE_START,         // between tokens
+  LEX_STATE_COMMENT,       // inside a # comment
+  LEX_STATE_WORD,          // inside an unescaped word
+  LEX_STATE_WORD_ESCAPE,   // after \ in an unescaped word
+  LEX_STATE_QUOTED,        // inside '...'
+  LEX_STATE_QUOTED_ESCAPE, // after \ inside '...'
+  LEX_STATE_FILE_OUT,      // after >, @ may follow
+  LEX_STATE_FILE_IN,       // after <, @ may follow
+} LexState;
+
+/// @brief Command framing of raw input, see lex_frame
+/// @details Starts zeroed.
+typedef struct {
+  LexState state; // START, COMMENT, or inside a quote or escape
+  bool command;   // Tokens seen since the last complete command
+  bool pipe;      // The last token was |, the pipeline goes on
+  bool lines;     // The command went on past a newline
+} LexFrame;
+
+/// @brief Input source of a streaming lexer
+/// @details `read` fills `buf` with up to `cap` bytes and returns the number
+/// of bytes read, or 0 (or -1) when the input is over.
+typedef struct {
+  ssize_t (*read)(void *ctx, char *buf, size_t cap);
+  void *ctx;
+} LexSource;
+
+/// @brief Token text storage block
+typedef struct LexBlock {
+  struct LexBlock *next;
+  size_t len;
+  size_t cap;
+  char data[];
+} LexBlock;
+
 /// @brief Program Lexer
-/// Initial position is 0
+/// @details A resumable state machine over input chunks. Token text
+/// (unescaped) is copied into lexer owned blocks, so a token may span any
+/// number of chunks and chunks can be dropped once they are consumed. The
+/// first NUL byte ends the input.
 typedef struct {
-  char *input;
-  int position;
+  const char *input; // current chunk
+  size_t length;     // chunk length
+  size_t position;   // read position in the chunk
+  bool eof;          // no input after the current chunk
+  LexState state;
+
+  LexBlock *tokens;   // token text, newest block first
+  size_t token_start; // start of the token being built in tokens->data
+
+  LexSource source; // refills the lexer when set
+  char *chunk;      // read buffer for source
 } Lexer;
 
-/// @brief Create a new Lexer
+/// @brief Create a new Lexer over a whole NUL-terminated input
 /// @param input
 /// @return Lexer
-Lexer lex_new(char *input);
+/// @note The lexer must be freed with lex_free
+Lexer lex_new(const char *input);
+
+/// @brief Create a new streaming Lexer
+/// @param source Input source, may be {0} to feed the lexer with lex_feed
+/// @return Lexer
+/// @note The lexer must be freed with lex_free
+Lexer lex_new_stream(LexSource source);
+
+/// @brief Free the lexer buffers
+void lex_free(Lexer *lexer);
+
+/// @brief Give the lexer the next chunk of input
+/// @details Only valid once lex_next returned TOKEN_INCOMPLETE (or before the
+/// first lex_next). The chunk must stay alive until the lexer asks for more.
+void lex_feed(Lexer *lexer, const char *chunk, size_t len);
+
+/// @brief Mark the end of the input
+void lex_finish(Lexer *lexer);
+
+/// @brief Drop the text of all the tokens returned so far
+/// @param keep Token value that must survive (usually the lookahead)
+/// @return `keep` relocated into the retained storage
+Slice lex_release(Lexer *lexer, Slice keep);
 
 /// @brief Iterator over Tokens
 /// @param lexer
-/// @return Token
+/// @return Token, TOKEN_INCOMPLETE if the lexer has no source and needs more
+/// input
 Token lex_next(Lexer *lexer);
+
+/// @brief Find where the next complete command ends in arriving input
+/// @details Follows quotes, escapes, comments and trailing pipes the way
+/// lex_next and the parser do, so a newline inside a quote or after a |
+/// does not end a command, and blank or comment-only lines do not make one.
+/// A NUL byte ends the input as it does for lex_next: the framed length
+/// then runs up to and including it, whatever the state.
+/// Resumes from `frame` and leaves it at the end of the scanned bytes.
+/// @return Length up to and including the newline ending the first
+/// complete command, 0 if no command ends in `data` (all of it was scanned)
+size_t lex_frame(LexFrame *frame, const char *data, size_t len);
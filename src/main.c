@@ -6,6 +6,7 @@
 #include "parser.h"
 #include "repl.h"
 #include "server.h"
+#include "procspawn.h"
 #include "types.h"
 #include <fcntl.h>
 #include <pthread.h>
@@ -32,6 +33,12 @@ typedef struct {
   bool is_daemon;
   int connection_timeout;
   char *log_file;
+  bool no_cache;
+  bool use_fork;
+  bool use_zygote;
+  bool use_uring;
+  int session_procs;
+  int server_procs;
 } shshargs;
 
 const char *help_message =
@@ -47,6 +54,12 @@ const char *help_message =
     "  -t TIMEOUT\tConnection timeout\n"
     "  -l LOGFILE\tLog file\n"
     "  -a\t\tShow about message\n"
+    "  -n\t\tDo not cache compiled scripts\n"
+    "  -f\t\tSpawn commands with fork instead of posix_spawn\n"
+    "  -z\t\tSpawn server commands from a helper forked at startup\n"
+    "  -j N\t\tMax server processes per connection, more wait\n"
+    "  -J N\t\tMax server processes in total, more wait\n"
+    "  -u\t\tServe connections through io_uring when available\n"
     "\n"
     "If no script is provided, the program will start in REPL mode\n";
 
@@ -66,6 +79,12 @@ shshargs shsh_parse_args(int argc, char *argv[]) {
       .is_daemon = false,
       .connection_timeout = 0,
       .log_file = NULL,
+      .no_cache = false,
+      .use_fork = false,
+      .use_zygote = false,
+      .use_uring = false,
+      .session_procs = 0,
+      .server_procs = 0,
   };
 
   for (int i = 1; i < argc; i++) {
@@ -90,6 +109,20 @@ shshargs shsh_parse_args(int argc, char *argv[]) {
     } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
       args.connection_timeout = atoi(argv[i + 1]);
       i++; // skip next argument
+    } else if (strcmp(argv[i], "-n") == 0) {
+      args.no_cache = true;
+    } else if (strcmp(argv[i], "-f") == 0) {
+      args.use_fork = true;
+    } else if (strcmp(argv[i], "-z") == 0) {
+      args.use_zygote = true;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      args.use_uring = true;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      args.session_procs = atoi(argv[i + 1]);
+      i++; // skip next argument
+    } else if (strcmp(argv[i], "-J") == 0 && i + 1 < argc) {
+      args.server_procs = atoi(argv[i + 1]);
+      i++; // skip next argument
     } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
       args.log_file = argv[i + 1];
       i++; // skip next argument
@@ -120,16 +153,18 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  if (args.use_fork) {
+    spawn_backend = SPAWN_FORK;
+  }
+
   if (!args.is_server && !args.is_client) {
-    FILE *file = NULL;
     if (args.script_file != NULL) {
-      file = fopen(args.script_file, "r");
+      return shsh_script((shsh_script_ctx){
+          .path = args.script_file,
+          .use_cache = !args.no_cache,
+      });
     }
-    int status = shsh_repl((shsh_repl_ctx){.in = file});
-    if (file != NULL) {
-      fclose(file);
-    }
-    return status;
+    return shsh_repl((shsh_repl_ctx){.in = NULL});
   }
 
   if (args.is_server) {
@@ -137,6 +172,10 @@ int main(int argc, char *argv[]) {
         .host = args.host,
         .port = args.port,
         .timeout = args.connection_timeout,
+        .zygote = args.use_zygote,
+        .uring = args.use_uring,
+        .session_procs = args.session_procs > 0 ? args.session_procs : 0,
+        .server_procs = args.server_procs > 0 ? args.server_procs : 0,
     });
   }
 
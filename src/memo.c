@@ -0,0 +1,322 @@
+#define _GNU_SOURCE // memfd_create
+#include "memo.h"
+#include "compile.h"
+#include "fdcopy.h"
+#include "log.h"
+#include "panic.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+MemoStore memo_store = MEMO_DISK;
+
+/// @brief In-memory entry, direct mapped by key hash
+typedef struct {
+  uint64_t hash;
+  char *key; // Key text, then the output
+  size_t key_len;
+  char *data; // NULL for a free slot
+  size_t len;
+  time_t stored; // CLOCK_MONOTONIC seconds
+} MemoEntry;
+
+static struct {
+  pthread_mutex_t lock;
+  MemoEntry slots[MEMO_SLOTS];
+} memory = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// @brief Add a part to a key
+static void memo_mix(MemoKey *key, const void *data, size_t len) {
+  if (key->len + len + 1 > key->cap) {
+    key->cap = (key->len + len + 1) * 2;
+    key->text = realloc(key->text, key->cap);
+    assertf(key->text != NULL, "realloc failed", NULL);
+  }
+  memcpy(key->text + key->len, data, len);
+  key->text[key->len + len] = '\0'; // So "ab" "c" differs from "a" "bc"
+  key->len += len + 1;
+}
+
+static void memo_mix_env(MemoKey *key, const ShellCtx *shell,
+                         const char *name) {
+  const char *value = shellctx_getenv(shell, name);
+  memo_mix(key, name, strlen(name));
+  if (value != NULL) {
+    memo_mix(key, value, strlen(value));
+  }
+}
+
+/// @brief Is an inherited stdin known to give nothing worth keying
+/// @details A terminal or /dev/null. Anything else (a pipe, a file, the
+/// client socket in server mode) may give other data on the next run.
+static bool memo_stdin_fixed(int in_fd) {
+  if (isatty(in_fd)) {
+    return true;
+  }
+  struct stat st, null;
+  return fstat(in_fd, &st) == 0 && stat("/dev/null", &null) == 0 &&
+         S_ISCHR(st.st_mode) && st.st_rdev == null.st_rdev;
+}
+
+/// @brief Add the parts of a pipeline's stages to a key
+/// @param in_fd Stdin the first stage inherits
+/// @return is ok
+static bool memo_key_stages(const ShellCtx *shell, const Pipeline *pipeline,
+                            int in_fd, MemoKey *key) {
+  if (pipeline->len > 0 && !CMDISFIN(pipeline->commands[0]) &&
+      !memo_stdin_fixed(in_fd)) {
+    return false;
+  }
+  for (size_t i = 0; i < pipeline->len; i++) {
+    const Command *command = &pipeline->commands[i];
+    memo_mix(key, command->name.data, command->name.len);
+    for (size_t j = 0; j < command->args.len; j++) {
+      memo_mix(key, command->args.data[j].data, command->args.data[j].len);
+    }
+    memo_mix(key, "|", 1);
+    if (CMDISTIN(*command)) {
+      return false; // The peer's data is not known up front
+    }
+    if (CMDISFIN(*command)) {
+      struct stat st;
+      if (fstatat(shell->dir_fd, slice_to_stack_str(command->in_file), &st,
+                  0) == -1) {
+        return false;
+      }
+      memo_mix(key, command->in_file.data, command->in_file.len);
+      memo_mix(key, &st.st_ino, sizeof(st.st_ino));
+      memo_mix(key, &st.st_size, sizeof(st.st_size));
+      memo_mix(key, &st.st_mtim, sizeof(st.st_mtim));
+    }
+  }
+  return true;
+}
+
+bool memo_key(const ShellCtx *shell, const Pipeline *pipeline, int in_fd,
+              MemoKey *key) {
+  *key = (MemoKey){0};
+  char buf[PATH_MAX];
+  const char *cwd = shellctx_cwd(shell, buf, sizeof(buf));
+  if (!memo_key_stages(shell, pipeline, in_fd, key) || cwd == NULL) {
+    memo_key_free(key);
+    return false;
+  }
+  memo_mix(key, cwd, strlen(cwd));
+  memo_mix_env(key, shell, "PATH");
+  const char *vars = shellctx_getenv(shell, MEMO_ENV);
+  if (vars != NULL) {
+    char buf[strlen(vars) + 1];
+    memcpy(buf, vars, sizeof(buf));
+    char *save;
+    for (char *name = strtok_r(buf, ":", &save); name != NULL;
+         name = strtok_r(NULL, ":", &save)) {
+      memo_mix_env(key, shell, name);
+    }
+  }
+  key->hash = fnv1a(key->text, key->len, FNV_OFFSET);
+  return true;
+}
+
+void memo_key_free(MemoKey *key) {
+  free(key->text);
+  *key = (MemoKey){0};
+}
+
+static time_t memo_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/// @brief Get the cache file of a key
+/// @details The file holds the key length (uint64_t) and text, then the
+/// output.
+/// @return is ok
+static bool memo_path(char *out, size_t cap, const MemoKey *key) {
+  char dir[PATH_MAX];
+  if (!cache_dir(dir, sizeof(dir))) {
+    return false;
+  }
+  int n = snprintf(out, cap, "%s/memo/%016llx.out", dir,
+                   (unsigned long long)key->hash);
+  return n > 0 && (size_t)n < cap;
+}
+
+/// @brief Write a whole buffer
+/// @return is ok
+static bool memo_write(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+/// @brief Is an entry the one of a key
+static bool memo_same_key(const MemoEntry *e, const MemoKey *key) {
+  return e->data != NULL && e->hash == key->hash && e->key_len == key->len &&
+         memcmp(e->key, key->text, key->len) == 0;
+}
+
+static int memo_open_memory(const MemoKey *key, long ttl) {
+  assertf(pthread_mutex_lock(&memory.lock) == 0, "mutex lock failed", NULL);
+  MemoEntry *e = &memory.slots[key->hash % MEMO_SLOTS];
+  if (!memo_same_key(e, key) || (ttl > 0 && memo_now() - e->stored > ttl)) {
+    pthread_mutex_unlock(&memory.lock);
+    return -1;
+  }
+  // Copied out, the client may be slow to read it
+  int fd = memfd_create("memo", MFD_CLOEXEC);
+  if (fd != -1 && (!memo_write(fd, e->data, e->len) ||
+                   lseek(fd, 0, SEEK_SET) == -1)) {
+    close(fd);
+    fd = -1;
+  }
+  pthread_mutex_unlock(&memory.lock);
+  return fd;
+}
+
+/// @brief Read exactly len bytes
+/// @return is ok
+static bool memo_read(int fd, void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, data, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data = (char *)data + n;
+    len -= n;
+  }
+  return true;
+}
+
+/// @brief Read the key of a cache file and compare it with one
+/// @return Is it the key, the file is then at the start of the output
+static bool memo_check_key(int fd, const MemoKey *key) {
+  uint64_t len;
+  if (!memo_read(fd, &len, sizeof(len)) || len != key->len) {
+    return false;
+  }
+  char *text = malloc(len);
+  assertf(text != NULL || len == 0, "malloc failed", NULL);
+  bool same = memo_read(fd, text, len) && memcmp(text, key->text, len) == 0;
+  free(text);
+  return same;
+}
+
+static int memo_open_disk(const MemoKey *key, long ttl) {
+  char path[PATH_MAX];
+  if (!memo_path(path, sizeof(path), key)) {
+    return -1;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      (ttl > 0 && time(NULL) - st.st_mtime > ttl) ||
+      !memo_check_key(fd, key)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int memo_open(const MemoKey *key, long ttl) {
+  return memo_store == MEMO_MEMORY ? memo_open_memory(key, ttl)
+                                   : memo_open_disk(key, ttl);
+}
+
+static void memo_save_memory(const MemoKey *key, int fd, size_t len) {
+  char *text = malloc(key->len);
+  char *data = malloc(len);
+  assertf(text != NULL && (data != NULL || len == 0), "malloc failed", NULL);
+  memcpy(text, key->text, key->len);
+  size_t off = 0;
+  while (off < len) {
+    ssize_t n = pread(fd, data + off, len - off, off);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      free(text);
+      free(data);
+      return;
+    }
+    off += n;
+  }
+
+  assertf(pthread_mutex_lock(&memory.lock) == 0, "mutex lock failed", NULL);
+  MemoEntry *e = &memory.slots[key->hash % MEMO_SLOTS];
+  free(e->key); // Evicted, or an expired entry of the same key
+  free(e->data);
+  *e = (MemoEntry){
+      .hash = key->hash,
+      .key = text,
+      .key_len = key->len,
+      .data = data,
+      .len = len,
+      .stored = memo_now(),
+  };
+  pthread_mutex_unlock(&memory.lock);
+}
+
+static void memo_save_disk(const MemoKey *key, int fd) {
+  char path[PATH_MAX];
+  char dir[PATH_MAX];
+  char tmp[PATH_MAX + 32];
+  if (!memo_path(path, sizeof(path), key) || !cache_dir(dir, sizeof(dir))) {
+    return;
+  }
+  strncat(dir, "/memo", sizeof(dir) - strlen(dir) - 1);
+  cache_mkdir(dir);
+
+  // Write a private file and rename it, readers never see a partial file
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out == -1) {
+    log_debug("Unable to create %s: %s\n", tmp, strerror(errno));
+    return;
+  }
+  uint64_t len = key->len;
+  bool ok = memo_write(out, (const char *)&len, sizeof(len)) &&
+            memo_write(out, key->text, key->len) &&
+            lseek(fd, 0, SEEK_SET) == 0 && fdcopy(fd, out);
+  close(out);
+  if (!ok || rename(tmp, path) == -1) {
+    unlink(tmp);
+  }
+}
+
+void memo_save(const MemoKey *key, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size > MEMO_MAX_BYTES) {
+    return;
+  }
+  if (memo_store == MEMO_MEMORY) {
+    memo_save_memory(key, fd, st.st_size);
+  } else {
+    memo_save_disk(key, fd);
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "parser.h"
+#include "shellctx.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MEMO_ENV "SHSH_MEMO_ENV" // Colon separated variables in the key
+#define MEMO_SLOTS 256               // In-memory entries
+#define MEMO_MAX_BYTES (16 << 20)    // Larger outputs are not cached
+
+/// @brief Where memoized outputs are kept
+typedef enum {
+  MEMO_DISK,   // Files in the cache directory, shared by every shell
+  MEMO_MEMORY, // Process memory (server)
+} MemoStore;
+
+/// @brief Store used by memo_open/memo_save, MEMO_DISK by default
+extern MemoStore memo_store;
+
+/// @brief Key of a pipeline's output
+/// @details The hash picks the entry. The text it was computed from is
+/// stored with the entry and compared on lookup, so two keys sharing a
+/// hash never replay each other's output.
+typedef struct {
+  uint64_t hash;
+  char *text; // Everything the key covers, each part NUL terminated
+  size_t len;
+  size_t cap;
+} MemoKey;
+
+/// @brief Make the key of a pipeline's output
+/// @details Covers the argv of every stage, the working directory, PATH,
+/// the variables named in $SHSH_MEMO_ENV and the inode, size and mtime of
+/// the input file.
+/// @param shell Working directory and environment the pipeline runs with
+/// @param in_fd Stdin the first stage inherits
+/// @note Allocates memory, so you must call memo_key_free when done
+/// @return is ok, false if the input file cannot be stat'ed or the first
+/// stage reads an inherited stdin other than a terminal or /dev/null
+/// (nothing to free then)
+bool memo_key(const ShellCtx *shell, const Pipeline *pipeline, int in_fd,
+              MemoKey *key);
+
+/// @brief Free a key
+void memo_key_free(MemoKey *key);
+
+/// @brief Open a cached output, for the caller to copy it out
+/// @param ttl Maximum age in seconds, 0 for no limit
+/// @return Descriptor at the start of the output, -1 if there is no entry
+int memo_open(const MemoKey *key, long ttl);
+
+/// @brief Cache an output, best effort
+/// @param fd Output, read from its start
+void memo_save(const MemoKey *key, int fd);
@@ -1,13 +1,15 @@
 #include "parser.h"
+#include "compile.h"
 #include "lexer.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 /// @brief Parse next command
-/// @return ParseResult
-ParseResult parse_command(Parser *parser);
+/// @return is ok
+int parse_command(Parser *parser, Command *command);
 
 /// @brief Parse a command body
 /// @return is ok
@@ -62,28 +64,132 @@ Parser parse_new(Lexer *lexer) {
   return (Parser){
       .lexer = lexer,
       .current_token = lex_next(lexer),
+      .arena = arena_new(),
+  };
+}
+
+Parser parse_new_compiled(const CompiledScript *compiled) {
+  return (Parser){
+      .lexer = NULL,
+      .arena = arena_new(),
+      .compiled = compiled,
+      .compiled_next = 0,
   };
 }
 
+void parse_free(Parser *parser) { arena_free(&parser->arena); }
+
+/// @brief Append a command to a pipeline allocated from the parser arena
+void pipeline_push(Parser *parser, Pipeline *pipeline, Command command) {
+  if (pipeline->len == pipeline->cap) {
+    size_t new_cap = pipeline->cap == 0 ? 4 : pipeline->cap * 2;
+    Command *new_commands =
+        arena_alloc(&parser->arena, new_cap * sizeof(Command));
+    if (pipeline->len != 0) {
+      memcpy(new_commands, pipeline->commands,
+             pipeline->len * sizeof(Command));
+    }
+    pipeline->commands = new_commands;
+    pipeline->cap = new_cap;
+  }
+  pipeline->commands[pipeline->len++] = command;
+}
+
+Slice parser_compiled_str(Parser *parser, StrRef ref) {
+  return (Slice){.data = (char *)parser->compiled->strings + ref.off,
+                 .len = ref.len};
+}
+
+/// @brief Rebuild the next pipeline of a compiled script
+ParseResult parse_next_compiled(Parser *parser) {
+  const CompiledScript *cs = parser->compiled;
+  ParseResult r = {
+      .pipeline = (Pipeline){0},
+      .result = PARSE_EOF,
+  };
+  while (parser->compiled_next < cs->header->commands_len) {
+    const CompiledCommand *cc = &cs->commands[parser->compiled_next++];
+    Command command = {
+        .name = parser_compiled_str(parser, cc->name),
+        .args = slice_vec_new_in(&parser->arena),
+        .in_file = parser_compiled_str(parser, cc->in_file),
+        .out_file = parser_compiled_str(parser, cc->out_file),
+        .in_tcp = parser_compiled_str(parser, cc->in_tcp),
+        .out_tcp = parser_compiled_str(parser, cc->out_tcp),
+        .flags = cc->flags,
+    };
+    for (uint32_t i = 0; i < cc->args_len; i++) {
+      slice_vec_push(&command.args,
+                     parser_compiled_str(parser, cs->args[cc->args_off + i]));
+    }
+    r.result = cc->result;
+    if (r.result != PARSE_OK) {
+      break;
+    }
+    pipeline_push(parser, &r.pipeline, command);
+    if (!CMDISPIPE(command)) {
+      break;
+    }
+  }
+  return r;
+}
+
+void parse_release(Parser *parser) {
+  if (parser->lexer != NULL) {
+    parser->current_token.value =
+        lex_release(parser->lexer, parser->current_token.value);
+  }
+  arena_reset(&parser->arena);
+}
+
 ParseResult parse_next(Parser *parser) {
+  if (parser->compiled != NULL) {
+    return parse_next_compiled(parser);
+  }
   while (parser_eat(parser, TOKEN_NEWLINE) ||
          parser_eat(parser, TOKEN_SEMICOLON)) {
   }
   if (parser_match(parser, TOKEN_EOF)) {
     return (ParseResult){
-        .command = (Command){0},
+        .pipeline = (Pipeline){0},
         .result = PARSE_EOF,
     };
   }
-  ParseResult pr = parse_command(parser);
+  ParseResult pr = {
+      .pipeline = (Pipeline){0},
+      .result = PARSE_OK,
+  };
+
+  while (true) {
+    Command command;
+    if (!parse_command(parser, &command)) {
+      pr.result = PARSE_ERROR;
+      break;
+    }
+    pipeline_push(parser, &pr.pipeline, command);
+    if (!CMDISPIPE(command)) {
+      break;
+    }
+    // The next stage may start on the next line
+    while (parser_eat(parser, TOKEN_NEWLINE)) {
+    }
+    if (parser_match(parser, TOKEN_EOF)) {
+      pr.result = PARSE_ERROR;
+      break;
+    }
+  }
 
-  if (parser_match(parser, TOKEN_ERROR)) {
+  if (parser_match(parser, TOKEN_ERROR) ||
+      parser_match(parser, TOKEN_INCOMPLETE)) {
     pr.result = PARSE_ERROR;
   }
 
+  // Stop in front of the newline: eating it would block a streaming lexer on
+  // the next line before the error is reported
   if (pr.result == PARSE_ERROR) {
-    while (!parser_eat(parser, TOKEN_NEWLINE) &&
-           !parser_eat(parser, TOKEN_EOF)) {
+    while (!parser_match(parser, TOKEN_NEWLINE) &&
+           !parser_match(parser, TOKEN_EOF) &&
+           !parser_match(parser, TOKEN_INCOMPLETE)) {
       parser_advance(parser);
     }
   }
@@ -91,33 +197,24 @@ ParseResult parse_next(Parser *parser) {
   return pr;
 }
 
-ParseResult parse_command(Parser *parser) {
-  ParseResult r = {
-      .command =
-          (Command){
-              .args = slice_vec_new(),
-          },
-      .result = PARSE_OK,
+int parse_command(Parser *parser, Command *command) {
+  *command = (Command){
+      .args = slice_vec_new_in(&parser->arena),
   };
 
-  if (parser_match_any_word(parser)) {
-    if (!parse_command_body(parser, &r.command)) {
-      r.result = PARSE_ERROR;
-      return r;
-    }
-  } else {
-    r.result = PARSE_ERROR;
-    return r;
+  if (!parser_match_any_word(parser) ||
+      !parse_command_body(parser, command)) {
+    return 0;
   }
 
   if (parser_eat(parser, TOKEN_BG)) {
-    r.command.flags |= CMD_BG;
+    command->flags |= CMD_BG;
   }
   if (parser_eat(parser, TOKEN_PIPE)) {
-    r.command.flags |= CMD_PIPE;
+    command->flags |= CMD_PIPE;
   }
 
-  return r;
+  return 1;
 }
 
 int parse_command_body(Parser *parser, Command *command) {
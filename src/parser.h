@@ -48,9 +48,17 @@ typedef struct {
 /// @param command Command
 void clear_command_args(Command command);
 
+/// @brief Pipeline structure
+/// Commands connected with pipes, a single command is a pipeline of one
+typedef struct {
+  Command *commands; // Pipeline stages
+  size_t len;
+  size_t cap;
+} Pipeline;
+
 /// ParseResult
 typedef struct {
-  Command command;
+  Pipeline pipeline;
   ParseResultEnum result;
 } ParseResult;
 
@@ -59,15 +67,38 @@ typedef struct {
 typedef struct {
   Lexer *lexer;
   Token current_token;
+  Arena arena; // Per-command allocations, reset by parse_release
+
+  const struct CompiledScript *compiled; // Replayed instead of lexing
+  size_t compiled_next;                  // Next compiled command
 } Parser;
 
 /// @brief Create a new Parser
 /// @param lexer Lexer
 /// @return Parser
-/// @note The lexer must be valid
+/// @note The lexer must be valid and must not return TOKEN_INCOMPLETE, so it
+/// either has a source or has been given the whole input
 Parser parse_new(Lexer *lexer);
 
-/// @brief Iterate over the commands in the input
+/// @brief Create a Parser replaying a compiled script
+/// @param compiled Compiled script, must outlive the parser
+/// @return Parser
+Parser parse_new_compiled(const struct CompiledScript *compiled);
+
+/// @brief Free the parser memory
+/// @note The lexer is not freed
+void parse_free(Parser *parser);
+
+/// @brief Release the memory of all the commands parsed so far
+/// @details Slices of previously returned commands become invalid. Call it
+/// once those commands are done with, so memory stays bounded by the longest
+/// command instead of the whole input.
+/// @param parser Parser
+void parse_release(Parser *parser);
+
+/// @brief Iterate over the pipelines in the input
+/// @details The whole pipeline is parsed, so a syntax error in any stage
+/// fails the pipeline before anything runs
 /// @param parser Parser
 /// @return ParseResult
 ParseResult parse_next(Parser *parser);
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE // strchrnul
+#include "pathcache.h"
+#include "log.h"
+#include "panic.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PATHCACHE_DEFAULT_PATH "/bin:/usr/bin" // execvp's default
+#define PATHCACHE_WATCH_MASK                                                   \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |           \
+   IN_DELETE_SELF | IN_MOVE_SELF)
+
+/// @brief Cached resolution
+typedef struct {
+  char *name; // NULL for a free slot
+  char *path;
+  size_t hits;
+} PathEntry;
+
+/// @brief Process wide resolution cache, read mostly
+static struct {
+  pthread_rwlock_t lock;
+  PathEntry *table; // Open addressing, linear probing
+  size_t cap;
+  size_t len;
+  char *path_env; // PATH the entries were resolved with
+  int inotify_fd; // Watches the directories of path_env, -1 if unavailable
+  unsigned gen;   // Bumped whenever the entries are dropped
+} cache = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .inotify_fd = -1,
+};
+
+static size_t pathcache_hash(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *s != '\0'; s++) {
+    h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/// @brief Find the slot of a name, or the free slot it would go to
+/// @note Must be called with the lock held and cap != 0
+static PathEntry *pathcache_slot(const char *name) {
+  size_t mask = cache.cap - 1;
+  size_t i = pathcache_hash(name) & mask;
+  while (cache.table[i].name != NULL &&
+         strcmp(cache.table[i].name, name) != 0) {
+    i = (i + 1) & mask;
+  }
+  return &cache.table[i];
+}
+
+/// @brief Drop all the entries
+/// @note Must be called with the write lock held
+static void pathcache_flush(void) {
+  cache.gen++;
+  for (size_t i = 0; i < cache.cap; i++) {
+    free(cache.table[i].name);
+    free(cache.table[i].path);
+    cache.table[i] = (PathEntry){0};
+  }
+  cache.len = 0;
+}
+
+/// @brief Start over for a new PATH, watching its directories
+/// @note Must be called with the write lock held
+static void pathcache_reset(const char *path_env) {
+  pathcache_flush();
+  free(cache.path_env);
+  cache.path_env = strdup(path_env);
+  assertf(cache.path_env != NULL, "strdup failed", NULL);
+
+  if (cache.inotify_fd != -1) {
+    close(cache.inotify_fd);
+  }
+  cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cache.inotify_fd == -1) {
+    log_debug("inotify unavailable, PATH directories are not watched\n", NULL);
+    return;
+  }
+  char dir[PATH_MAX];
+  const char *p = path_env;
+  while (true) {
+    const char *sep = strchrnul(p, ':');
+    size_t len = sep - p;
+    // Only absolute entries, relative ones are never cached
+    if (len != 0 && p[0] == '/' && len < sizeof(dir)) {
+      memcpy(dir, p, len);
+      dir[len] = '\0';
+      inotify_add_watch(cache.inotify_fd, dir, PATHCACHE_WATCH_MASK);
+    }
+    if (*sep == '\0') {
+      break;
+    }
+    p = sep + 1;
+  }
+}
+
+/// @brief Are there inotify events waiting, without taking them
+/// @note Must be called with the lock held
+static bool pathcache_pending(void) {
+  int n = 0;
+  return cache.inotify_fd != -1 &&
+         ioctl(cache.inotify_fd, FIONREAD, &n) == 0 && n > 0;
+}
+
+/// @brief Drop the cache if PATH or one of its directories changed
+/// @details The events are only taken under the write lock, so a single
+/// thread sees them and flushes before anyone looks the entries up again.
+/// @param gen Set to the generation of the entries checked
+/// @return PATH of the context
+static const char *pathcache_sync(const ShellCtx *ctx, unsigned *gen) {
+  const char *path_env = shellctx_getenv(ctx, "PATH");
+  if (path_env == NULL) {
+    path_env = PATHCACHE_DEFAULT_PATH;
+  }
+
+  assertf(pthread_rwlock_rdlock(&cache.lock) == 0, "rwlock failed", NULL);
+  bool stale = cache.path_env == NULL || strcmp(cache.path_env, path_env) != 0;
+  bool pending = !stale && pathcache_pending();
+  *gen = cache.gen;
+  assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+  if (!stale && !pending) {
+    return path_env;
+  }
+
+  assertf(pthread_rwlock_wrlock(&cache.lock) == 0, "rwlock failed", NULL);
+  if (cache.path_env == NULL || strcmp(cache.path_env, path_env) != 0) {
+    log_debug("PATH changed, resetting the command cache\n", NULL);
+    pathcache_reset(path_env);
+  } else {
+    // Any event at all is enough, the events themselves are not needed.
+    // None are left if another thread took them first.
+    char events[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (read(cache.inotify_fd, events, sizeof(events)) > 0) {
+      changed = true;
+    }
+    if (changed) {
+      log_debug("PATH directory changed, clearing the command cache\n", NULL);
+      pathcache_flush();
+    }
+  }
+  *gen = cache.gen;
+  assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+  return path_env;
+}
+
+/// @brief Walk PATH for a name
+/// @param dir_fd Directory relative entries are looked up from
+/// @param cacheable Set to false if the result depends on the directory
+/// @return is ok
+static bool pathcache_resolve(int dir_fd, const char *path_env,
+                              const char *name, char *out, size_t cap,
+                              bool *cacheable) {
+  const char *p = path_env;
+  while (true) {
+    const char *sep = strchrnul(p, ':');
+    int len = sep - p;
+    // An empty entry is the current directory
+    int n = len == 0 ? snprintf(out, cap, "./%s", name)
+                     : snprintf(out, cap, "%.*s/%s", len, p, name);
+    struct stat st;
+    if (n > 0 && (size_t)n < cap && fstatat(dir_fd, out, &st, 0) == 0 &&
+        S_ISREG(st.st_mode) && faccessat(dir_fd, out, X_OK, 0) == 0) {
+      *cacheable = out[0] == '/';
+      return true;
+    }
+    if (*sep == '\0') {
+      return false;
+    }
+    p = sep + 1;
+  }
+}
+
+/// @brief Insert a resolution
+/// @note Must be called with the write lock held
+static void pathcache_insert(const char *name, const char *path) {
+  if ((cache.len + 1) * 2 > cache.cap) {
+    PathEntry *old = cache.table;
+    size_t old_cap = cache.cap;
+    cache.cap = old_cap == 0 ? 64 : old_cap * 2;
+    cache.table = calloc(cache.cap, sizeof(PathEntry));
+    assertf(cache.table != NULL, "calloc failed", NULL);
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].name != NULL) {
+        *pathcache_slot(old[i].name) = old[i];
+      }
+    }
+    free(old);
+  }
+  PathEntry *e = pathcache_slot(name);
+  if (e->name != NULL) {
+    return; // Another session resolved it meanwhile
+  }
+  e->name = strdup(name);
+  e->path = strdup(path);
+  assertf(e->name != NULL && e->path != NULL, "strdup failed", NULL);
+  e->hits = 1;
+  cache.len++;
+}
+
+bool pathcache_lookup(const ShellCtx *ctx, const char *name, char *out,
+                      size_t cap) {
+  if (strchr(name, '/') != NULL || name[0] == '\0') {
+    return false;
+  }
+  unsigned gen;
+  const char *path_env = pathcache_sync(ctx, &gen);
+
+  assertf(pthread_rwlock_rdlock(&cache.lock) == 0, "rwlock failed", NULL);
+  // Another session may have reset the cache for its own PATH meanwhile
+  if (cache.cap != 0 && strcmp(cache.path_env, path_env) == 0) {
+    PathEntry *e = pathcache_slot(name);
+    if (e->name != NULL && strlen(e->path) < cap) {
+      strcpy(out, e->path);
+      __atomic_add_fetch(&e->hits, 1, __ATOMIC_RELAXED);
+      assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+      return true;
+    }
+  }
+  assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+
+  // The walk itself runs unlocked, its result is dropped if the entries
+  // were meanwhile
+  bool cacheable = false;
+  if (!pathcache_resolve(ctx->dir_fd, path_env, name, out, cap,
+                         &cacheable)) {
+    return false;
+  }
+  if (cacheable) {
+    assertf(pthread_rwlock_wrlock(&cache.lock) == 0, "rwlock failed", NULL);
+    if (cache.gen == gen && strcmp(cache.path_env, path_env) == 0) {
+      pathcache_insert(name, out);
+    }
+    assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+  }
+  return true;
+}
+
+void pathcache_forget(const char *name) {
+  assertf(pthread_rwlock_wrlock(&cache.lock) == 0, "rwlock failed", NULL);
+  if (cache.cap == 0) {
+    assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+    return;
+  }
+  PathEntry *e = pathcache_slot(name);
+  if (e->name != NULL) {
+    cache.gen++; // A walk under way may have found the same stale path
+    free(e->name);
+    free(e->path);
+    *e = (PathEntry){0};
+    cache.len--;
+
+    // Backward shift deletion keeps the probe sequences unbroken
+    size_t mask = cache.cap - 1;
+    size_t hole = e - cache.table;
+    for (size_t i = (hole + 1) & mask; cache.table[i].name != NULL;
+         i = (i + 1) & mask) {
+      size_t home = pathcache_hash(cache.table[i].name) & mask;
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        cache.table[hole] = cache.table[i];
+        cache.table[i] = (PathEntry){0};
+        hole = i;
+      }
+    }
+  }
+  assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+}
+
+void pathcache_clear(void) {
+  assertf(pthread_rwlock_wrlock(&cache.lock) == 0, "rwlock failed", NULL);
+  pathcache_flush();
+  assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+}
+
+void pathcache_print(const ShellCtx *ctx, int fd) {
+  unsigned gen;
+  pathcache_sync(ctx, &gen);
+  assertf(pthread_rwlock_rdlock(&cache.lock) == 0, "rwlock failed", NULL);
+  if (cache.len == 0) {
+    dprintf(fd, "hash: hash table empty\n");
+  } else {
+    dprintf(fd, "hits\tcommand\n");
+    for (size_t i = 0; i < cache.cap; i++) {
+      PathEntry *e = &cache.table[i];
+      if (e->name != NULL) {
+        dprintf(fd, "%4zu\t%s\n",
+                __atomic_load_n(&e->hits, __ATOMIC_RELAXED), e->path);
+      }
+    }
+  }
+  assertf(pthread_rwlock_unlock(&cache.lock) == 0, "rwlock failed", NULL);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "shellctx.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief Resolve a command name through PATH, like execvp does
+/// @details Uses the PATH of the context, relative entries are looked up
+/// from its working directory. Resolutions through absolute entries are
+/// cached process wide (shared by all the server sessions). The cache is
+/// dropped when the PATH it was filled with changes or when a PATH
+/// directory changes (inotify). Names containing '/' are not looked up.
+/// @param ctx Working directory and environment of the command
+/// @param name Command name
+/// @param out Path of the command, relative to the context's directory if
+/// found through a relative entry
+/// @param cap Size of out
+/// @return is ok, false if the command is not in PATH
+bool pathcache_lookup(const ShellCtx *ctx, const char *name, char *out,
+                      size_t cap);
+
+/// @brief Drop the cached resolution of a name (e.g. exec gave ENOENT)
+void pathcache_forget(const char *name);
+
+/// @brief Drop all the cached resolutions
+void pathcache_clear(void);
+
+/// @brief Print the cached resolutions (`hash` builtin)
+/// @param ctx Context whose PATH the cache must match
+/// @param fd Output file descriptor
+void pathcache_print(const ShellCtx *ctx, int fd);
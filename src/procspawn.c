@@ -0,0 +1,106 @@
+#define _GNU_SOURCE // execvpe, posix_spawn_file_actions_addfchdir_np
+#include "procspawn.h"
+#include "log.h"
+#include "panic.h"
+#include "zygote.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+SpawnBackend spawn_backend = SPAWN_POSIX;
+
+extern char **environ;
+
+static pid_t spawn_posix(const SpawnRequest *req) {
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  assertf(posix_spawn_file_actions_init(&fa) == 0, "file actions init failed",
+          NULL);
+  assertf(posix_spawnattr_init(&attr) == 0, "spawnattr init failed", NULL);
+
+  posix_spawn_file_actions_adddup2(&fa, req->stdin_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, req->stdout_fd, STDOUT_FILENO);
+  if (req->dir_fd != AT_FDCWD) {
+    posix_spawn_file_actions_addfchdir_np(&fa, req->dir_fd);
+  }
+
+  short flags = 0;
+  if (req->pgid != -1) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, req->pgid);
+  }
+  sigset_t none;
+  sigemptyset(&none);
+  flags |= POSIX_SPAWN_SETSIGMASK;
+  posix_spawnattr_setsigmask(&attr, &none);
+  sigset_t def;
+  sigemptyset(&def);
+  sigaddset(&def, SIGPIPE);
+  flags |= POSIX_SPAWN_SETSIGDEF;
+  posix_spawnattr_setsigdefault(&attr, &def);
+  posix_spawnattr_setflags(&attr, flags);
+
+  char **envp = req->envp != NULL ? req->envp : environ;
+  pid_t pid;
+  int err = req->path != NULL
+                ? posix_spawn(&pid, req->path, &fa, &attr, req->argv, envp)
+                : posix_spawnp(&pid, req->argv[0], &fa, &attr, req->argv, envp);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+
+static pid_t spawn_fork(const SpawnRequest *req) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  if (req->pgid != -1) {
+    setpgid(0, req->pgid);
+  }
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  signal(SIGPIPE, SIG_DFL);
+  assertf(dup2(req->stdin_fd, STDIN_FILENO) != -1, "dup2 failed", NULL);
+  assertf(dup2(req->stdout_fd, STDOUT_FILENO) != -1, "dup2 failed", NULL);
+  if (req->dir_fd != AT_FDCWD && fchdir(req->dir_fd) == -1) {
+    log_error_fd(req->log_fd, "Unable to enter the working directory\n",
+                 NULL);
+    _exit(126);
+  }
+
+  log_debug_fd(req->log_fd, "Executing command: %s\n", req->argv[0]);
+  char **envp = req->envp != NULL ? req->envp : environ;
+  if (req->path != NULL) {
+    execve(req->path, req->argv, envp);
+  } else {
+    execvpe(req->argv[0], req->argv, envp);
+  }
+  log_warn_fd(req->log_fd, "Command not found: %s\n", req->argv[0]);
+  _exit(127);
+}
+
+pid_t spawn_command(const SpawnRequest *req) {
+  if (spawn_backend == SPAWN_ZYGOTE) {
+    pid_t pid = zygote_spawn(req);
+    if (pid != -1 || errno != E2BIG) {
+      return pid;
+    }
+    // Too large for one message, spawned here instead
+  }
+  if (spawn_backend == SPAWN_FORK) {
+    return spawn_fork(req);
+  }
+  return spawn_posix(req);
+}
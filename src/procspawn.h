@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/// @brief Process creation backend
+typedef enum {
+  SPAWN_POSIX, // posix_spawn (clone(CLONE_VM|CLONE_VFORK) in glibc)
+  SPAWN_FORK,  // fork + exec
+  SPAWN_ZYGOTE, // posix_spawn from the pre-forked helper (server)
+} SpawnBackend;
+
+/// @brief Backend used by spawn_command, SPAWN_POSIX by default
+extern SpawnBackend spawn_backend;
+
+/// @brief Child process description
+typedef struct {
+  const char *path; // Executable, NULL to look argv[0] up in PATH
+  char **argv;      // NULL terminated
+  int stdin_fd;     // Duplicated onto stdin
+  int stdout_fd;    // Duplicated onto stdout
+  pid_t pgid;       // Process group: 0 for a new group, -1 to stay in ours
+  int log_fd;       // Where a forked child reports exec failures
+  int dir_fd;       // Working directory of the child, AT_FDCWD for ours
+  char **envp;      // Environment of the child, NULL for ours
+} SpawnRequest;
+
+/// @brief Start a command
+/// @details Every other descriptor the child must not keep has to be
+/// close-on-exec. The child starts with no signal blocked (the shell keeps
+/// SIGCHLD blocked for the reaper) and SIGPIPE at its default action.
+/// @return pid of the child, -1 and errno set if it could not be started
+pid_t spawn_command(const SpawnRequest *req);
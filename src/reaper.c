@@ -0,0 +1,183 @@
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
+#include "reaper.h"
+#include "jobs.h"
+#include "log.h"
+#include "panic.h"
+#include "zygote.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define REAPER_COLLECT_MS 10 // Between looks for exits the reaper may take
+
+static struct {
+  pthread_t thread;
+  Jobs *jobs;
+  int signal_fd;
+  int stop_fd; // eventfd, written to stop the thread
+  int epoll_fd;
+  pthread_rwlock_t gate; // Read held by reaper_hold, write by the reaper
+  pthread_mutex_t collect; // One reader of the helper's exits at a time
+  uint64_t collected;      // Exits taken from the helper
+} reaper = {
+    .collect = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// @brief Hand a wait status to the job table
+static void reaper_report(pid_t pid, int status, const struct rusage *ru) {
+  bool background = jobs_update(reaper.jobs, pid, status, ru);
+  if (!background) {
+    return;
+  }
+  if (WIFEXITED(status)) {
+    log_info("[H] Process with PID %d exited with status %d\n", pid,
+             WEXITSTATUS(status));
+  } else if (WIFSIGNALED(status)) {
+    log_info("[H] Process with PID %d exited abnormally\n", pid);
+  }
+}
+
+/// @brief Reap every child that changed state
+static void reaper_reap(void) {
+  int status;
+  struct rusage ru;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) >
+         0) {
+    reaper_report(pid, status, &ru);
+  }
+}
+
+/// @brief Take one exit reported by the spawn helper
+/// @note Must be called with the collect lock held
+/// @return Was there one
+static bool reaper_collect_one(void) {
+  int status;
+  struct rusage ru;
+  pid_t pid;
+  if (!zygote_read_exit(&pid, &status, &ru)) {
+    return false;
+  }
+  reaper.collected++;
+  reaper_report(pid, status, &ru);
+  return true;
+}
+
+/// @brief Take the exits reported by the spawn helper
+static void reaper_collect_zygote(void) {
+  assertf(pthread_mutex_lock(&reaper.collect) == 0, "mutex lock failed",
+          NULL);
+  while (reaper_collect_one()) {
+  }
+  pthread_mutex_unlock(&reaper.collect);
+}
+
+static void *reaper_run(void *arg __attribute__((unused))) {
+  while (true) {
+    struct epoll_event events[3];
+    int n = epoll_wait(reaper.epoll_fd, events, 3, -1);
+    if (n == -1) {
+      assertf(errno == EINTR, "epoll_wait failed", NULL);
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == reaper.stop_fd) {
+        return NULL;
+      }
+      if (events[i].data.fd == zygote_events_fd()) {
+        reaper_collect_zygote();
+      }
+    }
+    // Several SIGCHLDs collapse into one, so the siginfo is not used
+    struct signalfd_siginfo info[16];
+    while (read(reaper.signal_fd, info, sizeof(info)) > 0) {
+    }
+    assertf(pthread_rwlock_wrlock(&reaper.gate) == 0, "rwlock failed", NULL);
+    reaper_reap();
+    assertf(pthread_rwlock_unlock(&reaper.gate) == 0, "rwlock failed", NULL);
+  }
+}
+
+void reaper_start(Jobs *jobs) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  assertf(pthread_sigmask(SIG_BLOCK, &set, NULL) == 0, "sigmask failed", NULL);
+
+  reaper.jobs = jobs;
+  // Prefer the reaper, so a steady stream of pipelines cannot starve it
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  assertf(pthread_rwlock_init(&reaper.gate, &attr) == 0, "rwlock failed",
+          NULL);
+  pthread_rwlockattr_destroy(&attr);
+  reaper.signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  reaper.stop_fd = eventfd(0, EFD_CLOEXEC);
+  reaper.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  assertf(reaper.signal_fd != -1 && reaper.stop_fd != -1 &&
+              reaper.epoll_fd != -1,
+          "reaper setup failed", NULL);
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = reaper.signal_fd};
+  assertf(epoll_ctl(reaper.epoll_fd, EPOLL_CTL_ADD, reaper.signal_fd, &ev) ==
+              0,
+          "epoll_ctl failed", NULL);
+  ev.data.fd = reaper.stop_fd;
+  assertf(epoll_ctl(reaper.epoll_fd, EPOLL_CTL_ADD, reaper.stop_fd, &ev) == 0,
+          "epoll_ctl failed", NULL);
+  if (zygote_events_fd() != -1) {
+    ev.data.fd = zygote_events_fd();
+    assertf(epoll_ctl(reaper.epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0,
+            "epoll_ctl failed", NULL);
+  }
+
+  assertf(pthread_create(&reaper.thread, NULL, reaper_run, NULL) == 0,
+          "Unable to create reaper thread", NULL);
+}
+
+void reaper_stop(void) {
+  uint64_t one = 1;
+  assertf(write(reaper.stop_fd, &one, sizeof(one)) == sizeof(one),
+          "eventfd write failed", NULL);
+  pthread_join(reaper.thread, NULL);
+  close(reaper.epoll_fd);
+  close(reaper.stop_fd);
+  close(reaper.signal_fd);
+  pthread_rwlock_destroy(&reaper.gate);
+}
+
+void reaper_hold(void) {
+  assertf(pthread_rwlock_rdlock(&reaper.gate) == 0, "rwlock failed", NULL);
+  // The helper reaps on its own: the exits it reaped before the hold are
+  // taken now, or the next spawn may reuse a pid still in a job
+  uint64_t reaped = zygote_hold();
+  assertf(pthread_mutex_lock(&reaper.collect) == 0, "mutex lock failed",
+          NULL);
+  while (reaper.collected < reaped) {
+    if (reaper_collect_one()) {
+      continue;
+    }
+    // Still queued in the helper, or taken by the reaper meanwhile
+    pthread_mutex_unlock(&reaper.collect);
+    struct pollfd pfd = {.fd = zygote_events_fd(), .events = POLLIN};
+    poll(&pfd, 1, REAPER_COLLECT_MS);
+    assertf(pthread_mutex_lock(&reaper.collect) == 0, "mutex lock failed",
+            NULL);
+  }
+  pthread_mutex_unlock(&reaper.collect);
+}
+
+void reaper_release(void) {
+  zygote_release();
+  assertf(pthread_rwlock_unlock(&reaper.gate) == 0, "rwlock failed", NULL);
+}
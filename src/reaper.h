@@ -0,0 +1,26 @@
+#pragma once
+
+#include "jobs.h"
+
+/// @brief Start the reaper thread
+/// @details The reaper is the only place children are waited for. It reads
+/// SIGCHLD from a signalfd and hands every wait status to the job table,
+/// which wakes the waiters. Exits reported by the spawn helper (zygote.h)
+/// take the same path, so zygote_start must come first. SIGCHLD is blocked
+/// in the calling thread, so this must run before any other thread is
+/// created for every thread to inherit the mask.
+/// @param jobs Job table of the children
+void reaper_start(Jobs *jobs);
+
+/// @brief Stop the reaper thread
+void reaper_stop(void);
+
+/// @brief Keep the reaper from reaping until reaper_release
+/// @details A process group only exists while its leader is not reaped, so
+/// the group of a pipeline must be held while its stages join it. The
+/// spawn helper is held too, and the exits it reaped before are handed to
+/// the job table first, so no pid added meanwhile is still in a job.
+void reaper_hold(void);
+
+/// @brief Let the reaper reap again
+void reaper_release(void);
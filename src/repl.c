@@ -1,49 +1,142 @@
 #include "repl.h"
+#include "compile.h"
 #include "exec.h"
 #include "lexer.h"
 #include "log.h"
 #include "panic.h"
 #include "parser.h"
+#include "reaper.h"
 #include "types.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 Jobs *repl_jobs;
 
-static void repl_handle_sigchld(int sig __attribute__((unused))) {
-  int status;
-  pid_t pid;
+/// @brief Line reader feeding the REPL lexer
+typedef struct {
+  FILE *in;
+  bool echo;       // Echo the lines read (script mode)
+  bool line_start; // The next read starts a new line
+  bool is_eof;     // Input is over
+  Lexer *lexer;
+} ReplReader;
 
-  while ((pid = waitpid(0, &status, WNOHANG)) > 0) {
-    if (pid == -1) {
-      log_error("Error: waitpid failed\n", NULL);
-      return;
+/// @brief LexSource callback: print the prompt and read up to one line
+static ssize_t repl_read(void *ctx, char *buf, size_t cap) {
+  ReplReader *rr = (ReplReader *)ctx;
+  if (rr->is_eof) {
+    return 0;
+  }
+  if (rr->line_start) {
+    // Unterminated quotes and escapes continue on the next line
+    printf(rr->lexer->state == LEX_STATE_START ? ">> " : "> ");
+    fflush(stdout);
+  }
+
+  size_t i = 0;
+  while (i < cap) {
+    int c = fgetc(rr->in);
+    if (c == 4 || (c == EOF && feof(rr->in))) { // Ctrl + D (EOF)
+      if (i == 0) {
+        printf("\nExiting... (Ctrl + D)\n");
+      }
+      rr->is_eof = true;
+      break;
+    }
+    if (c == EOF) { // Interrupted by a signal
+      clearerr(rr->in);
+      continue;
     }
-    if (!WIFEXITED(status) && !WIFSIGNALED(status)) {
-      log_info("[H] Process with PID %d exited abnormally\n", pid);
+    if (c == 12) { // Ctrl + L
+      printf("\033[H\033[2J"); // Home, erase display
+      fflush(stdout);
       continue;
     }
-    log_info("[H] Process with PID %d exited with status %d\n", pid,
-             WEXITSTATUS(status));
-    remove_pid(repl_jobs, pid);
+    buf[i++] = c;
+    if (c == '\n') { // Enter
+      break;
+    }
   }
-  signal(SIGCHLD, repl_handle_sigchld); // WTF? Why do we need this?
+
+  rr->line_start = i == 0 || buf[i - 1] == '\n';
+  if (rr->echo && i != 0) {
+    fwrite(buf, 1, i, stdout);
+    if (rr->is_eof && !rr->line_start) {
+      putchar('\n');
+    }
+    fflush(stdout);
+  }
+  return i;
 }
 
-typedef enum {
-  REPL_PHR_EXIT = 1,
-} REPLPrehookResult;
+/// @brief Install the REPL signal handlers, job list and reaper
+static void repl_setup(void) {
+  if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
+    panic("Error: Unable to catch SIGINT\n");
+  }
+  // Output written by the shell itself reports EPIPE instead
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    panic("Error: Unable to ignore SIGPIPE\n");
+  }
+
+  repl_jobs = jobs_new();
+  reaper_start(repl_jobs);
+}
+
+/// @brief Run commands until the input is over or `exit` is called, then
+/// wait for the background jobs
+static void repl_run(Parser *parser) {
+  Executor executor = executor_new(parser, repl_jobs);
+
+  while (true) {
+    ExecResult er = exec_next(&executor, STDIN_FILENO, STDOUT_FILENO, NULL);
+    if (er.status == EXEC_PARSE_EOF) {
+      break;
+    }
+    if (er.status == EXEC_EXIT) {
+      log_debug("Exiting REPL\n", NULL);
+      break;
+    }
 
-int repl_prehook(Command cmd) {
-  char *cmd_name = slice_to_stack_str(cmd.name);
-  if (strcmp(cmd_name, "exit") == 0) {
-    log_debug("Exiting REPL\n", NULL);
-    return REPL_PHR_EXIT;
+    switch (er.status) {
+    case EXEC_ERROR_FILE_OPEN:
+      log_error("Unable to open file\n", NULL);
+      break;
+    case EXEC_ERROR_CONNECT:
+      log_error("Unable to connect\n", NULL);
+      break;
+    case EXEC_PARSE_ERROR:
+      log_error("Invalid Syntax\n", NULL);
+      break;
+    case EXEC_SEMANTIC_ERROR:
+      log_error("Semantic Error: %s\n",
+                get_semantic_reason(er.semantic_reason));
+      break;
+    case EXEC_PARSE_EOF:
+      break;
+    case EXEC_SUCCESS:
+      break;
+    case EXEC_IN_BACKGROUND:
+      break;
+    case EXEC_PIPELINE:
+      break;
+    case EXEC_PREHOOK_BREAK:
+      break;
+    case EXEC_EXIT:
+      break;
+    }
   }
-  return 0;
+  jobs_wait(repl_jobs, NULL);
+  reaper_stop();
+  jobs_free(repl_jobs);
 }
 
 int shsh_repl(shsh_repl_ctx ctx) {
@@ -53,111 +146,81 @@ int shsh_repl(shsh_repl_ctx ctx) {
     in = ctx.in;
   }
 
-  if (signal(SIGCHLD, repl_handle_sigchld) == SIG_ERR) {
-    panic("Error: Unable to catch SIGCHLD\n");
+  repl_setup();
+
+  ReplReader reader = {
+      .in = in,
+      .echo = ctx.in != NULL,
+      .line_start = true,
+  };
+  Lexer lexer = lex_new_stream((LexSource){.read = repl_read, .ctx = &reader});
+  reader.lexer = &lexer;
+  Parser parser = parse_new(&lexer);
+  repl_run(&parser);
+  parse_free(&parser);
+  lex_free(&lexer);
+
+  return 0;
+}
+
+/// @brief LexSource callback: read the next block of a non-mappable script
+static ssize_t script_read(void *ctx, char *buf, size_t cap) {
+  int fd = *(int *)ctx;
+  ssize_t n;
+  do {
+    n = read(fd, buf, cap);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    log_error("Error: Unable to read script: %s\n", strerror(errno));
   }
-  if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
-    panic("Error: Unable to catch SIGINT\n");
+  return n;
+}
+
+int shsh_script(shsh_script_ctx ctx) {
+  log_debug("Running script %s\n", ctx.path);
+  int fd = open(ctx.path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    log_error("Error: Unable to open script %s\n", ctx.path);
+    return 1;
   }
 
-  char input[1024 * 3]; // 3KB
-  repl_jobs = jobs_new();
+  // Regular files are mapped and lexed in one go, pipes and devices are
+  // read in blocks by the lexer itself
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
 
-  Lexer lexer;
+  Lexer lexer = lex_new_stream((LexSource){0});
   Parser parser;
-  Executor executor = executor_new(NULL, repl_jobs);
-
-  bool is_eof = false;
-  while (!is_eof) {
-    printf(">> ");
-    int i = 0;
-    char c;
-    while (1) {
-      // read from in
-      c = fgetc(in);
-      if (c == '\n') { // Enter
-        input[i] = '\0';
-        break;
-      }
-      if (c == 4) { // Ctrl + D
-        printf("\nExiting... (Ctrl + D)\n");
-        return 0;
-      }
-      if (c == 12) { // Ctrl + L
-        system("clear");
-        continue;
-      }
-      if (c == EOF && feof(in)) { // Ctrl + D (EOF)
-        if (i != 0) {
-          input[i] = '\0';
-          break;
-        }
-        printf("\nExiting... (Ctrl + D)\n");
-        is_eof = true;
-        break;
-      } else if (c == EOF) {
-        continue;
-      }
-      input[i++] = c;
-      if (ctx.in != NULL) {
-        putchar(c);
-      }
+  CompiledScript compiled = {0};
+  if (map != MAP_FAILED && ctx.use_cache) {
+    // Replay the cached compiled form, compile it if there is none
+    if (!compiled_load(&compiled, ctx.path, &st, map)) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      compiled_build(&compiled, ctx.path, &st, map);
     }
-    if (ctx.in != NULL) {
-      putchar('\n');
-    }
-    input[i] = '\0';
-
-    lexer = lex_new(input);
+    parser = parse_new_compiled(&compiled);
+  } else if (map != MAP_FAILED) {
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    lex_feed(&lexer, map, st.st_size);
+    lex_finish(&lexer);
     parser = parse_new(&lexer);
-    executor.parser = &parser;
-
-    while (1) {
-      ExecResult er =
-          exec_next(&executor, STDIN_FILENO, STDOUT_FILENO, repl_prehook);
-      if (er.status == EXEC_PARSE_EOF) {
-        break;
-      }
+  } else {
+    lexer = lex_new_stream((LexSource){.read = script_read, .ctx = &fd});
+    parser = parse_new(&lexer);
+  }
 
-      if (er.status == EXEC_PREHOOK_BREAK) {
-        if (er.prehook_result == REPL_PHR_EXIT) {
-          is_eof = true;
-          break;
-        }
-        panic("Unknown prehook result\n");
-      }
+  repl_setup();
+  repl_run(&parser);
 
-      switch (er.status) {
-      case EXEC_ERROR_FILE_OPEN:
-        log_error("Unable to open file\n", NULL);
-        break;
-      case EXEC_PARSE_ERROR:
-        log_error("Invalid Syntax\n", NULL);
-        break;
-      case EXEC_SEMANTIC_ERROR:
-        log_error("Semantic Error: %s\n",
-                  get_semantic_reason(er.semantic_reason));
-        break;
-      case EXEC_PARSE_EOF:
-        break;
-      case EXEC_SUCCESS:
-        break;
-      case EXEC_IN_BACKGROUND:
-        break;
-      case EXEC_PIPELINE:
-        break;
-      case EXEC_PREHOOK_BREAK:
-        break;
-      }
-    }
+  parse_free(&parser);
+  lex_free(&lexer);
+  compiled_free(&compiled);
+  if (map != MAP_FAILED) {
+    munmap(map, st.st_size);
   }
-  for (int i = 0; i < repl_jobs->pids_size; i++) {
-    if (repl_jobs->pids[i] != -1) {
-      log_info("Waiting for PID %d\n", repl_jobs->pids[i]);
-      waitpid(repl_jobs->pids[i], NULL, 0);
-    }
-  }
-  jobs_free(repl_jobs);
-
+  close(fd);
   return 0;
 }
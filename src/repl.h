@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 
 typedef struct {
@@ -9,3 +10,14 @@ typedef struct {
 /// @brief ShSh REPL
 /// @param ctx -- REPL context
 int shsh_repl(shsh_repl_ctx ctx);
+
+typedef struct {
+  char *path;
+  bool use_cache; // Use the compiled script cache
+} shsh_script_ctx;
+
+/// @brief Run a script non-interactively (no prompt, no echo)
+/// @details Regular files are memory-mapped, pipes are read in large blocks.
+/// Regular files are compiled once and replayed from the cache afterwards.
+/// @param ctx -- script context
+int shsh_script(shsh_script_ctx ctx);
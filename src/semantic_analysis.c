@@ -4,6 +4,7 @@ const char *semantic_reasons[] = {
     "TCP IN/OUT and FILE IN/OUT cannot be used together",
     "OUT to the file/tcp and PIPE cannot be used together",
     "PIPE and BACKGROUND cannot be used together",
+    "IN from the file/tcp and PIPE cannot be used together",
 };
 
 SemanticResult semantic_analyze(Command *command) {
@@ -27,6 +28,21 @@ SemanticResult semantic_analyze(Command *command) {
   return (SemanticResult){.result = SEMANTIC_OK};
 }
 
+SemanticResult semantic_analyze_pipeline(Pipeline *pipeline) {
+  for (size_t i = 0; i < pipeline->len; i++) {
+    Command *command = &pipeline->commands[i];
+    SemanticResult sr = semantic_analyze(command);
+    if (sr.result != SEMANTIC_OK) {
+      return sr;
+    }
+    if (i > 0 && (command->flags & (CMD_TCP_IN | CMD_FILE_IN))) {
+      return (SemanticResult){.reason = REASON_PIPE_IN_CONFLICT,
+                              .result = SEMANTIC_ERROR};
+    }
+  }
+  return (SemanticResult){.result = SEMANTIC_OK};
+}
+
 const char *get_semantic_reason(SemanticReasonEnum reason) {
   return semantic_reasons[reason];
 }
@@ -12,6 +12,7 @@ typedef enum {
   REASON_IO_CONFLICT,
   REASON_PIPE_CONFLICT,
   REASON_BACKGROUND_CONFLICT,
+  REASON_PIPE_IN_CONFLICT,
 } SemanticReasonEnum;
 
 typedef struct {
@@ -24,6 +25,11 @@ typedef struct {
 /// @return SemanticResult
 SemanticResult semantic_analyze(Command *command);
 
+/// @brief Analyze every stage of a pipeline and how the stages connect
+/// @param Pipeline pipeline
+/// @return SemanticResult
+SemanticResult semantic_analyze_pipeline(Pipeline *pipeline);
+
 /// @brief Get semantic reason
 /// @param SemanticReasonEnum reason
 /// @return const char*
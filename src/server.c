@@ -1,97 +1,104 @@
+#define _GNU_SOURCE // accept4
 #include "server.h"
+#include "builtins.h"
+#include "connreg.h"
 #include "exec.h"
+#include "fdcopy.h"
 #include "lexer.h"
 #include "log.h"
+#include "memo.h"
 #include "panic.h"
 #include "parser.h"
+#include "reaper.h"
+#include "shellctx.h"
 #include "types.h"
+#include "uring.h"
+#include "workpool.h"
+#include "zygote.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
-#include <sys/time.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-#define SELECT_TIMEOUT 5
+#define SERVER_TICK_MS 1000   // Timeouts and aborts are checked this often
+#define SERVER_EVENTS 64      // Events taken per epoll_wait
+#define SERVER_MIN_WORKERS 2  // Steps never wait, but may be slow (connect)
+#define SESSION_RECV_SIZE 4096
+#define SERVER_RING_ENTRIES 256 // io_uring submission queue
+#define SERVER_RING_BUFS 256    // Provided buffers, SESSION_RECV_SIZE each
+#define SERVER_RING_GROUP 0
 
-void *rshsh_handle_client(void *arg);
+// io_uring user_data: a SERVER_OP alone, or a session pointer with a
+// SESSION_OP in the low bits
+typedef enum {
+  SERVER_OP_ACCEPT = 1,
+  SERVER_OP_TICK = 2,
+  SERVER_OP_CANCEL = 3,
+  SESSION_OP_RECV = 4,
+  SESSION_OP_SEND = 5,  // The prompt, the read is linked to it
+  SESSION_OP_FLUSH = 6, // The rest of a prompt sent short, alone
+} ServerOp;
+#define SERVER_OP_MASK 7
+
+typedef struct Session Session;
+
+static void server_accept(int server_fd, int timeout);
+static void server_complete(struct io_uring_cqe *cqe, int server_fd,
+                            int timeout);
+static void session_run(void *arg);
+static void session_wake(Session *s, bool expired);
+static void session_sweep(void);
+static void session_close(Session *s);
+static void server_hangup(ConnId id);
 
 Jobs *server_jobs;
 bool server_running = true;
-
-typedef struct {
-  int client_fd;
-  int alive;
-} rshsh_server_conn;
-
-rshsh_server_conn *connections;
-int connections_size = 0;
-int connections_cap = 0;
-
-void conn_push(int conn) {
-  if (connections_size == connections_cap) {
-    connections_cap = connections_cap == 0 ? 1 : connections_cap * 2;
-    connections =
-        realloc(connections, connections_cap * sizeof(rshsh_server_conn));
-  }
-  connections[connections_size].client_fd = conn;
-  connections[connections_size].alive = 1;
-  connections_size++;
-}
-
-rshsh_server_conn *conn_get(int conn) {
-  for (int i = 0; i < connections_size; i++) {
-    if (connections[i].client_fd == conn) {
-      return &connections[i];
-    }
-  }
-  return NULL;
+static int server_epoll_fd = -1;
+static bool server_uses_uring; // Instead of epoll
+static Uring server_uring;
+static WorkPool *server_pool;
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Session *sessions; // All the connections
+static ConnRegistry *server_conns; // Connection handles for the console
+// Prompt components that do not change while the server runs, left empty
+// when they cannot be found (no controlling terminal)
+static char server_username[256];
+static char server_hostname[256];
+
+/// @brief Look up the user and host name for the prompts, once
+static void server_identify(void) {
+  gethostname(server_hostname, sizeof(server_hostname) - 1);
+  getlogin_r(server_username, sizeof(server_username));
 }
 
-void conn_remove(int conn) {
-  for (int i = 0; i < connections_size; i++) {
-    if (connections[i].client_fd == conn) {
-      for (int j = i; j < connections_size - 1; j++) {
-        connections[j] = connections[j + 1];
-      }
-      connections_size--;
-      break;
-    }
-  }
+void server_handle_sigint(int sig __attribute__((unused))) {
+  log_info("Received SIGINT\n", NULL);
+  server_running = false;
 }
 
-typedef struct {
-  int client_fd;
-  int timeout;
-} ClientThreadArgs;
-
-static void server_handle_sigchld(int sig __attribute__((unused))) {
-  int status;
-  pid_t pid;
-
-  while ((pid = waitpid(0, &status, WNOHANG)) > 0) {
-    if (pid == -1) {
-      log_error("Error: waitpid failed\n", NULL);
-      return;
-    }
-    if (!WIFEXITED(status) && !WIFSIGNALED(status)) {
-      log_info("[H] Process with PID %d exited abnormally\n", pid);
-      continue;
-    }
-    log_info("[H] Process with PID %d exited with status %d\n", pid,
-             WEXITSTATUS(status));
-    remove_pid(server_jobs, pid);
-  }
-  signal(SIGCHLD, server_handle_sigchld); // WTF? Why do we need this?
+/// @brief ConnEachFn: list a connection on the console
+static void server_print_conn(void *arg __attribute__((unused)), ConnId id,
+                              int fd, bool alive) {
+  printf("  %u.%u (fd %d): %s\n", CONN_SLOT(id), CONN_GEN(id), fd,
+         alive ? "Alive" : "Dead");
 }
 
-void server_handle_sigint(int sig __attribute__((unused))) {
-  log_info("Received SIGINT\n", NULL);
-  server_running = false;
+/// @brief ConnEachFn: wake a connection's session up for the shutdown
+static void server_shutdown_conn(void *arg __attribute__((unused)),
+                                 ConnId id __attribute__((unused)), int fd,
+                                 bool alive __attribute__((unused))) {
+  log_info("Closing connection %d\n", fd);
+  shutdown(fd, SHUT_RDWR);
 }
 
 void *rshsh_server_control(void *arg __attribute__((unused))) {
@@ -114,24 +121,29 @@ void *rshsh_server_control(void *arg __attribute__((unused))) {
       server_running = false;
     } else if (strcmp(input, "jobs\n") == 0) {
       printf("Jobs:\n");
-      for (int i = 0; i < server_jobs->pids_size; i++) {
-        printf("  %d\n", server_jobs->pids[i]);
-      }
+      fflush(stdout);
+      jobs_print(server_jobs, STDOUT_FILENO);
     } else if (strcmp(input, "stat\n") == 0) {
-      log_info("Connections:\n", NULL);
-      for (int i = 0; i < connections_size; i++) {
-        printf("  %d: %s\n", connections[i].client_fd,
-               connections[i].alive ? "Alive" : "Dead");
+      log_info("Connections: %u\n", atomic_load(&server_conns->count));
+      connreg_each(server_conns, server_print_conn, NULL);
+      if (server_jobs->admission != NULL) {
+        AdmitStats st;
+        admission_stats(server_jobs->admission, &st);
+        printf("Processes: %zu running, %zu queued\n", st.running, st.queued);
+        printf("Admitted: %llu, %llu waited (avg %.1f ms, max %.1f ms)\n",
+               (unsigned long long)st.admitted,
+               (unsigned long long)st.waited,
+               st.waited ? st.wait_total * 1e3 / st.waited : 0.0,
+               st.wait_max * 1e3);
       }
     } else if (strncmp(input, "abort", 5) == 0) {
-      int conn;
-      if (sscanf(input, "abort %d", &conn) == 1) {
-        rshsh_server_conn *c = conn_get(conn);
-        if (c == NULL) {
+      unsigned slot, gen;
+      if (sscanf(input, "abort %u.%u", &slot, &gen) == 2) {
+        if (!connreg_abort(server_conns, CONN_ID(slot, gen))) {
           log_error("Error: Connection not found\n", NULL);
         } else {
-          log_info("Aborting connection %d\n", conn);
-          c->alive = false;
+          log_info("Aborting connection %u.%u\n", slot, gen);
+          server_hangup(CONN_ID(slot, gen));
         }
       } else {
         log_error("Error: Invalid command\n", NULL);
@@ -140,8 +152,8 @@ void *rshsh_server_control(void *arg __attribute__((unused))) {
       printf("Commands:\n");
       printf("  quit - Exit the server\n");
       printf("  jobs - List all jobs (processes)\n");
-      printf("  stat - List all connections\n");
-      printf("  abort <conn> - Abort a connection\n");
+      printf("  stat - List all connections and queued processes\n");
+      printf("  abort <id> - Abort a connection, <id> as listed by stat\n");
     } else {
       printf("Unknown command\n");
     }
@@ -149,16 +161,111 @@ void *rshsh_server_control(void *arg __attribute__((unused))) {
   return NULL;
 }
 
-int rshsh_server(rshsh_server_ctx ctx) {
-  if (signal(SIGCHLD, server_handle_sigchld) == SIG_ERR) {
-    panic("Error: Unable to catch SIGCHLD\n");
+static void server_serve_epoll(int server_fd, int timeout) {
+  server_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  assertf(server_epoll_fd != -1, "epoll_create1 failed", NULL);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  assertf(epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == 0,
+          "epoll_ctl failed", NULL);
+
+  struct epoll_event events[SERVER_EVENTS];
+  while (server_running) {
+    int n = epoll_wait(server_epoll_fd, events, SERVER_EVENTS, SERVER_TICK_MS);
+    if (n == -1 && errno != EINTR) {
+      log_error("Error: epoll_wait() failed\n", NULL);
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        server_accept(server_fd, timeout);
+      } else {
+        session_wake(events[i].data.ptr, false);
+      }
+    }
+    session_sweep();
+  }
+}
+
+static struct __kernel_timespec server_tick = {
+    .tv_sec = SERVER_TICK_MS / 1000,
+    .tv_nsec = SERVER_TICK_MS % 1000 * 1000000L,
+};
+
+/// @brief Queue a request with no session
+/// @note Must be called with the ring lock held
+static void server_submit(ServerOp op, int server_fd) {
+  struct io_uring_sqe *sqe = uring_sqe(&server_uring);
+  assertf(sqe != NULL, "io_uring submission queue is stuck", NULL);
+  sqe->user_data = op;
+  if (op == SERVER_OP_ACCEPT) {
+    // One request accepts every connection until it runs out
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+  } else {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&server_tick;
+    sqe->len = 1;
+  }
+}
+
+/// @brief Set up the ring with its receive buffers and start accepting
+/// @return is ok
+static bool server_uring_start(int server_fd) {
+  if (!uring_init(&server_uring, SERVER_RING_ENTRIES)) {
+    return false;
+  }
+  // Buffer rings came with multishot accept, so that works too
+  if (!uring_buffers(&server_uring, SERVER_RING_BUFS, SESSION_RECV_SIZE,
+                     SERVER_RING_GROUP)) {
+    uring_free(&server_uring);
+    return false;
   }
+  pthread_mutex_lock(&server_uring.lock);
+  server_submit(SERVER_OP_ACCEPT, server_fd);
+  server_submit(SERVER_OP_TICK, server_fd);
+  bool ok = uring_submit(&server_uring);
+  pthread_mutex_unlock(&server_uring.lock);
+  if (!ok) {
+    uring_free(&server_uring);
+  }
+  return ok;
+}
+
+static void server_serve_uring(int server_fd, int timeout) {
+  struct io_uring_cqe cqes[SERVER_EVENTS];
+  while (server_running) {
+    size_t n = uring_wait(&server_uring, cqes, SERVER_EVENTS);
+    for (size_t i = 0; i < n; i++) {
+      server_complete(&cqes[i], server_fd, timeout);
+    }
+    session_sweep();
+  }
+}
+
+int rshsh_server(rshsh_server_ctx ctx) {
   if (signal(SIGINT, server_handle_sigint) == SIG_ERR) {
     panic("Error: Unable to catch SIGINT\n");
   }
+  // A client going away must not take the server with it
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    panic("Error: Unable to ignore SIGPIPE\n");
+  }
   log_info("Server mode\n", NULL);
 
+  memo_store = MEMO_MEMORY; // Sessions share it, nothing left on disk
+  server_identify();
+  // Forked while the server is small, holds no lock and has no socket
+  if (ctx.zygote && !zygote_start()) {
+    log_warn("Unable to start the spawn helper, spawning directly\n", NULL);
+  }
   server_jobs = jobs_new();
+  server_conns = connreg_new();
+  if (ctx.session_procs != 0 || ctx.server_procs != 0) {
+    server_jobs->admission =
+        admission_new(ctx.server_procs, ctx.session_procs);
+  }
+  reaper_start(server_jobs); // Before any other thread is created
 
   // Create a socket and bind it to the given port and host
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -180,7 +287,7 @@ int rshsh_server(rshsh_server_ctx ctx) {
     panicf("Error: Unable to bind socket to %s:%d\n", ctx.host, ctx.port);
   }
 
-  if (listen(server_fd, 10) == -1) {
+  if (listen(server_fd, SOMAXCONN) == -1) {
     panic("Error: Unable to listen on socket\n");
   }
 
@@ -200,72 +307,50 @@ int rshsh_server(rshsh_server_ctx ctx) {
     panic("Error: Unable to create control thread\n");
   }
 
-  while (server_running) {
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(server_fd, &read_fds);
-
-    struct timeval timeout;
-    timeout.tv_sec = SELECT_TIMEOUT;
-    timeout.tv_usec = 0;
-
-    int result = select(server_fd + 1, &read_fds, NULL, NULL, &timeout);
-    if (result == -1) {
-      log_error("Error: select() failed\n", NULL);
-      continue;
-    } else if (result == 0) {
-      continue;
-    }
-
-    int client_fd =
-        accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-    if (client_fd == -1) {
-      log_error("Error: Unable to accept connection\n", NULL);
-      continue;
-    }
-
-    conn_push(client_fd);
-
-    log_info("Accepted connection from %s:%d\n",
-             inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-
-    pthread_t thread;
-    ClientThreadArgs *cta = malloc(sizeof(ClientThreadArgs));
-    cta->client_fd = client_fd;
-    cta->timeout = ctx.timeout;
-    if (pthread_create(&thread, NULL, rshsh_handle_client, cta) != 0) {
-      close(client_fd);
-      free(cta);
-      conn_remove(client_fd);
-
-      panic("Error: Unable to create thread\n");
-    }
+  // One thread waits for every socket, a session only takes a worker while
+  // it has input to run or a finished job to report
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = cores > SERVER_MIN_WORKERS ? cores : SERVER_MIN_WORKERS;
+  server_pool = workpool_new(workers, session_run);
+  fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+  server_uses_uring = ctx.uring && server_uring_start(server_fd);
+  if (ctx.uring && !server_uses_uring) {
+    log_warn("io_uring is not available, using epoll\n", NULL);
   }
-
-  for (int i = 0; i < connections_size; i++) {
-    log_info("Closing connection %d\n", connections[i].client_fd);
-    close(connections[i].client_fd);
+  log_info("Running %zu workers on %s\n", workers,
+           server_uses_uring ? "io_uring" : "epoll");
+  if (server_uses_uring) {
+    server_serve_uring(server_fd, ctx.timeout);
+  } else {
+    server_serve_epoll(server_fd, ctx.timeout);
   }
 
+  // Sessions still parked are freed once the reaper and copies are done
+  workpool_stop(server_pool);
+  connreg_each(server_conns, server_shutdown_conn, NULL);
+  fdcopy_drain(); // The clients are shut down, copies to them fail fast
+
   log_info("Shutting down server\n", NULL);
   close(server_fd);
-  for (int i = 0; i < server_jobs->pids_size; i++) {
-    if (server_jobs->pids[i] == -1) {
-      continue;
-    }
-    int status;
-    log_info("Waiting for process %d to exit\n", server_jobs->pids[i]);
-    waitpid(server_jobs->pids[i], &status, 0);
+  jobs_wait(server_jobs, NULL);
+  reaper_stop();
+  zygote_stop();
+  if (server_uses_uring) {
+    uring_free(&server_uring); // Drops the reads still pointing at sessions
+  }
+  while (sessions != NULL) {
+    session_close(sessions);
   }
+  workpool_free(server_pool);
+  if (server_epoll_fd != -1) {
+    close(server_epoll_fd);
+  }
+  admission_free(server_jobs->admission);
   jobs_free(server_jobs);
+  connreg_free(server_conns);
   return 0;
 }
 
-void server_fill_prompt(char *prompt, const char *fmt);
-
 typedef enum {
   SERVER_PHR_QUIT = 1,
   SERVER_PHR_HALT = 2,
@@ -273,182 +358,721 @@ typedef enum {
 } ServerPrehookResult;
 
 int server_prehook(Command cmd) {
-  char *cmd_name = slice_to_stack_str(cmd.name);
-  if (strcmp(cmd_name, "quit") == 0) {
+  const Builtin *builtin = builtin_find(cmd.name);
+  if (builtin == NULL) {
+    return 0;
+  }
+  switch (builtin->id) {
+  case BUILTIN_QUIT:
     log_debug("Client requested exit\n", NULL);
     return SERVER_PHR_QUIT;
-  }
-  if (strcmp(cmd_name, "halt") == 0) {
+  case BUILTIN_HALT:
     log_debug("Client requested halt\n", NULL);
     return SERVER_PHR_HALT;
-  }
-  if (strcmp(cmd_name, "help") == 0) {
+  case BUILTIN_HELP:
     log_debug("Client requested help\n", NULL);
     return SERVER_PHR_HELP;
+  default:
+    return 0;
   }
-  return 0;
 }
 
-void *rshsh_handle_client(void *arg) {
-  ClientThreadArgs *cta = (ClientThreadArgs *)arg;
-  int client_fd = cta->client_fd;
-  int timeout = cta->timeout;
+typedef enum {
+  SESSION_ARMED, // Waiting in epoll for input
+  SESSION_BUSY,  // Queued, on a worker or waiting for its job
+  SESSION_WOKEN, // Input came while a worker was arming it
+} SessionState;
+
+/// @brief Connection state, driven by the workers
+struct Session {
+  ConnId conn;
+  int client_fd;
+  int in_fd;  // Duplicates of client_fd handed to the commands
+  int out_fd;
+  int timeout; // Seconds of silence before closing, 0 for none
+  Lexer lexer;
+  Parser parser; // Created with the first line, it reads a token ahead
+  bool parsing;
+  Executor executor;
+
+  char *in; // Received, not given to the lexer yet
+  size_t in_pos;
+  size_t in_next;  // End of the command being given to the lexer
+  size_t in_ready; // End of the last complete command
+  size_t in_scan;  // Framed up to here
+  size_t in_len;
+  size_t in_cap;
+  LexFrame frame; // Framing state at in_scan
+  bool eof;      // The client is gone or done sending
+  bool greeted;  // Welcome message sent
+  bool prompted; // Prompt sent since input was last taken
+  char prompt[PATH_MAX + 1024];
+  size_t prompt_len;
+  size_t prompt_sent; // Taken by the client, the rest goes out first
+  size_t prompt_off;  // Start of the send in flight (ring)
+  size_t prompt_head; // Length of the prompt before the time
+  unsigned prompt_gen; // Shell context generation of the head, 0 for none
+
+  _Atomic SessionState state;
+  bool expired;           // Timed out while armed (epoll thread)
+  bool expiring;          // Its ring requests are being cancelled
+  struct timespec idle;   // Armed since (CLOCK_MONOTONIC)
+  Session *prev, *next;   // All sessions
+};
+
+static bool session_alive(Session *s) {
+  return server_running && connreg_alive(server_conns, s->conn);
+}
 
-  rshsh_server_conn *conn = conn_get(client_fd);
-  free(cta);
+/// @brief End the jobs of an aborted connection's session
+/// @details A session parked on a job is not armed, so the sweep does not
+/// close it. Its jobs get SIGHUP, the command line then ends and the
+/// session sees the connection aborted.
+static void server_hangup(ConnId id) {
+  pthread_mutex_lock(&sessions_mutex); // Sessions are freed under it
+  for (Session *s = sessions; s != NULL; s = s->next) {
+    if (s->conn == id) {
+      jobs_hangup(server_jobs, &s->executor);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sessions_mutex);
+}
 
-  int in_fd, out_fd;
+/// @brief Make room for SESSION_RECV_SIZE more bytes of input
+static void session_reserve(Session *s) {
+  if (s->in_pos == s->in_len) {
+    s->in_pos = s->in_next = s->in_ready = s->in_scan = s->in_len = 0;
+  }
+  if (s->in_cap - s->in_len < SESSION_RECV_SIZE) {
+    // Slide the unread part to the front, grow if that is not enough
+    memmove(s->in, s->in + s->in_pos, s->in_len - s->in_pos);
+    s->in_next -= s->in_pos;
+    s->in_ready -= s->in_pos;
+    s->in_scan -= s->in_pos;
+    s->in_len -= s->in_pos;
+    s->in_pos = 0;
+    if (s->in_cap - s->in_len < SESSION_RECV_SIZE) {
+      s->in_cap = s->in_cap * 2 + SESSION_RECV_SIZE;
+      s->in = realloc(s->in, s->in_cap);
+      assertf(s->in != NULL, "realloc failed", NULL);
+    }
+  }
+}
 
-  if ((in_fd = dup(client_fd)) == -1) {
-    log_error("Error: Unable to duplicate file descriptor\n", NULL);
-    close(client_fd);
-    return NULL;
+/// @brief Receive what the client sent so far, without blocking
+static void session_recv(Session *s) {
+  while (!s->eof) {
+    session_reserve(s);
+    // The socket stays blocking for the commands writing to it
+    ssize_t n = recv(s->client_fd, s->in + s->in_len, s->in_cap - s->in_len,
+                     MSG_DONTWAIT);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n == -1) {
+      log_error("Error: Unable to read from socket\n", NULL);
+      s->eof = true;
+    } else if (n == 0) {
+      log_info("Client disconnected\n", NULL);
+      s->eof = true;
+    } else {
+      log_info("Received %ld bytes\n", n);
+      s->in_len += n;
+    }
   }
+}
 
-  if ((out_fd = dup(client_fd)) == -1) {
-    log_error("Error: Unable to duplicate file descriptor\n", NULL);
-    close(client_fd);
-    close(in_fd);
-    return NULL;
+/// @brief Frame the input received since the last call
+static void session_scan(Session *s) {
+  size_t from = s->in_scan;
+  size_t n;
+  while ((n = lex_frame(&s->frame, s->in + s->in_scan,
+                        s->in_len - s->in_scan)) != 0) {
+    s->in_scan += n;
+    s->in_ready = s->in_scan;
+  }
+  s->in_scan = s->in_len;
+  // A line that did not end the command, the client waits for a prompt
+  size_t tail = from > s->in_ready ? from : s->in_ready;
+  if (tail < s->in_len && memchr(s->in + tail, '\n', s->in_len - tail)) {
+    s->prompted = false;
   }
+}
 
-  char input[1024 * 3]; // 3KB
+/// @brief Can the next command be parsed without waiting for the client
+/// @details The lexer is only given complete commands, so the parser never
+/// has to wait in client_read for the rest of one.
+static bool session_has_line(Session *s) {
+  session_scan(s);
+  if (s->eof || s->in_ready > s->in_pos) {
+    return true;
+  }
+  if (!s->parsing) {
+    return false;
+  }
+  // The lexer holds the tail of a command that already ran, and the parser
+  // skips separators up to the next command
+  TokenType next = s->parser.current_token.type;
+  if (next != TOKEN_NEWLINE && next != TOKEN_SEMICOLON) {
+    return true;
+  }
+  LexFrame frame = {0};
+  return lex_frame(&frame, s->lexer.input + s->lexer.position,
+                   s->lexer.length - s->lexer.position) != 0;
+}
 
-  Lexer lexer;
-  Parser parser;
-  Executor executor = executor_new(NULL, server_jobs);
-
-  char *welcome = "                   #             #\n"
-                  "             mmm   # mm    mmm   # mm\n"
-                  "            #   \"  #\"  #  #   \"  #\"  #\n"
-                  "             \"\"\"m  #   #   \"\"\"m  #   #\n"
-                  "Welcome to  \"mmm\"  #   #  \"mmm\"  #   # by ic-it\n\n";
-
-  send(client_fd, welcome, strlen(welcome), 0);
-
-  const char *prompt_fmt = "[%s@%s:%s]-[%s]$ ";
-
-  bool is_eof = false;
-  while (is_eof == false && server_running == true && conn->alive == true) {
-    char prompt[1024];
-    server_fill_prompt(prompt, prompt_fmt);
-
-    // send prompt
-    send(client_fd, prompt, strlen(prompt), 0);
-
-    memset(input, 0, sizeof(input));
-
-    // select for timeout
-    if (timeout > 0) {
-      fd_set read_fds;
-      FD_ZERO(&read_fds);
-      FD_SET(client_fd, &read_fds);
-
-      struct timeval tv;
-      tv.tv_sec = timeout;
-      tv.tv_usec = 0;
-
-      int result = select(client_fd + 1, &read_fds, NULL, NULL, &tv);
-      if (result == -1) {
-        log_error("Error: select() failed\n", NULL);
-        break;
-      } else if (result == 0) {
-        send(client_fd, "Connection timed out\n", 21, 0);
-        log_info("Connection timed out\n", NULL);
-        break;
-      }
-    }
 
-    ssize_t bytes_read = recv(client_fd, input, sizeof(input), 0);
-    if (bytes_read == -1) {
-      log_error("Error: Unable to read from socket\n", NULL);
+/// @brief Render the prompt for the next input into s->prompt, none of it
+/// sent yet
+/// @details `[user@host:cwd]-[time]$ `. The part before the time is kept
+/// until the session changes directory, only the time is formatted anew.
+static void session_fill_prompt(Session *s) {
+  s->prompt_sent = 0;
+  if (s->frame.lines) {
+    strcpy(s->prompt, "> ");
+    s->prompt_len = 2;
+    s->prompt_gen = 0;
+    return;
+  }
+  const ShellCtx *shell = &s->executor.shell;
+  if (s->prompt_gen != shell->gen) {
+    snprintf(s->prompt, sizeof(s->prompt) - 16, "[%s@%s:%s]-[",
+             server_username, server_hostname, shell->cwd);
+    s->prompt_head = strlen(s->prompt);
+    s->prompt_gen = shell->gen;
+  }
+  struct tm tm;
+  time_t t = time(NULL);
+  localtime_r(&t, &tm);
+  s->prompt_len = s->prompt_head;
+  s->prompt_len += strftime(s->prompt + s->prompt_len,
+                            sizeof(s->prompt) - s->prompt_len, "%H:%M:%S]$ ",
+                            &tm);
+}
+
+/// @brief Send what the client takes of the prompt, without blocking
+/// @return Is all of it out, or dropped with a broken connection
+static bool session_send_prompt(Session *s) {
+  while (s->prompt_sent < s->prompt_len) {
+    ssize_t n = send(s->client_fd, s->prompt + s->prompt_sent,
+                     s->prompt_len - s->prompt_sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return false;
+    }
+    if (n == -1) {
+      s->prompt_sent = s->prompt_len; // Reading tells it is gone
       break;
     }
+    s->prompt_sent += n;
+  }
+  return true;
+}
 
-    if (bytes_read == 0) {
-      log_info("Client disconnected\n", NULL);
-      break;
+/// @brief LexSource callback: hand the lexer the next received command
+/// @details Never waits, session_has_line made sure the parser gets a whole
+/// command. One command at a time, so what the lexer holds past it stays
+/// short for session_has_line to look at.
+static ssize_t client_read(void *ctx, char *buf, size_t cap) {
+  Session *s = (Session *)ctx;
+  if (s->in_pos == s->in_next && s->in_next < s->in_ready) {
+    LexFrame frame = {0};
+    s->in_next += lex_frame(&frame, s->in + s->in_pos,
+                            s->in_ready - s->in_pos);
+  }
+  size_t end = s->eof ? s->in_len : s->in_next;
+  size_t len = end - s->in_pos;
+  if (len == 0) {
+    return 0; // The client is gone
+  }
+  if (len > cap) {
+    len = cap;
+  }
+  memcpy(buf, s->in + s->in_pos, len);
+  s->in_pos += len;
+  s->prompted = false; // The next wait for input prompts again
+  return len;
+}
+
+/// @brief Act on the result of a command
+/// @return Does the session go on
+static bool session_result(Session *s, ExecResult er) {
+  int out_fd = s->out_fd;
+  if (er.status == EXEC_PARSE_EOF) {
+    return false;
+  }
+  if (er.status == EXEC_EXIT) {
+    log_info("Client requested exit\n", NULL);
+    return false;
+  }
+
+  if (er.status == EXEC_PREHOOK_BREAK) {
+    if (er.prehook_result == SERVER_PHR_QUIT) {
+      log_info("Client requested exit\n", NULL);
+      return false;
     }
+    if (er.prehook_result == SERVER_PHR_HALT) {
+      log_info("Client requested halt\n", NULL);
+      server_running = false;
+      return false;
+    }
+    if (er.prehook_result == SERVER_PHR_HELP) {
+      log_info("Client requested help\n", NULL);
+      const char *help = "Commands:\n"
+                         "  quit - Exit the shell\n"
+                         "  halt - Halt the server\n"
+                         "  help - Show this help\n"
+                         "  jobs - List all jobs\n"
+                         "  wait - Wait for the background jobs\n"
+                         "  <cmd> - Run a command\n";
+      send(s->client_fd, help, strlen(help), MSG_NOSIGNAL);
+      return true;
+    }
+  }
+
+  switch (er.status) {
+  case EXEC_ERROR_FILE_OPEN:
+    log_error_fd(out_fd, "Unable to open file\n", NULL);
+    break;
+  case EXEC_ERROR_CONNECT:
+    log_error_fd(out_fd, "Unable to connect\n", NULL);
+    break;
+  case EXEC_PARSE_ERROR:
+    log_error_fd(out_fd, "Invalid Syntax\n", NULL);
+    break;
+  case EXEC_SEMANTIC_ERROR:
+    log_error_fd(out_fd, "Semantic Error: %s\n",
+                 get_semantic_reason(er.semantic_reason));
+    break;
+  case EXEC_PARSE_EOF:
+    break;
+  case EXEC_SUCCESS:
+    break;
+  case EXEC_IN_BACKGROUND:
+    break;
+  case EXEC_PIPELINE:
+    break;
+  case EXEC_PREHOOK_BREAK:
+    break;
+  case EXEC_EXIT:
+    break;
+  }
+  return true;
+}
+
+/// @brief Hand a session to the workers
+/// @param expired Closing it (epoll thread), instead of an input event
+static void session_wake(Session *s, bool expired) {
+  SessionState state = SESSION_ARMED;
+  if (atomic_compare_exchange_strong(&s->state, &state, SESSION_BUSY)) {
+    s->expired = expired;
+    workpool_push(server_pool, s);
+  } else if (!expired && state == SESSION_BUSY) {
+    // The worker arming it sees this and goes on instead
+    atomic_compare_exchange_strong(&s->state, &state, SESSION_WOKEN);
+  }
+}
+
+/// @brief Send the welcome banner
+static void session_greet(Session *s) {
+  const char *welcome =
+      "                   #             #\n"
+      "             mmm   # mm    mmm   # mm\n"
+      "            #   \"  #\"  #  #   \"  #\"  #\n"
+      "             \"\"\"m  #   #   \"\"\"m  #   #\n"
+      "Welcome to  \"mmm\"  #   #  \"mmm\"  #   # by ic-it\n\n";
+  send(s->client_fd, welcome, strlen(welcome), MSG_NOSIGNAL);
+  s->greeted = true;
+}
+
+static uint64_t session_op(Session *s, ServerOp op) {
+  return (uintptr_t)s | op;
+}
+
+/// @brief Queue a send of the prompt's unsent part
+/// @details Counted as sent, the completion of a short one (always posted)
+/// says how far it got.
+/// @param op SESSION_OP_SEND to link the read to it, or SESSION_OP_FLUSH
+static void session_submit_send(Session *s, ServerOp op) {
+  struct io_uring_sqe *sqe = uring_sqe(&server_uring);
+  assertf(sqe != NULL, "io_uring submission queue is stuck", NULL);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = s->client_fd;
+  sqe->addr = (uintptr_t)(s->prompt + s->prompt_sent);
+  sqe->len = s->prompt_len - s->prompt_sent;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->flags = op == SESSION_OP_SEND ? IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS
+                                     : 0;
+  sqe->user_data = session_op(s, op);
+  s->prompt_off = s->prompt_sent;
+  s->prompt_sent = s->prompt_len;
+}
+
+/// @brief Queue the prompt and a read of the next input in one submission,
+/// or only the rest of a prompt sent short
+/// @details The read starts once the send is done, so its completion is the
+/// last word on the session. Its data lands in a provided buffer and is
+/// copied out by the ring thread. A short send fails the read, the session
+/// then sends the rest first.
+/// @param input Wait for input, else for the rest of the prompt to go out
+static void session_submit(Session *s, bool input) {
+  pthread_mutex_lock(&server_uring.lock);
+  if (!input) {
+    session_submit_send(s, SESSION_OP_FLUSH);
+    if (!uring_submit(&server_uring)) {
+      log_error("Error: io_uring_enter() failed\n", NULL);
+    }
+    pthread_mutex_unlock(&server_uring.lock);
+    return;
+  }
+  if (!s->prompted) {
+    session_fill_prompt(s);
+    s->prompted = true;
+    session_submit_send(s, SESSION_OP_SEND);
+  }
+  struct io_uring_sqe *sqe = uring_sqe(&server_uring);
+  assertf(sqe != NULL, "io_uring submission queue is stuck", NULL);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = s->client_fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = SERVER_RING_GROUP;
+  sqe->user_data = session_op(s, SESSION_OP_RECV);
+  if (!uring_submit(&server_uring)) {
+    log_error("Error: io_uring_enter() failed\n", NULL);
+  }
+  pthread_mutex_unlock(&server_uring.lock);
+}
+
+/// @brief Cancel the ring requests of a session, they complete and close it
+/// (ring thread)
+static void session_cancel(Session *s) {
+  s->expiring = true;
+  pthread_mutex_lock(&server_uring.lock);
+  // A read still waiting on its linked send is only found through the send
+  ServerOp ops[] = {SESSION_OP_SEND, SESSION_OP_RECV, SESSION_OP_FLUSH};
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    struct io_uring_sqe *sqe = uring_sqe(&server_uring);
+    assertf(sqe != NULL, "io_uring submission queue is stuck", NULL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = session_op(s, ops[i]);
+    sqe->user_data = SERVER_OP_CANCEL;
+  }
+  uring_submit(&server_uring);
+  pthread_mutex_unlock(&server_uring.lock);
+}
+
+/// @brief Wait in epoll or the ring for more input, or for the client to
+/// take the rest of the prompt
+/// @param input Wait for input, prompting first if not done yet
+/// @return Is it armed, the session then belongs to the epoll or ring thread
+static bool session_arm(Session *s, bool input) {
+  clock_gettime(CLOCK_MONOTONIC, &s->idle);
+  if (server_uses_uring) {
+    session_submit(s, input);
+  } else {
+    if (input && !s->prompted) {
+      session_fill_prompt(s);
+      s->prompted = true;
+      input = session_send_prompt(s);
+    }
+    // Without EPOLLRDHUP for room: a client that shut its side would wake
+    // it over and over
+    struct epoll_event ev = {
+        .events = input ? EPOLLIN | EPOLLRDHUP | EPOLLONESHOT
+                        : EPOLLOUT | EPOLLONESHOT,
+        .data.ptr = s,
+    };
+    assertf(epoll_ctl(server_epoll_fd, EPOLL_CTL_MOD, s->client_fd, &ev) == 0,
+            "epoll_ctl failed", NULL);
+  }
+  // An event may already have fired, it is not lost either way
+  SessionState busy = SESSION_BUSY;
+  if (atomic_compare_exchange_strong(&s->state, &busy, SESSION_ARMED)) {
+    return true;
+  }
+  atomic_store(&s->state, SESSION_BUSY);
+  return false;
+}
+
+/// @brief ExecDoneFn: the session's command line can go on, resume it on a
+/// worker
+static void session_job_done(Executor *executor __attribute__((unused)),
+                             void *arg) {
+  workpool_push(server_pool, arg);
+}
+
+static void session_close(Session *s) {
+  log_info("Closing connection\n", NULL);
+  if (!server_uses_uring && !s->expired) { // Removed by session_sweep else
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_DEL, s->client_fd, NULL);
+  }
+  connreg_remove(server_conns, s->conn); // Before its fd may be reused
+  close(s->in_fd);
+  close(s->out_fd);
+  if (close(s->client_fd) == -1) {
+    log_error("Error: Unable to close client socket\n", NULL);
+  }
+  shellctx_free(&s->executor.shell);
+
+  pthread_mutex_lock(&sessions_mutex);
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    sessions = s->next;
+  }
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+  pthread_mutex_unlock(&sessions_mutex);
 
-    log_info("Received %ld bytes\n", bytes_read);
+  if (s->parsing) {
+    parse_free(&s->parser);
+  }
+  lex_free(&s->lexer);
+  free(s->in);
+  free(s);
+}
 
-    lexer = lex_new(input);
-    parser = parse_new(&lexer);
-    executor.parser = &parser;
+/// @brief WorkFn: run the commands a session has input for
+static void session_run(void *arg) {
+  Session *s = (Session *)arg;
+  if (s->expired) {
+    if (session_alive(s)) {
+      send(s->client_fd, "Connection timed out\n", 21, MSG_NOSIGNAL);
+      log_info("Connection timed out\n", NULL);
+    }
+    session_close(s);
+    return;
+  }
 
-    while (1) {
-      ExecResult er = exec_next(&executor, in_fd, out_fd, server_prehook);
-      if (er.status == EXEC_PARSE_EOF) {
-        break;
+  bool going = true;
+  if (!s->greeted) {
+    session_greet(s);
+  }
+  if (s->executor.state == EXEC_STATE_RUNNING &&
+      !exec_resume(&s->executor)) {
+    return; // Parked again
+  }
+  if (s->executor.state == EXEC_STATE_REAPED) {
+    going = session_result(s, exec_finish(&s->executor));
+  }
+  while (going && session_alive(s)) {
+    if (s->prompt_sent < s->prompt_len) {
+      // The client did not take all of the prompt, the rest goes first
+      if (!session_send_prompt(s) && session_arm(s, false)) {
+        return;
       }
+      continue;
+    }
+    if (!session_has_line(s)) {
+      if (!server_uses_uring) {
+        session_recv(s); // The ring thread already copied it in
+      }
+      if (!session_has_line(s) && session_arm(s, true)) {
+        return;
+      }
+      continue; // Input came in, or the prompt went out short
+    }
+    if (!s->parsing) {
+      s->parser = parse_new(&s->lexer);
+      s->executor.parser = &s->parser;
+      s->parsing = true;
+    }
+    if (!exec_start(&s->executor, s->in_fd, s->out_fd, server_prehook,
+                    session_job_done, s)) {
+      return; // Parked, resumed by session_job_done, maybe already
+    }
+    going = session_result(s, exec_finish(&s->executor));
+  }
+  session_close(s);
+}
 
-      if (er.status == EXEC_PREHOOK_BREAK) {
-        if (er.prehook_result == SERVER_PHR_QUIT) {
-          log_info("Client requested exit\n", NULL);
-          is_eof = true;
-          break;
-        }
-        if (er.prehook_result == SERVER_PHR_HALT) {
-          log_info("Client requested halt\n", NULL);
-          server_running = false;
-          break;
-        }
-        if (er.prehook_result == SERVER_PHR_HELP) {
-          log_info("Client requested help\n", NULL);
-          const char *help = "Commands:\n"
-                             "  quit - Exit the shell\n"
-                             "  halt - Halt the server\n"
-                             "  help - Show this help\n"
-                             "  jobs - List all jobs\n"
-                             "  <cmd> - Run a command\n";
-          send(client_fd, help, strlen(help), 0);
-          continue;
-        }
+/// @brief Start serving an accepted connection (epoll or ring thread)
+static void session_open(int client_fd, struct sockaddr_in *client_addr,
+                         int timeout) {
+  log_info("Accepted connection from %s:%d\n",
+           inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+
+  Session *s = calloc(1, sizeof(Session));
+  assertf(s != NULL, "calloc failed", NULL);
+  s->client_fd = client_fd;
+  s->in_fd = fcntl(client_fd, F_DUPFD_CLOEXEC, 0);
+  s->out_fd = fcntl(client_fd, F_DUPFD_CLOEXEC, 0);
+  if (s->in_fd == -1 || s->out_fd == -1) {
+    log_error("Error: Unable to duplicate file descriptor\n", NULL);
+    close(client_fd);
+    if (s->in_fd != -1) {
+      close(s->in_fd);
+    }
+    free(s);
+    return;
+  }
+  s->timeout = timeout;
+  s->lexer = lex_new_stream((LexSource){.read = client_read, .ctx = s});
+  s->executor = executor_new(NULL, server_jobs);
+  s->executor.detach_output = true; // Workers are shared, clients may stall
+  s->state = SESSION_BUSY;
+  if (!shellctx_init(&s->executor.shell)) {
+    log_error("Error: Unable to set up the session: %s\n", strerror(errno));
+    close(s->in_fd);
+    close(s->out_fd);
+    close(client_fd);
+    lex_free(&s->lexer);
+    free(s);
+    return;
+  }
+  s->conn = connreg_add(server_conns, client_fd);
+  if (s->conn == 0) {
+    log_error("Error: Too many connections\n", NULL);
+    shellctx_free(&s->executor.shell);
+    close(s->in_fd);
+    close(s->out_fd);
+    close(client_fd);
+    lex_free(&s->lexer);
+    free(s);
+    return;
+  }
+
+  pthread_mutex_lock(&sessions_mutex);
+  s->next = sessions;
+  if (sessions != NULL) {
+    sessions->prev = s;
+  }
+  sessions = s;
+  pthread_mutex_unlock(&sessions_mutex);
+
+  if (!server_uses_uring) {
+    // Registered disarmed, the first run greets and arms it
+    struct epoll_event ev = {.events = EPOLLONESHOT, .data.ptr = s};
+    assertf(epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == 0,
+            "epoll_ctl failed", NULL);
+  }
+  workpool_push(server_pool, s);
+}
+
+/// @brief Accept the pending connections (epoll thread)
+static void server_accept(int server_fd, int timeout) {
+  while (true) {
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr,
+                            &client_addr_len, SOCK_CLOEXEC);
+    if (client_fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_error("Error: Unable to accept connection\n", NULL);
       }
+      return;
+    }
+    session_open(client_fd, &client_addr, timeout);
+  }
+}
 
-      switch (er.status) {
-      case EXEC_ERROR_FILE_OPEN:
-        log_error_fd(out_fd, "Unable to open file\n", NULL);
-        break;
-      case EXEC_PARSE_ERROR:
-        log_error_fd(out_fd, "Invalid Syntax\n", NULL);
-        break;
-      case EXEC_SEMANTIC_ERROR:
-        log_error_fd(out_fd, "Semantic Error: %s\n",
-                     get_semantic_reason(er.semantic_reason));
-        break;
-      case EXEC_PARSE_EOF:
-        break;
-      case EXEC_SUCCESS:
-        break;
-      case EXEC_IN_BACKGROUND:
-        break;
-      case EXEC_PIPELINE:
-        break;
-      case EXEC_PREHOOK_BREAK:
-        break;
+/// @brief Ring thread: a request finished
+static void server_complete(struct io_uring_cqe *cqe, int server_fd,
+                            int timeout) {
+  ServerOp op = cqe->user_data & SERVER_OP_MASK;
+  Session *s =
+      (Session *)(uintptr_t)(cqe->user_data & ~(uint64_t)SERVER_OP_MASK);
+  switch (op) {
+  case SERVER_OP_ACCEPT:
+    if (cqe->res >= 0) {
+      struct sockaddr_in client_addr = {0};
+      socklen_t client_addr_len = sizeof(client_addr);
+      getpeername(cqe->res, (struct sockaddr *)&client_addr, &client_addr_len);
+      session_open(cqe->res, &client_addr, timeout);
+    } else {
+      log_error("Error: Unable to accept connection\n", NULL);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      pthread_mutex_lock(&server_uring.lock);
+      server_submit(SERVER_OP_ACCEPT, server_fd);
+      uring_submit(&server_uring);
+      pthread_mutex_unlock(&server_uring.lock);
+    }
+    return;
+  case SERVER_OP_TICK:
+    pthread_mutex_lock(&server_uring.lock);
+    server_submit(SERVER_OP_TICK, server_fd);
+    uring_submit(&server_uring);
+    pthread_mutex_unlock(&server_uring.lock);
+    return;
+  case SERVER_OP_CANCEL:
+    return;
+  case SESSION_OP_RECV:
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (cqe->res > 0 && !s->expiring) {
+        session_reserve(s);
+        memcpy(s->in + s->in_len, uring_buffer(&server_uring, bid), cqe->res);
+        s->in_len += cqe->res;
       }
+      uring_buffer_return(&server_uring, bid);
+    }
+    if (s->expiring) {
+      session_wake(s, true); // The worker closes it
+      return;
     }
+    if (cqe->res > 0) {
+      log_info("Received %d bytes\n", cqe->res);
+    } else if (cqe->res == 0) {
+      log_info("Client disconnected\n", NULL);
+      s->eof = true;
+    } else {
+      session_recv(s); // Out of buffers or the prompt failed, read it plainly
+    }
+    session_wake(s, false);
+    return;
+  case SESSION_OP_SEND:
+  case SESSION_OP_FLUSH:
+    // Short or failed, a failed send has nothing more to send
+    s->prompt_sent = cqe->res >= 0 ? s->prompt_off + cqe->res : s->prompt_len;
+    if (op == SESSION_OP_SEND) {
+      return; // The linked read fails with it and wakes the session
+    }
+    session_wake(s, s->expiring);
+    return;
   }
+}
 
-  log_info("Closing connection\n", NULL);
-  if (close(client_fd) == -1) {
-    log_error("Error: Unable to close client socket\n", NULL);
+/// @brief Close the armed sessions that were aborted or timed out (epoll or
+/// ring thread), at most once a tick
+static void session_sweep(void) {
+  static struct timespec last;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long since_ms = (now.tv_sec - last.tv_sec) * 1000 +
+                  (now.tv_nsec - last.tv_nsec) / 1000000;
+  if (since_ms < SERVER_TICK_MS) {
+    return;
   }
-  conn_remove(client_fd);
-  return NULL;
+  last = now;
+  pthread_mutex_lock(&sessions_mutex);
+  for (Session *s = sessions; s != NULL; s = s->next) {
+    if (atomic_load(&s->state) != SESSION_ARMED) {
+      continue;
+    }
+    long idle_ms = (now.tv_sec - s->idle.tv_sec) * 1000 +
+                   (now.tv_nsec - s->idle.tv_nsec) / 1000000;
+    bool timed_out = s->timeout > 0 && idle_ms >= s->timeout * 1000L;
+    if (!timed_out && session_alive(s)) {
+      continue;
+    }
+    if (!server_uses_uring) {
+      // Out of epoll before a worker may free it: an event could still
+      // name it otherwise
+      epoll_ctl(server_epoll_fd, EPOLL_CTL_DEL, s->client_fd, NULL);
+      session_wake(s, true);
+    } else if (!s->expiring) {
+      session_cancel(s);
+    }
+  }
+  pthread_mutex_unlock(&sessions_mutex);
 }
 
-void server_fill_prompt(char *prompt, const char *prompt_fmt) {
-  char hostname[1024];
-  gethostname(hostname, sizeof(hostname));
-  char username[1024];
-  getlogin_r(username, sizeof(username));
-  char cwd[1024];
-  getcwd(cwd, sizeof(cwd));
-  char time_str[1024];
-  time_t t = time(NULL);
-  struct tm *tm = localtime(&t);
-  strftime(time_str, sizeof(time_str), "%H:%M:%S", tm);
-  sprintf(prompt, prompt_fmt, username, hostname, cwd, time_str);
-}
\ No newline at end of file
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef struct {
   char *host;
   int port;
   int timeout;
+  bool zygote; // Spawn commands from a helper forked at startup
+  bool uring;  // Serve sockets through io_uring, epoll if unavailable
+  size_t session_procs; // Processes per connection, 0 for no limit
+  size_t server_procs;  // Processes in total, 0 for no limit
 } rshsh_server_ctx;
 
 /// @brief Remote ShSh Server
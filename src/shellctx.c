@@ -0,0 +1,150 @@
+#define _GNU_SOURCE // O_PATH
+#include "shellctx.h"
+#include "panic.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern char **environ;
+
+ShellCtx shellctx_process(void) { return (ShellCtx){.dir_fd = AT_FDCWD}; }
+
+bool shellctx_init(ShellCtx *ctx) {
+  *ctx = (ShellCtx){.gen = 1};
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    return false;
+  }
+  ctx->dir_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (ctx->dir_fd == -1) {
+    return false;
+  }
+  ctx->cwd = strdup(cwd);
+  assertf(ctx->cwd != NULL, "strdup failed", NULL);
+
+  while (environ[ctx->env_len] != NULL) {
+    ctx->env_len++;
+  }
+  ctx->env = malloc((ctx->env_len + 1) * sizeof(char *));
+  assertf(ctx->env != NULL, "malloc failed", NULL);
+  for (size_t i = 0; i < ctx->env_len; i++) {
+    ctx->env[i] = strdup(environ[i]);
+    assertf(ctx->env[i] != NULL, "strdup failed", NULL);
+  }
+  ctx->env[ctx->env_len] = NULL;
+  return true;
+}
+
+void shellctx_free(ShellCtx *ctx) {
+  if (ctx->dir_fd != AT_FDCWD) {
+    close(ctx->dir_fd);
+  }
+  free(ctx->cwd);
+  for (size_t i = 0; i < ctx->env_len; i++) {
+    free(ctx->env[i]);
+  }
+  free(ctx->env);
+  *ctx = shellctx_process();
+}
+
+/// @brief Find the NAME=value entry of a variable
+/// @return Index, env_len if unset
+static size_t shellctx_find(const ShellCtx *ctx, const char *name) {
+  size_t len = strlen(name);
+  size_t i = 0;
+  while (i < ctx->env_len &&
+         (strncmp(ctx->env[i], name, len) != 0 || ctx->env[i][len] != '=')) {
+    i++;
+  }
+  return i;
+}
+
+/// @brief Set a variable of a private context
+static void shellctx_setenv(ShellCtx *ctx, const char *name,
+                            const char *value) {
+  char *entry;
+  assertf(asprintf(&entry, "%s=%s", name, value) != -1, "asprintf failed",
+          NULL);
+  size_t i = shellctx_find(ctx, name);
+  if (i < ctx->env_len) {
+    free(ctx->env[i]);
+    ctx->env[i] = entry;
+    return;
+  }
+  char **env = realloc(ctx->env, (ctx->env_len + 2) * sizeof(char *));
+  assertf(env != NULL, "realloc failed", NULL);
+  ctx->env = env;
+  ctx->env[ctx->env_len++] = entry;
+  ctx->env[ctx->env_len] = NULL;
+}
+
+/// @brief Path of a directory just opened from the context's
+/// @return Allocated path
+static char *shellctx_resolve(const ShellCtx *ctx, int fd, const char *path) {
+  char link[64];
+  char target[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, target, sizeof(target) - 1);
+  char *resolved;
+  if (n > 0) {
+    target[n] = '\0';
+    resolved = strdup(target);
+  } else if (path[0] == '/') {
+    resolved = strdup(path); // No /proc, keep it as it was written
+  } else {
+    assertf(asprintf(&resolved, "%s/%s", ctx->cwd, path) != -1,
+            "asprintf failed", NULL);
+  }
+  assertf(resolved != NULL, "strdup failed", NULL);
+  return resolved;
+}
+
+bool shellctx_chdir(ShellCtx *ctx, const char *path) {
+  if (ctx->dir_fd == AT_FDCWD) {
+    if (chdir(path) == -1) {
+      return false;
+    }
+    ctx->gen++;
+    return true;
+  }
+
+  int fd = openat(ctx->dir_fd, path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  // O_PATH needs no search permission on the directory, chdir does
+  if (faccessat(fd, ".", X_OK, 0) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return false;
+  }
+  char *cwd = shellctx_resolve(ctx, fd, path);
+  close(ctx->dir_fd);
+  ctx->dir_fd = fd;
+  shellctx_setenv(ctx, "OLDPWD", ctx->cwd);
+  shellctx_setenv(ctx, "PWD", cwd);
+  free(ctx->cwd);
+  ctx->cwd = cwd;
+  ctx->gen++;
+  return true;
+}
+
+const char *shellctx_cwd(const ShellCtx *ctx, char *buf, size_t cap) {
+  if (ctx->cwd != NULL) {
+    return ctx->cwd;
+  }
+  return getcwd(buf, cap);
+}
+
+const char *shellctx_getenv(const ShellCtx *ctx, const char *name) {
+  if (ctx->env == NULL) {
+    return getenv(name);
+  }
+  size_t i = shellctx_find(ctx, name);
+  return i < ctx->env_len ? ctx->env[i] + strlen(name) + 1 : NULL;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief Working directory and environment commands run with
+/// @details The REPL and scripts use the process ones, `cd` moves the whole
+/// process. A server session owns private ones instead: the directory is
+/// held as a descriptor that paths are opened against and that children
+/// change to, so sessions never move each other.
+typedef struct {
+  int dir_fd;   // O_PATH directory, AT_FDCWD for the process one
+  char *cwd;    // Path of dir_fd, NULL for the process one
+  char **env;   // NULL terminated, NULL for the process environment
+  size_t env_len;
+  unsigned gen; // Bumped by every directory change
+} ShellCtx;
+
+/// @brief Context of the process itself
+ShellCtx shellctx_process(void);
+
+/// @brief Create a private context, starting from the process directory
+/// and environment
+/// @note Allocates memory, so you must call shellctx_free when done
+/// @return is ok
+bool shellctx_init(ShellCtx *ctx);
+
+/// @brief Free a private context
+void shellctx_free(ShellCtx *ctx);
+
+/// @brief Change the working directory (`cd`)
+/// @details A private context also updates its PWD and OLDPWD.
+/// @return is ok, errno set on failure
+bool shellctx_chdir(ShellCtx *ctx, const char *path);
+
+/// @brief Get the working directory
+/// @param buf Used for the process directory only
+/// @return Path, NULL and errno set on failure
+const char *shellctx_cwd(const ShellCtx *ctx, char *buf, size_t cap);
+
+/// @brief Get an environment variable
+/// @return Value, NULL if unset
+const char *shellctx_getenv(const ShellCtx *ctx, const char *name);
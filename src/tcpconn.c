@@ -0,0 +1,297 @@
+#include "tcpconn.h"
+#include "panic.h"
+#include "workpool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TCP_EVENTS 64
+
+/// @brief Connection started by tcp_connect_start
+typedef struct TcpTask {
+  char *target; // Split in place into host and port
+  char *host;
+  char *port;
+  int timeout_ms;
+  struct addrinfo *addrs;
+  struct addrinfo *next_addr; // Tried once the current one fails
+  int fd;                     // Connect in flight, -1 if none
+  int err;                    // errno of the last address tried
+  struct timespec deadline;   // Of the connect in flight (CLOCK_MONOTONIC)
+  TcpDoneFn done;
+  void *arg;
+  struct TcpTask *prev, *next; // Queued, then in flight
+} TcpTask;
+
+/// @brief The connector: one thread waiting for every connect in epoll
+static struct {
+  pthread_once_t once;
+  pthread_mutex_t mutex;
+  int epoll_fd;
+  int wake_fd;            // eventfd, tasks were queued
+  TcpTask *queued;        // Resolved, not seen by the connector yet
+  TcpTask *flying;        // Connects in flight (connector only)
+  WorkPool *resolvers;    // Name lookups
+} tcp = {
+    .once = PTHREAD_ONCE_INIT,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .epoll_fd = -1,
+    .wake_fd = -1,
+};
+
+/// @brief Split `host:port` in place
+/// @return is ok
+static bool tcp_split(char *target, char **host, char **port) {
+  char *colon = strrchr(target, ':');
+  if (colon == NULL || colon == target || colon[1] == '\0') {
+    return false;
+  }
+  *colon = '\0';
+  *port = colon + 1;
+  *host = target;
+  size_t len = colon - target;
+  if (target[0] == '[' && len > 2 && target[len - 1] == ']') {
+    target[len - 1] = '\0';
+    *host = target + 1;
+  }
+  return true;
+}
+
+/// @brief Call done and free the task
+static void tcp_finish(TcpTask *task, int fd, const char *err) {
+  if (task->addrs != NULL) {
+    freeaddrinfo(task->addrs);
+  }
+  task->done(task->arg, fd, err);
+  free(task->target);
+  free(task);
+}
+
+/// @brief Milliseconds from now to a deadline, 0 if it passed
+static long tcp_left_ms(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+            (deadline->tv_nsec - now.tv_nsec) / 1000000;
+  return ms > 0 ? ms : 0;
+}
+
+static void tcp_fly(TcpTask *task) {
+  task->prev = NULL;
+  task->next = tcp.flying;
+  if (tcp.flying != NULL) {
+    tcp.flying->prev = task;
+  }
+  tcp.flying = task;
+}
+
+static void tcp_land(TcpTask *task) {
+  if (task->prev != NULL) {
+    task->prev->next = task->next;
+  } else {
+    tcp.flying = task->next;
+  }
+  if (task->next != NULL) {
+    task->next->prev = task->prev;
+  }
+}
+
+/// @brief Hand over a connected socket, made blocking for the commands
+static void tcp_connected(TcpTask *task, int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+    task->err = errno;
+    close(fd);
+    tcp_finish(task, -1, strerror(task->err));
+    return;
+  }
+  tcp_finish(task, fd, NULL);
+}
+
+/// @brief Start connecting the next address, or fail once none is left
+/// (connector)
+static void tcp_next(TcpTask *task) {
+  for (struct addrinfo *ai = task->next_addr; ai != NULL; ai = ai->ai_next) {
+    task->next_addr = ai->ai_next;
+    int fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+    if (fd == -1) {
+      task->err = errno;
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      tcp_connected(task, fd);
+      return;
+    }
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = task};
+    if (errno == EINPROGRESS &&
+        epoll_ctl(tcp.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+      task->fd = fd;
+      clock_gettime(CLOCK_MONOTONIC, &task->deadline);
+      task->deadline.tv_sec += task->timeout_ms / 1000;
+      task->deadline.tv_nsec += (task->timeout_ms % 1000) * 1000000L;
+      if (task->deadline.tv_nsec >= 1000000000L) {
+        task->deadline.tv_sec++;
+        task->deadline.tv_nsec -= 1000000000L;
+      }
+      tcp_fly(task);
+      return;
+    }
+    task->err = errno;
+    close(fd);
+  }
+  tcp_finish(task, -1, strerror(task->err));
+}
+
+/// @brief End the connect in flight of a task (connector)
+/// @param err 0 if it is made, errno of the failure else
+static void tcp_settle(TcpTask *task, int err) {
+  int fd = task->fd;
+  task->fd = -1;
+  tcp_land(task);
+  epoll_ctl(tcp.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  if (err == 0) {
+    tcp_connected(task, fd);
+    return;
+  }
+  task->err = err;
+  close(fd);
+  tcp_next(task);
+}
+
+static void *tcp_thread(void *arg __attribute__((unused))) {
+  struct epoll_event events[TCP_EVENTS];
+  while (true) {
+    long timeout = -1; // Until the nearest deadline
+    for (TcpTask *task = tcp.flying; task != NULL; task = task->next) {
+      long left = tcp_left_ms(&task->deadline);
+      timeout = timeout == -1 || left < timeout ? left : timeout;
+    }
+    int n = epoll_wait(tcp.epoll_fd, events, TCP_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      TcpTask *task = events[i].data.ptr;
+      if (task != NULL) {
+        int soerr = 0;
+        socklen_t len = sizeof(soerr);
+        if (getsockopt(task->fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == -1) {
+          soerr = errno;
+        }
+        tcp_settle(task, soerr);
+        continue;
+      }
+      uint64_t count;
+      if (read(tcp.wake_fd, &count, sizeof(count)) == -1) {
+        continue;
+      }
+      pthread_mutex_lock(&tcp.mutex);
+      TcpTask *queued = tcp.queued;
+      tcp.queued = NULL;
+      pthread_mutex_unlock(&tcp.mutex);
+      while (queued != NULL) {
+        TcpTask *next = queued->next;
+        tcp_next(queued);
+        queued = next;
+      }
+    }
+    for (TcpTask *task = tcp.flying, *next; task != NULL; task = next) {
+      next = task->next;
+      if (tcp_left_ms(&task->deadline) == 0) {
+        tcp_settle(task, ETIMEDOUT);
+      }
+    }
+  }
+  return NULL;
+}
+
+/// @brief Hand a resolved task to the connector
+static void tcp_queue(TcpTask *task) {
+  task->next_addr = task->addrs;
+  pthread_mutex_lock(&tcp.mutex);
+  task->next = tcp.queued;
+  tcp.queued = task;
+  pthread_mutex_unlock(&tcp.mutex);
+  uint64_t one = 1;
+  assertf(write(tcp.wake_fd, &one, sizeof(one)) == sizeof(one),
+          "eventfd write failed", NULL);
+}
+
+/// @brief Resolve a name (resolver thread)
+static int tcp_resolve(TcpTask *task, int flags) {
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = flags,
+  };
+  return getaddrinfo(task->host, task->port, &hints, &task->addrs);
+}
+
+/// @brief WorkFn: look a name up, then connect
+static void tcp_lookup(void *arg) {
+  TcpTask *task = arg;
+  int gai = tcp_resolve(task, 0);
+  if (gai != 0) {
+    task->addrs = NULL;
+    tcp_finish(task, -1, gai_strerror(gai));
+    return;
+  }
+  tcp_queue(task);
+}
+
+static void tcp_init(void) {
+  tcp.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  tcp.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  assertf(tcp.epoll_fd != -1 && tcp.wake_fd != -1, "connector setup failed",
+          NULL);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  assertf(epoll_ctl(tcp.epoll_fd, EPOLL_CTL_ADD, tcp.wake_fd, &ev) == 0,
+          "epoll_ctl failed", NULL);
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  assertf(pthread_create(&thread, &attr, tcp_thread, NULL) == 0,
+          "Unable to create connector thread", NULL);
+  pthread_attr_destroy(&attr);
+  tcp.resolvers = workpool_new(TCP_RESOLVERS, tcp_lookup);
+}
+
+void tcp_connect_start(const char *target, int timeout_ms, TcpDoneFn done,
+                       void *arg) {
+  pthread_once(&tcp.once, tcp_init);
+  TcpTask *task = calloc(1, sizeof(TcpTask));
+  assertf(task != NULL, "calloc failed", NULL);
+  task->target = strdup(target);
+  assertf(task->target != NULL, "strdup failed", NULL);
+  task->timeout_ms = timeout_ms;
+  task->fd = -1;
+  task->err = ECONNREFUSED;
+  task->done = done;
+  task->arg = arg;
+  if (!tcp_split(task->target, &task->host, &task->port)) {
+    tcp_finish(task, -1, "expected host:port");
+    return;
+  }
+  // Addresses and port numbers need no lookup, names wait for a resolver
+  int gai = tcp_resolve(task, AI_NUMERICHOST | AI_NUMERICSERV);
+  if (gai == 0) {
+    tcp_queue(task);
+    return;
+  }
+  task->addrs = NULL;
+  if (gai != EAI_NONAME) {
+    tcp_finish(task, -1, gai_strerror(gai));
+    return;
+  }
+  workpool_push(tcp.resolvers, task);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#define TCP_CONNECT_TIMEOUT_MS 5000
+#define TCP_RESOLVERS 2 // Threads looking names up
+
+/// @brief Called once a connection started by tcp_connect_start is made or
+/// failed
+/// @param fd Connected socket, -1 on failure
+/// @param err Reason of a failure, a static string
+typedef void (*TcpDoneFn)(void *arg, int fd, const char *err);
+
+/// @brief Connect to a TCP endpoint without blocking the caller
+/// @details Numeric addresses are parsed on the spot, names are looked up
+/// on a resolver thread. Each address is tried with a non-blocking connect
+/// bounded by timeout_ms, waited for in epoll by one connector thread. The
+/// socket is handed over blocking and close-on-exec, ready to be a
+/// command's stdin or stdout.
+/// @param target `host:port`, host may be a name or an IPv4/IPv6 address
+/// (IPv6 in brackets)
+/// @param timeout_ms Per address connect timeout
+/// @param done Called once it is over, on the connector or a resolver, or
+/// right away on this thread if the target cannot be parsed. It must not
+/// block.
+void tcp_connect_start(const char *target, int timeout_ms, TcpDoneFn done,
+                       void *arg);
@@ -43,13 +43,28 @@ Slice slice_substr(Slice s, size_t start, size_t end) {
 }
 
 SliceVec slice_vec_new(void) {
-  return (SliceVec){.data = NULL, .len = 0, .cap = 0};
+  return (SliceVec){.data = NULL, .len = 0, .cap = 0, .arena = NULL};
+}
+
+SliceVec slice_vec_new_in(Arena *arena) {
+  return (SliceVec){.data = NULL, .len = 0, .cap = 0, .arena = arena};
 }
 
 void slice_vec_push(SliceVec *vec, Slice s) {
   if (vec->len == vec->cap) {
-    int new_cap = vec->cap == 0 ? 1 : vec->cap * 2;
-    Slice *new_data = realloc(vec->data, new_cap * sizeof(Slice));
+    Slice *new_data;
+    size_t new_cap;
+    if (vec->arena != NULL) {
+      // Outgrown arena storage is simply abandoned until the reset
+      new_cap = vec->cap == 0 ? 8 : vec->cap * 2;
+      new_data = arena_alloc(vec->arena, new_cap * sizeof(Slice));
+      if (vec->len != 0) {
+        memcpy(new_data, vec->data, vec->len * sizeof(Slice));
+      }
+    } else {
+      new_cap = vec->cap == 0 ? 1 : vec->cap * 2;
+      new_data = realloc(vec->data, new_cap * sizeof(Slice));
+    }
     if (new_data == NULL)
       return;
     vec->data = new_data;
@@ -59,7 +74,9 @@ void slice_vec_push(SliceVec *vec, Slice s) {
 }
 
 void slice_vec_free(SliceVec *vec) {
-  free(vec->data);
+  if (vec->arena == NULL) {
+    free(vec->data);
+  }
   vec->data = NULL;
   vec->len = 0;
   vec->cap = 0;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "arena.h"
 #include <alloca.h>
 #include <sys/types.h>
 
@@ -45,10 +46,14 @@ typedef struct {
   Slice *data;
   size_t len;
   size_t cap;
+  Arena *arena; // Allocate from the arena instead of the heap when set
 } SliceVec;
 
 /// @brief Create a new slice vector
 SliceVec slice_vec_new(void);
+/// @brief Create a new slice vector allocated from an arena
+/// @note The data lives until the arena is reset, slice_vec_free is a no-op
+SliceVec slice_vec_new_in(Arena *arena);
 /// @brief Append a slice to a slice vector
 void slice_vec_push(SliceVec *vec, Slice s);
 /// @brief Free a slice vector
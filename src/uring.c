@@ -0,0 +1,190 @@
+#include "uring.h"
+#include "panic.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+                          unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_init(Uring *u, unsigned entries) {
+  memset(u, 0, sizeof(Uring));
+  struct io_uring_params p = {
+      .flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP,
+      .cq_entries = entries * 4,
+  };
+  u->fd = uring_setup(entries, &p);
+  if (u->fd == -1) {
+    return false;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    close(u->fd);
+    return false; // Older than the buffer rings anyway
+  }
+
+  // One mapping holds both rings, the entries are mapped apart
+  u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_len > u->sq_map_len) {
+    u->sq_map_len = cq_len;
+  }
+  u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sq_map == MAP_FAILED || u->sqes == MAP_FAILED) {
+    if (u->sq_map != MAP_FAILED) {
+      munmap(u->sq_map, u->sq_map_len);
+    }
+    close(u->fd);
+    return false;
+  }
+  u->cq_map = u->sq_map;
+
+  char *sq = u->sq_map;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  char *cq = u->cq_map;
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  assertf(pthread_mutex_init(&u->lock, NULL) == 0, "mutex init failed", NULL);
+  return true;
+}
+
+void uring_free(Uring *u) {
+  close(u->fd); // Cancels what is still pending
+  munmap(u->sqes, u->sqes_len);
+  munmap(u->sq_map, u->sq_map_len);
+  if (u->buf_ring != NULL) {
+    munmap(u->buf_ring, u->buf_ring_len);
+    munmap(u->bufs, u->nbufs * u->buf_size);
+  }
+  pthread_mutex_destroy(&u->lock);
+}
+
+bool uring_buffers(Uring *u, unsigned nbufs, size_t size, uint16_t group) {
+  assertf((nbufs & (nbufs - 1)) == 0, "buffer count must be a power of 2",
+          NULL);
+  u->buf_ring_len = nbufs * sizeof(struct io_uring_buf);
+  u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  u->bufs = mmap(NULL, nbufs * size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->buf_ring == MAP_FAILED || u->bufs == MAP_FAILED) {
+    if (u->buf_ring != MAP_FAILED) {
+      munmap(u->buf_ring, u->buf_ring_len);
+    }
+    u->buf_ring = NULL;
+    return false;
+  }
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (uintptr_t)u->buf_ring,
+      .ring_entries = nbufs,
+      .bgid = group,
+  };
+  if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    munmap(u->buf_ring, u->buf_ring_len);
+    munmap(u->bufs, nbufs * size);
+    u->buf_ring = NULL;
+    return false;
+  }
+  u->nbufs = nbufs;
+  u->buf_size = size;
+  u->buf_group = group;
+  for (unsigned bid = 0; bid < nbufs; bid++) {
+    uring_buffer_return(u, bid);
+  }
+  return true;
+}
+
+char *uring_buffer(Uring *u, unsigned bid) {
+  return u->bufs + (size_t)bid * u->buf_size;
+}
+
+void uring_buffer_return(Uring *u, unsigned bid) {
+  // The tail overlays the reserved field of the first entry, so the
+  // entries are written field by field
+  uint16_t tail = u->buf_ring->tail;
+  struct io_uring_buf *buf = &u->buf_ring->bufs[tail & (u->nbufs - 1)];
+  buf->addr = (uintptr_t)uring_buffer(u, bid);
+  buf->len = u->buf_size;
+  buf->bid = bid;
+  __atomic_store_n(&u->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *uring_sqe(Uring *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *u->sq_tail + u->sq_pending;
+  if (tail - head > u->sq_mask) {
+    uring_submit(u);
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    tail = *u->sq_tail;
+    if (tail - head > u->sq_mask) {
+      return NULL;
+    }
+  }
+  unsigned index = tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[index] = index;
+  u->sq_pending++;
+  return sqe;
+}
+
+bool uring_submit(Uring *u) {
+  if (u->sq_pending == 0) {
+    return true;
+  }
+  __atomic_store_n(u->sq_tail, *u->sq_tail + u->sq_pending, __ATOMIC_RELEASE);
+  unsigned n = u->sq_pending;
+  u->sq_pending = 0;
+  while (n > 0) {
+    int r = uring_enter(u->fd, n, 0, 0);
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    n -= r;
+  }
+  return true;
+}
+
+size_t uring_wait(Uring *u, struct io_uring_cqe *out, size_t cap) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    if (uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1) {
+      assertf(errno == EINTR, "io_uring_enter failed", NULL);
+      return 0;
+    }
+  }
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  size_t n = 0;
+  for (; head != tail && n < cap; head++) {
+    out[n++] = u->cqes[head & u->cq_mask];
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief io_uring instance, driven through the raw system calls
+/// @details Submissions may come from any thread, they serialize on the
+/// lock. Completions and the provided buffers belong to one thread.
+typedef struct {
+  int fd;
+  pthread_mutex_t lock; // Submission queue
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_pending; // Filled in, not submitted yet
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  size_t sqes_len;
+
+  // Provided buffers the kernel picks from for IOSQE_BUFFER_SELECT
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_len;
+  char *bufs;
+  size_t buf_size;
+  unsigned nbufs;
+  uint16_t buf_group;
+} Uring;
+
+/// @brief Set up a ring
+/// @param entries Submission queue size, the completion queue is 4 times it
+/// @return is ok, false if io_uring is not available
+bool uring_init(Uring *u, unsigned entries);
+
+/// @brief Tear down a ring, pending requests are cancelled
+void uring_free(Uring *u);
+
+/// @brief Register a group of provided buffers
+/// @param nbufs Number of buffers, a power of 2
+/// @param size Size of each buffer
+/// @param group Buffer group id for sqe->buf_group
+/// @return is ok
+bool uring_buffers(Uring *u, unsigned nbufs, size_t size, uint16_t group);
+
+/// @brief Address of a provided buffer
+/// @param bid Buffer id from a completion's flags
+char *uring_buffer(Uring *u, unsigned bid);
+
+/// @brief Give a provided buffer back to the kernel (completion thread)
+void uring_buffer_return(Uring *u, unsigned bid);
+
+/// @brief Take the next free submission entry, zeroed
+/// @details Submits the queued entries first if the queue is full.
+/// @note Must be called with the lock held
+struct io_uring_sqe *uring_sqe(Uring *u);
+
+/// @brief Submit the queued entries
+/// @note Must be called with the lock held
+/// @return is ok
+bool uring_submit(Uring *u);
+
+/// @brief Wait for completions and copy them out
+/// @param out Completions
+/// @param cap Capacity of out
+/// @return Number of completions, 0 if interrupted
+size_t uring_wait(Uring *u, struct io_uring_cqe *out, size_t cap);
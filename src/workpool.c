@@ -0,0 +1,99 @@
+#include "workpool.h"
+#include "panic.h"
+#include <stdlib.h>
+
+static void workpool_lock(WorkPool *pool) {
+  assertf(pthread_mutex_lock(&pool->mutex) == 0, "mutex lock failed", NULL);
+}
+
+static void workpool_unlock(WorkPool *pool) {
+  assertf(pthread_mutex_unlock(&pool->mutex) == 0, "mutex unlock failed",
+          NULL);
+}
+
+static void *workpool_thread(void *arg) {
+  WorkPool *pool = arg;
+  workpool_lock(pool);
+  while (true) {
+    while (pool->len == 0 && !pool->stopping) {
+      pthread_cond_wait(&pool->ready, &pool->mutex);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    void *item = pool->items[pool->head];
+    pool->head = (pool->head + 1) % pool->cap;
+    pool->len--;
+    workpool_unlock(pool);
+    pool->run(item);
+    workpool_lock(pool);
+  }
+  workpool_unlock(pool);
+  return NULL;
+}
+
+WorkPool *workpool_new(size_t threads, WorkFn run) {
+  WorkPool *pool = calloc(1, sizeof(WorkPool));
+  assertf(pool != NULL, "calloc failed", NULL);
+  assertf(pthread_mutex_init(&pool->mutex, NULL) == 0, "mutex init failed",
+          NULL);
+  assertf(pthread_cond_init(&pool->ready, NULL) == 0, "cond init failed",
+          NULL);
+  pool->run = run;
+  pool->cap = 64;
+  pool->items = malloc(pool->cap * sizeof(void *));
+  pool->threads = malloc(threads * sizeof(pthread_t));
+  assertf(pool->items != NULL && pool->threads != NULL, "malloc failed",
+          NULL);
+  for (size_t i = 0; i < threads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, workpool_thread, pool) != 0) {
+      panic("Error: Unable to create worker thread\n");
+    }
+  }
+  pool->nthreads = threads;
+  return pool;
+}
+
+void workpool_push(WorkPool *pool, void *item) {
+  workpool_lock(pool);
+  if (pool->stopping) {
+    workpool_unlock(pool);
+    return;
+  }
+  if (pool->len == pool->cap) {
+    // Unwrap the ring into a larger one
+    void **items = malloc(pool->cap * 2 * sizeof(void *));
+    assertf(items != NULL, "malloc failed", NULL);
+    for (size_t i = 0; i < pool->len; i++) {
+      items[i] = pool->items[(pool->head + i) % pool->cap];
+    }
+    free(pool->items);
+    pool->items = items;
+    pool->head = 0;
+    pool->cap *= 2;
+  }
+  pool->items[(pool->head + pool->len) % pool->cap] = item;
+  pool->len++;
+  pthread_cond_signal(&pool->ready);
+  workpool_unlock(pool);
+}
+
+void workpool_stop(WorkPool *pool) {
+  workpool_lock(pool);
+  pool->stopping = true;
+  pool->len = 0;
+  pthread_cond_broadcast(&pool->ready);
+  workpool_unlock(pool);
+  for (size_t i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pool->nthreads = 0;
+}
+
+void workpool_free(WorkPool *pool) {
+  free(pool->threads);
+  free(pool->items);
+  pthread_cond_destroy(&pool->ready);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief Work item handler, runs on a pool thread
+typedef void (*WorkFn)(void *item);
+
+/// @brief Fixed set of threads running queued items in FIFO order
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t ready; // An item was queued or the pool is stopping
+  void **items;         // Ring of queued items
+  size_t head;
+  size_t len;
+  size_t cap;
+  bool stopping;
+  WorkFn run;
+  pthread_t *threads;
+  size_t nthreads;
+} WorkPool;
+
+/// @brief Create a pool and start its threads
+/// @param threads Number of threads, at least 1
+/// @param run Handler of the items
+/// @note Allocates memory, so you must call workpool_free when done
+WorkPool *workpool_new(size_t threads, WorkFn run);
+
+/// @brief Queue an item, does not block
+/// @details Items pushed once the pool is stopping are dropped.
+void workpool_push(WorkPool *pool, void *item);
+
+/// @brief Let the running items finish, drop the queued ones and join the
+/// threads
+void workpool_stop(WorkPool *pool);
+
+/// @brief Free a stopped pool
+void workpool_free(WorkPool *pool);
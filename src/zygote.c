@@ -0,0 +1,453 @@
+#define _GNU_SOURCE // O_PATH
+#include "zygote.h"
+#include "log.h"
+#include "panic.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef enum {
+  ZYGOTE_SPAWN,
+  ZYGOTE_HOLD,
+  ZYGOTE_RELEASE,
+} ZygoteOp;
+
+/// @brief Request header
+/// @details A spawn request is followed by the path (if has_path), argc
+/// arguments and envc environment entries, all NUL terminated. It carries
+/// the stdin, stdout and working directory descriptors.
+typedef struct {
+  uint32_t op; // ZygoteOp
+  int32_t pgid;
+  uint32_t argc;
+  uint32_t envc; // 0 for the helper's environment
+  uint32_t has_path;
+} ZygoteRequest;
+
+typedef struct {
+  int32_t pid; // -1 on failure
+  int32_t err; // errno of the failure
+} ZygoteReply;
+
+typedef struct {
+  int32_t pid;
+  int32_t status;
+  struct rusage ru;
+} ZygoteExit;
+
+/// @brief Reply to ZYGOTE_HOLD
+typedef struct {
+  uint64_t reaped; // Exits reaped so far, none until the release
+} ZygoteHeld;
+
+static struct {
+  pid_t pid; // Helper, -1 when not running
+  SpawnBackend backend; // Used by the helper, restored by zygote_stop
+  int req_fd;
+  int event_fd;
+  pthread_mutex_t lock; // One request in flight
+} zygote = {
+    .pid = -1,
+    .req_fd = -1,
+    .event_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// @brief Take the next NUL terminated string of a payload
+/// @return String, NULL if the payload ends first
+static char *zygote_next_str(char **p, char *end) {
+  char *s = *p;
+  char *nul = memchr(s, '\0', end - s);
+  if (nul == NULL) {
+    return NULL;
+  }
+  *p = nul + 1;
+  return s;
+}
+
+/// @brief Spawn the command of a request (helper side)
+static ZygoteReply zygote_do_spawn(const ZygoteRequest *h, char *p, char *end,
+                                   int fds[3]) {
+  char *path = h->has_path ? zygote_next_str(&p, end) : NULL;
+  if ((h->has_path && path == NULL) || h->argc == 0 ||
+      h->argc + h->envc > ZYGOTE_MSG_MAX / 2) {
+    return (ZygoteReply){.pid = -1, .err = EINVAL};
+  }
+  char *argv[h->argc + 1];
+  for (uint32_t i = 0; i < h->argc; i++) {
+    if ((argv[i] = zygote_next_str(&p, end)) == NULL) {
+      return (ZygoteReply){.pid = -1, .err = EINVAL};
+    }
+  }
+  argv[h->argc] = NULL;
+  char *envp[h->envc + 1];
+  for (uint32_t i = 0; i < h->envc; i++) {
+    if ((envp[i] = zygote_next_str(&p, end)) == NULL) {
+      return (ZygoteReply){.pid = -1, .err = EINVAL};
+    }
+  }
+  envp[h->envc] = NULL;
+
+  SpawnRequest req = {
+      .path = path,
+      .argv = argv,
+      .stdin_fd = fds[0],
+      .stdout_fd = fds[1],
+      .pgid = h->pgid,
+      .log_fd = STDERR_FILENO,
+      .dir_fd = fds[2],
+      .envp = h->envc != 0 ? envp : NULL,
+  };
+  pid_t pid = spawn_command(&req);
+  return (ZygoteReply){.pid = pid, .err = pid == -1 ? errno : 0};
+}
+
+/// @brief Serve one request (helper side)
+/// @param reaped Exits reaped so far, for the reply to a hold
+/// @return false once the server is gone
+static bool zygote_serve(int req_fd, unsigned *holds, uint64_t reaped) {
+  char buf[ZYGOTE_MSG_MAX];
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+  ssize_t n = recvmsg(req_fd, &msg, MSG_CMSG_CLOEXEC);
+  if (n == -1 && errno == EINTR) {
+    return true;
+  }
+  if (n <= 0) {
+    return false;
+  }
+
+  int fds[3] = {-1, -1, -1};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+      c->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+  }
+  if ((size_t)n < sizeof(ZygoteRequest)) {
+    return true;
+  }
+  ZygoteRequest h;
+  memcpy(&h, buf, sizeof(h));
+
+  switch (h.op) {
+  case ZYGOTE_HOLD: {
+    (*holds)++;
+    ZygoteHeld reply = {.reaped = reaped};
+    if (send(req_fd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) {
+      return false;
+    }
+    break;
+  }
+  case ZYGOTE_RELEASE:
+    (*holds)--;
+    break;
+  case ZYGOTE_SPAWN: {
+    ZygoteReply reply = {.pid = -1, .err = EBADF};
+    if (fds[2] != -1) {
+      reply = zygote_do_spawn(&h, buf + sizeof(h), buf + n, fds);
+    }
+    if (send(req_fd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) {
+      return false;
+    }
+    break;
+  }
+  }
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] != -1) {
+      close(fds[i]);
+    }
+  }
+  return true;
+}
+
+/// @brief Exits reaped but not sent yet (helper side)
+typedef struct {
+  ZygoteExit *exits;
+  size_t head; // Next to send
+  size_t len;
+  size_t cap;
+  uint64_t reaped; // Ever queued
+} ZygoteQueue;
+
+/// @brief Reap the children and queue their exits (helper side)
+static void zygote_reap(ZygoteQueue *q) {
+  ZygoteExit e;
+  pid_t pid;
+  while ((pid = wait4(-1, &e.status, WNOHANG | WUNTRACED | WCONTINUED,
+                      &e.ru)) > 0) {
+    e.pid = pid;
+    if (q->len == q->cap) {
+      q->cap = q->cap == 0 ? 64 : q->cap * 2;
+      q->exits = realloc(q->exits, q->cap * sizeof(ZygoteExit));
+      assertf(q->exits != NULL, "realloc failed", NULL);
+    }
+    q->exits[q->len++] = e;
+    q->reaped++;
+  }
+}
+
+/// @brief Send the queued exits, as many as the socket takes (helper side)
+/// @details Never blocks: the server may be waiting for a spawn reply while
+/// its reaper waits for the spawner, and nobody would read the events.
+static void zygote_flush(ZygoteQueue *q, int event_fd) {
+  while (q->head < q->len && send(event_fd, &q->exits[q->head],
+                                  sizeof(ZygoteExit), MSG_NOSIGNAL) != -1) {
+    q->head++;
+  }
+  if (q->head == q->len) {
+    q->head = 0;
+    q->len = 0;
+  }
+}
+
+/// @brief ^C is meant for the server, not the helper
+/// @details A handler rather than SIG_IGN, so children get the default
+/// action back on exec, as they do when the server spawns them.
+static void zygote_on_sigint(int sig __attribute__((unused))) {}
+
+/// @brief Main loop of the helper
+static void zygote_main(int req_fd, int event_fd) {
+  signal(SIGINT, zygote_on_sigint);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  int sig_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  assertf(sig_fd != -1, "signalfd failed", NULL);
+
+  unsigned holds = 0;
+  ZygoteQueue queue = {0};
+  struct pollfd pfd[3] = {
+      {.fd = req_fd, .events = POLLIN},
+      {.fd = sig_fd, .events = POLLIN},
+      {.fd = event_fd, .events = POLLOUT},
+  };
+  while (true) {
+    // Wait for room on the event socket only while exits are queued
+    if (poll(pfd, queue.len != 0 ? 3 : 2, -1) == -1) {
+      assertf(errno == EINTR, "poll failed", NULL);
+      continue;
+    }
+    if (pfd[1].revents != 0) {
+      struct signalfd_siginfo info[16];
+      while (read(sig_fd, info, sizeof(info)) > 0) {
+      }
+    }
+    if (pfd[0].revents != 0 &&
+        !zygote_serve(req_fd, &holds, queue.reaped)) {
+      break;
+    }
+    if (holds == 0) {
+      zygote_reap(&queue);
+    }
+    zygote_flush(&queue, event_fd);
+  }
+  _exit(0);
+}
+
+bool zygote_start(void) {
+  int req[2], events[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, req) == -1) {
+    return false;
+  }
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, events) == -1) {
+    close(req[0]);
+    close(req[1]);
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(req[0]);
+    close(req[1]);
+    close(events[0]);
+    close(events[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(req[0]);
+    close(events[0]);
+    assertf(fcntl(events[1], F_SETFL, O_NONBLOCK) == 0, "fcntl failed", NULL);
+    zygote_main(req[1], events[1]);
+  }
+
+  close(req[1]);
+  close(events[1]);
+  zygote.pid = pid;
+  zygote.backend = spawn_backend;
+  zygote.req_fd = req[0];
+  zygote.event_fd = events[0];
+  assertf(fcntl(zygote.event_fd, F_SETFL, O_NONBLOCK) == 0, "fcntl failed",
+          NULL);
+  spawn_backend = SPAWN_ZYGOTE;
+  log_info("Spawn helper started with PID %d\n", pid);
+  return true;
+}
+
+void zygote_stop(void) {
+  if (zygote.pid == -1) {
+    return;
+  }
+  spawn_backend = zygote.backend;
+  close(zygote.req_fd); // The helper exits on EOF
+  waitpid(zygote.pid, NULL, 0);
+  close(zygote.event_fd);
+  zygote.pid = -1;
+  zygote.req_fd = -1;
+  zygote.event_fd = -1;
+}
+
+/// @brief Append a NUL terminated string to a payload
+/// @return is ok, false if it does not fit
+static bool zygote_put_str(char *buf, size_t *len, const char *s) {
+  size_t n = strlen(s) + 1;
+  if (*len + n > ZYGOTE_MSG_MAX) {
+    return false;
+  }
+  memcpy(buf + *len, s, n);
+  *len += n;
+  return true;
+}
+
+/// @brief Send a request with nfds descriptors
+/// @note Must be called with the lock held
+/// @return is ok
+static bool zygote_send(const void *buf, size_t len, const int *fds,
+                        size_t nfds) {
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  if (nfds != 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+  }
+  ssize_t n;
+  while ((n = sendmsg(zygote.req_fd, &msg, MSG_NOSIGNAL)) == -1 &&
+         errno == EINTR) {
+  }
+  return n == (ssize_t)len;
+}
+
+pid_t zygote_spawn(const SpawnRequest *req) {
+  char buf[ZYGOTE_MSG_MAX];
+  size_t len = sizeof(ZygoteRequest);
+  int argc = 0, envc = 0;
+  bool fits = req->path == NULL || zygote_put_str(buf, &len, req->path);
+  for (; fits && req->argv[argc] != NULL; argc++) {
+    fits = zygote_put_str(buf, &len, req->argv[argc]);
+  }
+  for (; fits && req->envp != NULL && req->envp[envc] != NULL; envc++) {
+    fits = zygote_put_str(buf, &len, req->envp[envc]);
+  }
+  if (!fits) {
+    errno = E2BIG;
+    return -1;
+  }
+  ZygoteRequest h = {
+      .op = ZYGOTE_SPAWN,
+      .pgid = req->pgid,
+      .argc = argc,
+      .envc = envc,
+      .has_path = req->path != NULL,
+  };
+  memcpy(buf, &h, sizeof(h));
+
+  // The helper never changes directory, the child enters the one it is
+  // handed, ours if the request has none
+  int dir_fd = req->dir_fd;
+  if (dir_fd == AT_FDCWD &&
+      (dir_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    return -1;
+  }
+  int fds[3] = {req->stdin_fd, req->stdout_fd, dir_fd};
+  ZygoteReply reply = {.pid = -1, .err = EPIPE};
+  assertf(pthread_mutex_lock(&zygote.lock) == 0, "mutex lock failed", NULL);
+  if (zygote_send(buf, len, fds, 3)) {
+    ssize_t n;
+    while ((n = recv(zygote.req_fd, &reply, sizeof(reply), 0)) == -1 &&
+           errno == EINTR) {
+    }
+    if (n != sizeof(reply)) {
+      reply = (ZygoteReply){.pid = -1, .err = EPIPE};
+    }
+  }
+  pthread_mutex_unlock(&zygote.lock);
+  if (dir_fd != req->dir_fd) {
+    close(dir_fd);
+  }
+  if (reply.pid == -1) {
+    errno = reply.err;
+  }
+  return reply.pid;
+}
+
+uint64_t zygote_hold(void) {
+  if (zygote.pid == -1) {
+    return 0;
+  }
+  ZygoteRequest h = {.op = ZYGOTE_HOLD};
+  ZygoteHeld reply = {0};
+  assertf(pthread_mutex_lock(&zygote.lock) == 0, "mutex lock failed", NULL);
+  if (zygote_send(&h, sizeof(h), NULL, 0)) {
+    ssize_t n;
+    while ((n = recv(zygote.req_fd, &reply, sizeof(reply), 0)) == -1 &&
+           errno == EINTR) {
+    }
+    if (n != sizeof(reply)) {
+      reply.reaped = 0; // The helper is gone, it reaps nothing more
+    }
+  }
+  pthread_mutex_unlock(&zygote.lock);
+  return reply.reaped;
+}
+
+void zygote_release(void) {
+  if (zygote.pid == -1) {
+    return;
+  }
+  ZygoteRequest h = {.op = ZYGOTE_RELEASE};
+  assertf(pthread_mutex_lock(&zygote.lock) == 0, "mutex lock failed", NULL);
+  zygote_send(&h, sizeof(h), NULL, 0);
+  pthread_mutex_unlock(&zygote.lock);
+}
+
+int zygote_events_fd(void) { return zygote.event_fd; }
+
+bool zygote_read_exit(pid_t *pid, int *status, struct rusage *ru) {
+  ZygoteExit e;
+  ssize_t n;
+  while ((n = recv(zygote.event_fd, &e, sizeof(e), 0)) == -1 &&
+         errno == EINTR) {
+  }
+  if (n != sizeof(e)) {
+    return false;
+  }
+  *pid = e.pid;
+  *status = e.status;
+  *ru = e.ru;
+  return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "procspawn.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#define ZYGOTE_MSG_MAX 65536 // Larger requests are spawned locally
+
+/// @brief Fork the spawn helper and route spawn_command through it
+/// @details The helper is forked while the caller is still small and
+/// single-threaded, so later spawns never copy a large or locked address
+/// space. Requests travel over a SOCK_SEQPACKET socketpair with the stdio
+/// and working directory descriptors attached as SCM_RIGHTS. The helper
+/// reaps its children and reports their exits on a second socketpair, read
+/// by the reaper. Exits the socket has no room for are queued in the
+/// helper, which never blocks on the server.
+/// Must run before any thread is created and before reaper_start.
+/// @return is ok
+bool zygote_start(void);
+
+/// @brief Stop the spawn helper
+void zygote_stop(void);
+
+/// @brief Spawn a command from the helper
+/// @return pid of the child, -1 and errno set (E2BIG if the request does not
+/// fit in a message)
+pid_t zygote_spawn(const SpawnRequest *req);
+
+/// @brief Keep the helper from reaping until zygote_release
+/// @details See reaper_hold. The exits it reaped before are still to be
+/// read with zygote_read_exit, their pids may already be reused.
+/// @return Exits the helper reaped so far, 0 if there is no helper
+uint64_t zygote_hold(void);
+
+/// @brief Let the helper reap again
+void zygote_release(void);
+
+/// @brief Descriptor readable when the helper reported exits
+/// @return -1 if there is no helper
+int zygote_events_fd(void);
+
+/// @brief Read one exit reported by the helper
+/// @return is there one, false when none is pending
+bool zygote_read_exit(pid_t *pid, int *status, struct rusage *ru);
@@ -0,0 +1,23 @@
+#!/bin/sh
+# memo must not replay a pipeline that read another stdin the first time.
+# Usage: tests/memo_stdin.sh path/to/shsh
+set -eu
+
+shsh=$1
+dir=$(mktemp -d /tmp/shsh-test-XXXXXX)
+trap 'rm -rf "$dir"' EXIT
+export XDG_CACHE_HOME="$dir"
+printf 'memo cat\n' > "$dir/script.sh"
+
+# Piped stdin is part of no key, so each run must see its own. Logs go to
+# stdout too, so look for the line
+for input in first second; do
+  printf '%s\n' "$input" | "$shsh" "$dir/script.sh" 2>/dev/null |
+    grep -qx "$input" || { echo "memo_stdin: $input not read"; exit 1; }
+done
+
+# /dev/null gives the same nothing every time, that is still cached
+printf 'memo echo cached\n' > "$dir/script.sh"
+"$shsh" "$dir/script.sh" < /dev/null > /dev/null 2>&1
+[ -n "$(ls "$dir/shsh/memo")" ] || { echo "memo_stdin: not cached"; exit 1; }
+echo "memo_stdin: ok"